@@ -26,6 +26,9 @@
 #include <stdint.h>
 #include <ctype.h>
 #include <wchar.h>
+#ifdef _WIN32
+#include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "charset.h"
@@ -310,3 +313,15 @@ void print_hex_dump(log_module_level_t level, const char *prefix_str,
 		LOG(lm_main, level, ("%s%s\n", prefix_str, linebuf));
         }
 }
+
+int get_processor_count(void)
+{
+#if defined(_WIN32)
+    return max(pthread_num_processors_np(), 1);
+#elif defined(__lv2ppu__)
+    return 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#endif
+}
@@ -58,6 +58,7 @@
 #endif
 
 #include <logging.h>
+#include <timeout.h>
 
 #include "dst_decoder.h"
 #include "yarn.h"
@@ -71,14 +72,21 @@
 
 /* -- parallel decoding -- */
 
+/* most frames decoded by a single job, one second of audio */
+#define JOB_MAX_FRAMES 75
+
 /* decode or write job (passed from decode list to write list) -- if seq is
    equal to -1, decode_thread is instructed to return; if more is false then
    this is the last chunk, which after writing tells write_thread to return */
 typedef struct job_t
 {
     long seq;                                 /* sequence number */
-    int error;                                /* an error code (eg. DST decoding error) */
     int more;                                 /* true if this is not the last chunk */
+    int frames;                               /* number of frames in the job */
+    long first_frame;                         /* frame number of the first frame */
+    size_t frame_size[JOB_MAX_FRAMES];        /* size of each DST frame in the input */
+    int error[JOB_MAX_FRAMES];                /* an error code for each frame (eg. DST decoding error) */
+    double decode_time;                       /* time it took to decode the frames */
     buffer_pool_space_t *in;                  /* input DST data to decode */
     buffer_pool_space_t *out;                 /* resulting DSD decoded data */
     struct job_t *next;                       /* next job in the list (either list) */
@@ -89,8 +97,11 @@ struct dst_decoder_s
 {
     int procs;            /* maximum number of compression threads (>= 1) */
     int channel_count;
+    size_t dsd_frame_size;  /* size of a decoded frame */
 
     int sequence;       /* each job get's a unique sequence number */
+    long frame_count;   /* number of frames handed to the decoder */
+    volatile long frames_written;  /* number of frames written, by the write thread */
 
     /* input and output buffer pools */
     buffer_pool_t in_pool;
@@ -104,15 +115,27 @@ struct dst_decoder_s
     lock *write_first;    /* lowest sequence number in list */
     job_t *write_head;
 
+    /* number of frames handed to the decoder and not yet written, and the
+       number allowed by the memory budget (0 for no limit) */
+    lock *in_flight;
+    long job_limit;
+
     /* number of decoding threads running */
     int cthreads;
 
+    /* the decoding threads, several decoders can be running at once so
+       only these are joined (and not all threads) */
+    thread **decode_threads;
+
     /* write thread if running */
     thread *writeth;
 
     frame_decoded_callback_t frame_decoded_callback;
     frame_error_callback_t frame_error_callback;
     void *userdata;
+
+    /* decoding statistics, only updated by the write thread */
+    dst_decoder_stats_t *stats;
 };
 
 static unsigned processor_count(void)
@@ -141,10 +164,15 @@ static void setup_decoding_jobs(dst_decoder_t *dst_decoder)
     dst_decoder->decode_tail = &dst_decoder->decode_head;
     dst_decoder->write_first = new_lock(-1);
     dst_decoder->write_head = NULL;
+    dst_decoder->in_flight = new_lock(0);
+    dst_decoder->decode_threads = (thread **) calloc(dst_decoder->procs, sizeof(thread *));
+    if (dst_decoder->decode_threads == NULL)
+        exit(1);
 
-    /* initialize buffer pools */
-    buffer_pool_create(&dst_decoder->in_pool, 64 * 1024, (dst_decoder->procs << 1) + 2);
-    buffer_pool_create(&dst_decoder->out_pool, 64 * 1024, -1);
+    /* initialize buffer pools, a buffer holds the frames of a job -- a DST
+       frame is never larger than the DSD frame it decodes to */
+    buffer_pool_create(&dst_decoder->in_pool, JOB_MAX_FRAMES * dst_decoder->dsd_frame_size, dst_decoder->procs + 2);
+    buffer_pool_create(&dst_decoder->out_pool, JOB_MAX_FRAMES * dst_decoder->dsd_frame_size, -1);
 }
 
 /* command the decode threads to all return, then join them all (call from
@@ -160,24 +188,27 @@ static void finish_decoding_jobs(dst_decoder_t *dst_decoder)
 
     /* command all of the extant decode threads to return */
     possess(dst_decoder->decode_have);
-    job.error = 0;
+    job.frames = 0;
     job.seq = -1;
     job.next = NULL;
     dst_decoder->decode_head = &job;
     dst_decoder->decode_tail = &(job.next);
     twist(dst_decoder->decode_have, BY, +1);       /* will wake them all up */
 
-    /* join all of the decode threads, verify they all came back */
-    caught = join_all();
+    /* join all of the decode threads */
+    for (caught = 0; caught < dst_decoder->cthreads; caught++)
+        join(dst_decoder->decode_threads[caught]);
     LOG(lm_main, LOG_NOTICE, ("-- joined %d decode threads", caught));
-    assert(caught == dst_decoder->cthreads);
     dst_decoder->cthreads = 0;
+    free(dst_decoder->decode_threads);
+    dst_decoder->decode_threads = NULL;
 
     /* free the resources */
     caught = buffer_pool_free(&dst_decoder->out_pool);
     LOG(lm_main, LOG_NOTICE, ("-- freed %d output buffers", caught));
     caught = buffer_pool_free(&dst_decoder->in_pool);
     LOG(lm_main, LOG_NOTICE, ("-- freed %d input buffers", caught));
+    free_lock(dst_decoder->in_flight);
     free_lock(dst_decoder->write_first);
     free_lock(dst_decoder->decode_have);
     dst_decoder->decode_have = NULL;
@@ -220,14 +251,25 @@ static void decode_thread(void *userdata)
 
         if (job->more)
         {
-            job->out = buffer_pool_get_space(&dst_decoder->out_pool);
-
-            /* Save the error for later, so that the write_thread can output them in DST frame order */
-            job->error = DST_FramDSTDecode(job->in->buf, job->out->buf, job->in->len, job->seq, &D); 
-            if (job->error != DSTErr_NoError)
-                LOG(lm_main, LOG_ERROR, ("ERROR: %s on frame: %d", DST_GetErrorMessage(job->error), D.FrameHdr.FrameNr));
+            double start;
+            uint8_t *in_ptr;
+            int i;
 
-            job->out->len = (size_t)(MAX_DSDBITS_INFRAME / 8 * dst_decoder->channel_count);
+            job->out = buffer_pool_get_space(&dst_decoder->out_pool);
+            start = timeout_gettime();
+
+            in_ptr = (uint8_t *) job->in->buf;
+            for (i = 0; i < job->frames; i++)
+            {
+                /* Save the error for later, so that the write_thread can output them in DST frame order */
+                job->error[i] = DST_FramDSTDecode(in_ptr, (uint8_t *) job->out->buf + i * dst_decoder->dsd_frame_size, job->frame_size[i], job->first_frame + i, &D); 
+                if (job->error[i] != DSTErr_NoError)
+                    LOG(lm_main, LOG_ERROR, ("ERROR: %s on frame: %d", DST_GetErrorMessage(job->error[i]), D.FrameHdr.FrameNr));
+                in_ptr += job->frame_size[i];
+            }
+
+            job->decode_time = timeout_gettime() - start;
+            job->out->len = job->frames * dst_decoder->dsd_frame_size;
             buffer_pool_drop_space(job->in);
 
             LOG(lm_main, LOG_NOTICE, ("-- decoded #%ld%s", job->seq, job->more ? "" : " (last)"));
@@ -266,6 +308,7 @@ static void write_thread(void *userdata)
     long seq;                       /* next sequence number looking for */
     job_t *job;                     /* job pulled and working on */
     int more;                       /* true if more chunks to write */
+    int i;
     dst_decoder_t *dst_decoder = (dst_decoder_t *) userdata;
 
     /* build and write header */
@@ -283,16 +326,30 @@ static void write_thread(void *userdata)
         twist(dst_decoder->write_first, TO, dst_decoder->write_head == NULL ? -1 : dst_decoder->write_head->seq);
 
         /* report any error */
-        if (job->error != 0 && dst_decoder->frame_error_callback)
-            dst_decoder->frame_error_callback(job->seq, job->error, DST_GetErrorMessage(job->error), dst_decoder->userdata);
+        for (i = 0; i < job->frames; i++)
+        {
+            if (job->error[i] != 0 && dst_decoder->frame_error_callback)
+                dst_decoder->frame_error_callback(job->first_frame + i, job->error[i], DST_GetErrorMessage(job->error[i]), dst_decoder->userdata);
+        }
 
         more = job->more;
 
         if (more)
         {
-            /* write the decoded data and drop the output buffer */
+            if (dst_decoder->stats)
+            {
+                dst_decoder->stats->decode_time += job->decode_time;
+                dst_decoder->stats->frame_count += job->frames;
+            }
+
+            /* write the decoded frames of the job at once and drop the output buffer */
             dst_decoder->frame_decoded_callback(job->out->buf, job->out->len, dst_decoder->userdata);
             buffer_pool_drop_space(job->out);
+            dst_decoder->frames_written += job->frames;
+
+            /* make room for the next frame */
+            possess(dst_decoder->in_flight);
+            twist(dst_decoder->in_flight, BY, -1);
         }
 
         free(job);
@@ -319,7 +376,7 @@ static void finish_write_job(dst_decoder_t *dst_decoder)
     job = malloc(sizeof(job_t));
     if (job == NULL)
         exit(1);
-    job->error = 0;
+    job->frames = 0;
     job->seq = dst_decoder->sequence;
     job->in = 0;
     job->out = 0;
@@ -330,7 +387,7 @@ static void finish_write_job(dst_decoder_t *dst_decoder)
     /* start another decode thread if needed */
     if (dst_decoder->cthreads < dst_decoder->procs) 
     {
-        (void)launch(decode_thread, dst_decoder);
+        dst_decoder->decode_threads[dst_decoder->cthreads] = launch(decode_thread, dst_decoder);
         dst_decoder->cthreads++;
     }
 
@@ -355,6 +412,7 @@ dst_decoder_t* dst_decoder_create(int channel_count, frame_decoded_callback_t fr
     assert(frame_decoded_callback);
 
     dst_decoder->channel_count = channel_count;
+    dst_decoder->dsd_frame_size = (size_t) (MAX_DSDBITS_INFRAME / 8 * channel_count);
     dst_decoder->userdata = userdata;
     dst_decoder->frame_decoded_callback = frame_decoded_callback;
     dst_decoder->frame_error_callback = frame_error_callback;
@@ -377,35 +435,93 @@ void dst_decoder_destroy(dst_decoder_t *dst_decoder)
     free(dst_decoder);
 }
 
-void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size)
+void dst_decoder_set_stats(dst_decoder_t *dst_decoder, dst_decoder_stats_t *stats)
 {
-    job_t *job;                /* job for decode, then write */
+    dst_decoder->stats = stats;
+}
 
-    /* create a new job, use next input chunk */
-    job = malloc(sizeof(job_t));
-    if (job == NULL)
-        exit(1);
-    job->error = 0;
-    job->seq = dst_decoder->sequence;
-    job->in = buffer_pool_get_space(&dst_decoder->in_pool);
-    memcpy(job->in->buf, frame_data, frame_size);
-    job->in->len = frame_size;
-    job->out = NULL;
-    job->more = 1;
+int dst_decoder_get_queue_depth(dst_decoder_t *dst_decoder)
+{
+    return (int) (dst_decoder->frame_count - dst_decoder->frames_written);
+}
 
-    ++dst_decoder->sequence;
+int dst_decoder_get_thread_count(dst_decoder_t *dst_decoder)
+{
+    return dst_decoder->cthreads;
+}
 
-    /* start another decode thread if needed */
-    if (dst_decoder->cthreads < dst_decoder->procs) 
+void dst_decoder_set_memory_limit(dst_decoder_t *dst_decoder, size_t limit)
+{
+    /* each frame in flight holds an input buffer until it is decoded and an
+       output buffer until it is written */
+    dst_decoder->job_limit = (long) (limit / (dst_decoder->in_pool.size + dst_decoder->out_pool.size));
+    if (limit > 0 && dst_decoder->job_limit < 1)
+        dst_decoder->job_limit = 1;
+}
+
+void dst_decoder_decode_frames(dst_decoder_t *dst_decoder, uint8_t *frame_data, const size_t *frame_sizes, int frame_count)
+{
+    job_t *job;                /* job for decode, then write */
+    size_t len;
+    int frames;
+
+    while (frame_count > 0)
     {
-        (void)launch(decode_thread, dst_decoder);
-        dst_decoder->cthreads++;
+        /* block the caller (and the disc reader behind it) until the frames in
+           flight fit the memory budget */
+        possess(dst_decoder->in_flight);
+        if (dst_decoder->job_limit > 0)
+            wait_for(dst_decoder->in_flight, TO_BE_LESS_THAN, dst_decoder->job_limit);
+        twist(dst_decoder->in_flight, BY, +1);
+
+        /* create a new job, use as many of the next frames as fit a buffer */
+        job = malloc(sizeof(job_t));
+        if (job == NULL)
+            exit(1);
+        job->seq = dst_decoder->sequence;
+        job->in = buffer_pool_get_space(&dst_decoder->in_pool);
+        job->out = NULL;
+        job->more = 1;
+
+        len = 0;
+        frames = 0;
+        while (frames < frame_count && frames < JOB_MAX_FRAMES && len + frame_sizes[frames] <= dst_decoder->in_pool.size)
+        {
+            job->frame_size[frames] = frame_sizes[frames];
+            job->error[frames] = 0;
+            len += frame_sizes[frames];
+            frames++;
+        }
+        assert(frames > 0);
+        memcpy(job->in->buf, frame_data, len);
+        job->in->len = len;
+        job->frames = frames;
+        job->first_frame = dst_decoder->frame_count;
+
+        dst_decoder->frame_count += frames;
+        ++dst_decoder->sequence;
+
+        /* start another decode thread if needed */
+        if (dst_decoder->cthreads < dst_decoder->procs) 
+        {
+            dst_decoder->decode_threads[dst_decoder->cthreads] = launch(decode_thread, dst_decoder);
+            dst_decoder->cthreads++;
+        }
+
+        /* put job at end of decode list, let all the decoders know */
+        possess(dst_decoder->decode_have);
+        job->next = NULL;
+        *dst_decoder->decode_tail = job;
+        dst_decoder->decode_tail = &(job->next);
+        twist(dst_decoder->decode_have, BY, +1);
+
+        frame_data += len;
+        frame_sizes += frames;
+        frame_count -= frames;
     }
+}
 
-    /* put job at end of decode list, let all the decoders know */
-    possess(dst_decoder->decode_have);
-    job->next = NULL;
-    *dst_decoder->decode_tail = job;
-    dst_decoder->decode_tail = &(job->next);
-    twist(dst_decoder->decode_have, BY, +1);
+void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size)
+{
+    dst_decoder_decode_frames(dst_decoder, frame_data, &frame_size, 1);
 }
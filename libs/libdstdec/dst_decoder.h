@@ -28,9 +28,36 @@ typedef struct dst_decoder_s dst_decoder_t;
 typedef void (*frame_decoded_callback_t)(uint8_t* frame_data, size_t frame_size, void *userdata);
 typedef void (*frame_error_callback_t)(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata);
 
+typedef struct
+{
+    double   decode_time;       /* seconds spent decoding, summed over the decoding threads */
+    uint32_t frame_count;
+}
+dst_decoder_stats_t;
+
 dst_decoder_t* dst_decoder_create(int channel_count, frame_decoded_callback_t frame_decoded_callback, frame_error_callback_t frame_error_callback, void *userdata);
 void dst_decoder_destroy(dst_decoder_t *dst_decoder);
 void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size);
 
+/* decodes frame_count frames stored back to back in frame_data, the frames
+   are decoded in jobs of up to a second of audio. frame_decoded_callback is
+   called once for the frames of a job, frame_size is then a multiple of the
+   size of a decoded frame */
+void dst_decoder_decode_frames(dst_decoder_t *dst_decoder, uint8_t *frame_data, const size_t *frame_sizes, int frame_count);
+
+/* the decoder adds to stats for every frame written, stats are complete once
+   the decoder has been destroyed */
+void dst_decoder_set_stats(dst_decoder_t *dst_decoder, dst_decoder_stats_t *stats);
+
+/* for monitoring a running decoder, the frames handed to it that have not
+   been written yet and the number of decoding threads -- read without locking */
+int dst_decoder_get_queue_depth(dst_decoder_t *dst_decoder);
+int dst_decoder_get_thread_count(dst_decoder_t *dst_decoder);
+
+/* limits the memory of the frames in flight (queued, decoded or waiting to be
+   written) to about limit bytes, dst_decoder_decode blocks while the budget
+   is used up -- 0 for no limit */
+void dst_decoder_set_memory_limit(dst_decoder_t *dst_decoder, size_t limit);
+
 
 #endif /* DST_DECODER_H */
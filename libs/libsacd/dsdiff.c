@@ -34,6 +34,7 @@
 #endif
 
 #include <charset.h>
+#include <logging.h>
 
 #include "sacd_reader.h"
 #include "scarletbook_id3.h"
@@ -45,6 +46,15 @@
 
 #define DSDFIFF_BUFFER_SIZE    1024 * 16
 
+// the state of the writer between two frames, the frame indexes of DST are
+// journaled as a log
+typedef struct
+{
+    uint64_t            frame_count;
+    uint64_t            audio_data_size;
+}
+dsdiff_state_t;
+
 typedef struct
 {
     uint8_t            *header;
@@ -57,8 +67,11 @@ typedef struct
 
     dst_frame_index_t  *frame_indexes;
     size_t              frame_indexes_allocated;
+    size_t              frame_indexes_journaled;    // the log of the journal holds the ones before
 
     int                 edit_master;
+
+    dsdiff_state_t      state;                      // journaled to resume the file
 } 
 dsdiff_handle_t;
 
@@ -104,6 +117,7 @@ static int calculate_header_and_footer(scarletbook_output_format_t *ft)
     uint8_t          *write_ptr, *prop_ptr;
     scarletbook_handle_t *sb_handle = ft->sb_handle;
     dsdiff_handle_t  *handle = (dsdiff_handle_t *) ft->priv;
+    size_t            footer_buffer_size = DSDFIFF_BUFFER_SIZE;
 
     if (!handle->header)
         handle->header = (uint8_t *) calloc(DSDFIFF_BUFFER_SIZE, 1);
@@ -271,7 +285,14 @@ static int calculate_header_and_footer(scarletbook_output_format_t *ft)
         write_ptr += DST_FRAME_INFORMATION_CHUNK_SIZE;
     }
 
-    // start with a new footer
+    // start with a new footer, the padding of its chunks is left zero
+    if (!ft->dsd_encoded_export && handle->frame_count > 0)
+    {
+        // resize the footer buffer
+        footer_buffer_size += handle->frame_indexes_allocated * DST_FRAME_INDEX_SIZE;
+        handle->footer = realloc(handle->footer, footer_buffer_size);
+    }
+    memset(handle->footer, 0, footer_buffer_size);
     handle->footer_size = 0;
 
     // DST Sound Index Chunk
@@ -281,9 +302,6 @@ static int calculate_header_and_footer(scarletbook_output_format_t *ft)
         dst_sound_index_chunk_t *dst_sound_index_chunk;
         uint8_t *dsti_ptr;
 
-        // resize the footer buffer
-        handle->footer = realloc(handle->footer, DSDFIFF_BUFFER_SIZE + handle->frame_indexes_allocated * DST_FRAME_INDEX_SIZE);
-
         dsti_ptr = handle->footer + handle->footer_size;
 
         dst_sound_index_chunk                 = (dst_sound_index_chunk_t *) dsti_ptr;
@@ -561,30 +579,80 @@ static int calculate_header_and_footer(scarletbook_output_format_t *ft)
     return 0;
 }
 
-static int dsdiff_create_edit_master(scarletbook_output_format_t *ft)
+static int dsdiff_write_header(scarletbook_output_format_t *ft)
 {
-    int ret;
     dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
-    handle->edit_master = 1;
+    int ret;
+
+    if (ft->sequential)
+    {
+        // the size of DST frames is not known before they are read
+        if (!ft->dsd_encoded_export)
+        {
+            LOG(lm_main, LOG_ERROR, ("%s cannot seek, DST must be converted to DSD to write it", ft->filename));
+            return -1;
+        }
+
+        // the header cannot be rewritten, it is written up front with the size
+        // of the frame count in the TOC, the audio is cut or padded to match
+        handle->audio_data_size = (uint64_t) ft->frame_count * FRAME_SIZE_64 * ft->channel_count;
+    }
+
     ret = calculate_header_and_footer(ft);
     fwrite(handle->header, 1, handle->header_size, ft->fd);
+    handle->audio_data_size = 0;
+
     return ret;
 }
 
+static int dsdiff_create_edit_master(scarletbook_output_format_t *ft)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+    handle->edit_master = 1;
+    return dsdiff_write_header(ft);
+}
+
 static int dsdiff_create(scarletbook_output_format_t *ft)
 {
-    int ret = calculate_header_and_footer(ft);
-    dsdiff_handle_t  *handle = (dsdiff_handle_t *) ft->priv;
-    fwrite(handle->header, 1, handle->header_size, ft->fd); 
-    return ret;
+    return dsdiff_write_header(ft);
+}
+
+static size_t dsdiff_write_frame(scarletbook_output_format_t *, const uint8_t *, size_t);
+
+// pads a sequential file with silence up to the frame count in its header
+static void dsdiff_pad_frames(scarletbook_output_format_t *ft)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+    size_t frame_size = FRAME_SIZE_64 * ft->channel_count;
+    uint8_t *silence;
+
+    if (handle->frame_count >= ft->frame_count)
+        return;
+
+    silence = (uint8_t *) malloc(frame_size);
+    if (!silence)
+        return;
+
+    memset(silence, DSD_SILENCE_BYTE, frame_size);
+    while (handle->frame_count < ft->frame_count)
+    {
+        dsdiff_write_frame(ft, silence, frame_size);
+    }
+    free(silence);
 }
 
 static int dsdiff_close(scarletbook_output_format_t *ft)
 {
     dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
 
-    if (!handle)
+    // no header was written
+    if (!handle || !handle->header)
         return 0;
+
+    if (ft->sequential)
+    {
+        dsdiff_pad_frames(ft);
+    }
     
     if (handle->audio_data_size % 2)
     {
@@ -599,9 +667,12 @@ static int dsdiff_close(scarletbook_output_format_t *ft)
     // append the footer
     fwrite(handle->footer, 1, handle->footer_size, ft->fd);
 
-    // write the final header
-    fseek(ft->fd, 0, SEEK_SET);
-    fwrite(handle->header, 1, handle->header_size, ft->fd);
+    // write the final header, a sequential file has the same header already
+    if (!ft->sequential)
+    {
+        fseek(ft->fd, 0, SEEK_SET);
+        fwrite(handle->header, 1, handle->header_size, ft->fd);
+    }
 
     if (handle->frame_indexes)
         free(handle->frame_indexes);
@@ -613,10 +684,73 @@ static int dsdiff_close(scarletbook_output_format_t *ft)
     return 0;
 }
 
+static int dsdiff_save_state(scarletbook_output_format_t *ft, scarletbook_journal_state_t *state)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+
+    handle->state.frame_count = handle->frame_count;
+    handle->state.audio_data_size = handle->audio_data_size;
+    state->state = (const uint8_t *) &handle->state;
+    state->state_size = sizeof(dsdiff_state_t);
+
+    // the frame indexes since the last time are added to the log
+    if (!ft->dsd_encoded_export)
+    {
+        state->log = (const uint8_t *) (handle->frame_indexes + handle->frame_indexes_journaled);
+        state->log_offset = handle->frame_indexes_journaled * DST_FRAME_INDEX_SIZE;
+        state->log_size = (handle->frame_count - handle->frame_indexes_journaled) * DST_FRAME_INDEX_SIZE;
+        handle->frame_indexes_journaled = handle->frame_count;
+    }
+
+    return 0;
+}
+
+static int dsdiff_resume(scarletbook_output_format_t *ft, const scarletbook_journal_state_t *state)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+    dsdiff_state_t saved;
+
+    if (state->state_size != sizeof(dsdiff_state_t))
+        return -1;
+    memcpy(&saved, state->state, sizeof(dsdiff_state_t));
+
+    handle->frame_count = (size_t) saved.frame_count;
+    handle->audio_data_size = saved.audio_data_size;
+    if (!ft->dsd_encoded_export)
+    {
+        if (state->log_size != handle->frame_count * DST_FRAME_INDEX_SIZE)
+            return -1;
+
+        handle->frame_indexes_allocated = handle->frame_count + 10000;
+        handle->frame_indexes = (dst_frame_index_t *) malloc(handle->frame_indexes_allocated * DST_FRAME_INDEX_SIZE);
+        if (!handle->frame_indexes)
+            return -1;
+        memcpy(handle->frame_indexes, state->log, state->log_size);
+        handle->frame_indexes_journaled = handle->frame_count;
+    }
+
+    // the header is the same size whatever it holds, it is finalized on close
+    if (calculate_header_and_footer(ft) != 0)
+        return -1;
+    fwrite(handle->header, 1, handle->header_size, ft->fd);
+
+    return 0;
+}
+
+static int dsdiff_resume_edit_master(scarletbook_output_format_t *ft, const scarletbook_journal_state_t *state)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+    handle->edit_master = 1;
+    return dsdiff_resume(ft, state);
+}
+
 static size_t dsdiff_write_frame(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
 {
     dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
 
+    // frames past the length in the header are dropped
+    if (ft->sequential && handle->frame_count >= ft->frame_count)
+        return 0;
     handle->frame_count++;
 
     if (ft->dsd_encoded_export)
@@ -663,6 +797,39 @@ static size_t dsdiff_write_frame(scarletbook_output_format_t *ft, const uint8_t
     }
 }
 
+// DSD frames are written in a single run, DST frames each get their own chunk
+static size_t dsdiff_write_frames(scarletbook_output_format_t *ft, const uint8_t *buf, const size_t *frame_sizes, int frame_count)
+{
+    dsdiff_handle_t *handle = (dsdiff_handle_t *) ft->priv;
+    size_t len = 0, nrw = 0;
+    int i;
+
+    if (ft->dsd_encoded_export)
+    {
+        // frames past the length in the header are dropped
+        if (ft->sequential && handle->frame_count + frame_count > ft->frame_count)
+        {
+            frame_count = handle->frame_count < ft->frame_count ? (int) (ft->frame_count - handle->frame_count) : 0;
+        }
+        for (i = 0; i < frame_count; i++)
+        {
+            len += frame_sizes[i];
+        }
+        handle->frame_count += frame_count;
+
+        nrw = fwrite(buf, 1, len, ft->fd);
+        handle->audio_data_size += nrw;
+        return nrw;
+    }
+
+    for (i = 0; i < frame_count; i++)
+    {
+        nrw += dsdiff_write_frame(ft, buf, frame_sizes[i]);
+        buf += frame_sizes[i];
+    }
+    return nrw;
+}
+
 scarletbook_format_handler_t const * dsdiff_format_fn(void) 
 {
     static scarletbook_format_handler_t handler = 
@@ -671,9 +838,12 @@ scarletbook_format_handler_t const * dsdiff_format_fn(void)
         "dsdiff", 
         dsdiff_create, 
         dsdiff_write_frame,
+        dsdiff_write_frames,
         dsdiff_close, 
-        OUTPUT_FLAG_DSD | OUTPUT_FLAG_DST,
-        sizeof(dsdiff_handle_t)
+        OUTPUT_FLAG_DSD | OUTPUT_FLAG_DST | OUTPUT_FLAG_RESUMABLE,
+        sizeof(dsdiff_handle_t),
+        dsdiff_save_state,
+        dsdiff_resume
     };
     return &handler;
 }
@@ -686,9 +856,12 @@ scarletbook_format_handler_t const * dsdiff_edit_master_format_fn(void)
         "dsdiff_edit_master", 
         dsdiff_create_edit_master, 
         dsdiff_write_frame,
+        dsdiff_write_frames,
         dsdiff_close, 
-        OUTPUT_FLAG_DSD | OUTPUT_FLAG_DST | OUTPUT_FLAG_EDIT_MASTER,
-        sizeof(dsdiff_handle_t)
+        OUTPUT_FLAG_DSD | OUTPUT_FLAG_DST | OUTPUT_FLAG_EDIT_MASTER | OUTPUT_FLAG_RESUMABLE,
+        sizeof(dsdiff_handle_t),
+        dsdiff_save_state,
+        dsdiff_resume_edit_master
     };
     return &handler;
 }
@@ -54,12 +54,26 @@ typedef struct
 
     int                 channel_count;
     uint64_t            sample_count;
+    uint32_t            frame_count;
 
     uint8_t             buffer[MAX_CHANNEL_COUNT][SACD_BLOCK_SIZE_PER_CHANNEL];
     uint8_t            *buffer_ptr[MAX_CHANNEL_COUNT];
+
+    uint8_t            *state;                      // journaled to resume the file
 } 
 dsf_handle_t;
 
+// the state of the writer between two frames, followed by what is waiting
+// in the block of each channel
+typedef struct
+{
+    uint64_t            sample_count;
+    uint64_t            audio_data_size;
+    uint32_t            frame_count;
+    uint32_t            block_fill;                 // the same for every channel
+}
+dsf_state_t;
+
 static const uint8_t bit_reverse_table[] = 
 {
     0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0, 
@@ -164,7 +178,46 @@ static int dsf_create_header(scarletbook_output_format_t *ft)
 
 static int dsf_create(scarletbook_output_format_t *ft)
 {
-    return dsf_create_header(ft);
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+    int ret;
+
+    if (!ft->sequential)
+        return dsf_create_header(ft);
+
+    // the header cannot be rewritten, it is written up front with the sizes
+    // of the frame count in the TOC, the audio is cut or padded to match
+    handle->sample_count = (uint64_t) ft->frame_count * FRAME_SIZE_64 * ft->channel_count;
+    handle->audio_data_size = ((uint64_t) ft->frame_count * FRAME_SIZE_64 + SACD_BLOCK_SIZE_PER_CHANNEL - 1) 
+                              / SACD_BLOCK_SIZE_PER_CHANNEL * SACD_BLOCK_SIZE_PER_CHANNEL * ft->channel_count;
+    ret = dsf_create_header(ft);
+    handle->sample_count = 0;
+    handle->audio_data_size = 0;
+
+    return ret;
+}
+
+static size_t dsf_write_frame(scarletbook_output_format_t *, const uint8_t *, size_t);
+
+// pads a sequential file with silence up to the frame count in its header
+static void dsf_pad_frames(scarletbook_output_format_t *ft)
+{
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+    size_t frame_size = FRAME_SIZE_64 * ft->channel_count;
+    uint8_t *silence;
+
+    if (handle->frame_count >= ft->frame_count)
+        return;
+
+    silence = (uint8_t *) malloc(frame_size);
+    if (!silence)
+        return;
+
+    memset(silence, DSD_SILENCE_BYTE, frame_size);
+    while (handle->frame_count < ft->frame_count)
+    {
+        dsf_write_frame(ft, silence, frame_size);
+    }
+    free(silence);
 }
 
 static int dsf_close(scarletbook_output_format_t *ft)
@@ -172,6 +225,11 @@ static int dsf_close(scarletbook_output_format_t *ft)
     dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
     int i;
 
+    if (ft->sequential)
+    {
+        dsf_pad_frames(ft);
+    }
+
     // write out what was left in the ring buffers
     for (i = 0; i < handle->channel_count; i++)
     {
@@ -188,20 +246,79 @@ static int dsf_close(scarletbook_output_format_t *ft)
 
     // write the footer
     fwrite(handle->footer, 1, handle->footer_size, ft->fd);
-    fseek(ft->fd, 0, SEEK_SET);
-    
+
     // write the final header
-    dsf_create_header(ft);
+    if (!ft->sequential)
+    {
+        fseek(ft->fd, 0, SEEK_SET);
+        dsf_create_header(ft);
+    }
 
     if (handle->header)
         free(handle->header);
     if (handle->footer)
         free(handle->footer);
+    free(handle->state);
 
     return 0;
 }
 
-static size_t dsf_write_frame(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
+static int dsf_save_state(scarletbook_output_format_t *ft, scarletbook_journal_state_t *state)
+{
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+    dsf_state_t saved;
+    int i;
+
+    if (!handle->state)
+    {
+        handle->state = (uint8_t *) malloc(sizeof(dsf_state_t) + MAX_CHANNEL_COUNT * SACD_BLOCK_SIZE_PER_CHANNEL);
+        if (!handle->state)
+            return -1;
+    }
+
+    saved.sample_count = handle->sample_count;
+    saved.audio_data_size = handle->audio_data_size;
+    saved.frame_count = handle->frame_count;
+    saved.block_fill = handle->buffer_ptr[0] ? (uint32_t) (handle->buffer_ptr[0] - handle->buffer[0]) : 0;
+    memcpy(handle->state, &saved, sizeof(dsf_state_t));
+    for (i = 0; i < handle->channel_count; i++)
+    {
+        memcpy(handle->state + sizeof(dsf_state_t) + i * saved.block_fill, handle->buffer[i], saved.block_fill);
+    }
+
+    state->state = handle->state;
+    state->state_size = sizeof(dsf_state_t) + handle->channel_count * saved.block_fill;
+
+    return 0;
+}
+
+static int dsf_resume(scarletbook_output_format_t *ft, const scarletbook_journal_state_t *state)
+{
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+    dsf_state_t saved;
+    int i;
+
+    if (state->state_size < sizeof(dsf_state_t))
+        return -1;
+    memcpy(&saved, state->state, sizeof(dsf_state_t));
+
+    handle->sample_count = saved.sample_count;
+    handle->audio_data_size = saved.audio_data_size;
+    handle->frame_count = saved.frame_count;
+    if (dsf_create_header(ft) != 0 || saved.block_fill > SACD_BLOCK_SIZE_PER_CHANNEL ||
+        state->state_size != sizeof(dsf_state_t) + handle->channel_count * saved.block_fill)
+        return -1;
+
+    for (i = 0; i < handle->channel_count; i++)
+    {
+        memcpy(handle->buffer[i], state->state + sizeof(dsf_state_t) + i * saved.block_fill, saved.block_fill);
+        handle->buffer_ptr[i] = handle->buffer[i] + saved.block_fill;
+    }
+
+    return 0;
+}
+
+static size_t dsf_write_samples(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
 {
     dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
     const uint8_t *buf_end_ptr = buf + len;
@@ -240,6 +357,39 @@ static size_t dsf_write_frame(scarletbook_output_format_t *ft, const uint8_t *bu
     return (size_t) (handle->audio_data_size - prev_audio_data_size);
 }
 
+static size_t dsf_write_frame(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
+{
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+
+    // frames past the length in the header are dropped
+    if (ft->sequential && handle->frame_count >= ft->frame_count)
+        return 0;
+    handle->frame_count++;
+
+    return dsf_write_samples(ft, buf, len);
+}
+
+// the frames are interleaved into the channel blocks in a single run
+static size_t dsf_write_frames(scarletbook_output_format_t *ft, const uint8_t *buf, const size_t *frame_sizes, int frame_count)
+{
+    dsf_handle_t *handle = (dsf_handle_t *) ft->priv;
+    size_t len = 0;
+    int i;
+
+    // frames past the length in the header are dropped
+    if (ft->sequential && handle->frame_count + frame_count > ft->frame_count)
+    {
+        frame_count = handle->frame_count < ft->frame_count ? (int) (ft->frame_count - handle->frame_count) : 0;
+    }
+    for (i = 0; i < frame_count; i++)
+    {
+        len += frame_sizes[i];
+    }
+    handle->frame_count += frame_count;
+
+    return dsf_write_samples(ft, buf, len);
+}
+
 scarletbook_format_handler_t const * dsf_format_fn(void) 
 {
     static scarletbook_format_handler_t handler = 
@@ -248,9 +398,12 @@ scarletbook_format_handler_t const * dsf_format_fn(void)
         "dsf", 
         dsf_create, 
         dsf_write_frame,
+        dsf_write_frames,
         dsf_close, 
-        OUTPUT_FLAG_DSD,
-        sizeof(dsf_handle_t)
+        OUTPUT_FLAG_DSD | OUTPUT_FLAG_RESUMABLE,
+        sizeof(dsf_handle_t),
+        dsf_save_state,
+        dsf_resume
     };
     return &handler;
 }
@@ -33,6 +33,7 @@
 
 #include <scarletbook.h>
 #include <logging.h>
+#include <timeout.h>
 #include "dst_decoder_ps3.h"
 
 enum 
@@ -307,9 +308,16 @@ static void process_dst_frames(dst_decoder_t *dst_decoder)
     if (dst_decoder->event_count > 0)
     {
         int current_event = 0;
+        double start = timeout_gettime();
     
         // wait for all frames to be decoded (decoding takes around 0.03 seconds per frame)
         dst_decoder_wait(dst_decoder, 500000);
+
+        if (dst_decoder->stats)
+        {
+            dst_decoder->stats->decode_time += timeout_gettime() - start;
+            dst_decoder->stats->frame_count += dst_decoder->event_count;
+        }
     
         while (current_event < dst_decoder->event_count)
         {
@@ -430,6 +438,27 @@ int dst_decoder_destroy(dst_decoder_t *dst_decoder)
     return 0;
 }   
 
+void dst_decoder_set_stats(dst_decoder_t *dst_decoder, dst_decoder_stats_t *stats)
+{
+    dst_decoder->stats = stats;
+}
+
+void dst_decoder_set_memory_limit(dst_decoder_t *dst_decoder, size_t limit)
+{
+    // the SPU decoders work on a fixed set of buffers, the memory is bounded already
+}
+
+// frames sent to the SPUs that have not been collected yet
+int dst_decoder_get_queue_depth(dst_decoder_t *dst_decoder)
+{
+    return dst_decoder->event_count;
+}
+
+int dst_decoder_get_thread_count(dst_decoder_t *dst_decoder)
+{
+    return NUM_DST_DECODERS;
+}
+
 int dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t *dst_data, size_t dst_size)
 {
     int ret;
@@ -471,4 +500,18 @@ int dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t *dst_data, size_t dst
     return ret;
 }
 
+// the SPU decoders take a frame each, the frames are handed on one by one
+int dst_decoder_decode_frames(dst_decoder_t *dst_decoder, uint8_t *frame_data, const size_t *frame_sizes, int frame_count)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < frame_count && ret == 0; i++)
+    {
+        ret = dst_decoder_decode(dst_decoder, frame_data, frame_sizes[i]);
+        frame_data += frame_sizes[i];
+    }
+
+    return ret;
+}
+
 #endif
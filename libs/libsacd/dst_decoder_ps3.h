@@ -30,6 +30,13 @@ typedef void (*frame_decoded_callback_t)(uint8_t* frame_data, size_t frame_size,
 typedef void (*frame_error_callback_t)(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata);
 typedef struct dst_decoder_thread_s *dst_decoder_thread_t;
 
+typedef struct
+{
+    double                          decode_time;        // seconds spent waiting for the SPUs
+    uint32_t                        frame_count;
+}
+dst_decoder_stats_t;
+
 #define NUM_DST_DECODERS                5 /* The number of DST decoders (SPUs) */ 
 
 typedef struct dst_decoder_t
@@ -47,12 +54,19 @@ typedef struct dst_decoder_t
     frame_decoded_callback_t        frame_decoded_callback;
     frame_error_callback_t          frame_error_callback;
     void                           *userdata;
+
+    dst_decoder_stats_t            *stats;
 }
 dst_decoder_t;
 
 dst_decoder_t* dst_decoder_create(int channel_count, frame_decoded_callback_t frame_decoded_callback, frame_error_callback_t frame_error_callback, void *userdata);
 int dst_decoder_destroy(dst_decoder_t *dst_decoder);
 int dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size);
+int dst_decoder_decode_frames(dst_decoder_t *dst_decoder, uint8_t *frame_data, const size_t *frame_sizes, int frame_count);
+void dst_decoder_set_stats(dst_decoder_t *dst_decoder, dst_decoder_stats_t *stats);
+void dst_decoder_set_memory_limit(dst_decoder_t *dst_decoder, size_t limit);
+int dst_decoder_get_queue_depth(dst_decoder_t *dst_decoder);
+int dst_decoder_get_thread_count(dst_decoder_t *dst_decoder);
 
 #endif
 
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef __lv2ppu__
 #include <sys/file.h>
@@ -30,9 +31,106 @@
 
 #include "scarletbook_output.h"
 
+// runs of zero sectors shorter than this are written, longer runs are skipped
+// so the filesystem can leave a hole (64KB keeps the writes large)
+#define ISO_SPARSE_MIN_SECTORS 32
+
+typedef struct
+{
+    uint32_t zero_sectors;          // zero sectors that have not been written yet
+}
+iso_handle_t;
+
+static const uint8_t zero_sector[SACD_LSN_SIZE];
+
+static int iso_seek_forward(FILE *fd, int64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fd, offset, SEEK_CUR);
+#else
+    // off_t is 64 bits wide (_FILE_OFFSET_BITS=64)
+    return fseeko(fd, (off_t) offset, SEEK_CUR);
+#endif
+}
+
+/**
+ * outputs the pending zero sectors, the last byte of the image is always
+ * written so the file gets its full size
+ */
+static int iso_flush_zero_sectors(scarletbook_output_format_t *ft, int end_of_image)
+{
+    iso_handle_t *handle = (iso_handle_t *) ft->priv;
+    uint32_t      i;
+    int           ret = 0;
+
+    // a pipe cannot skip, the zero sectors are written out
+    if (handle->zero_sectors >= ISO_SPARSE_MIN_SECTORS && !ft->sequential)
+    {
+        if (end_of_image)
+        {
+            ret = iso_seek_forward(ft->fd, (int64_t) handle->zero_sectors * SACD_LSN_SIZE - 1);
+            if (ret == 0 && fwrite(zero_sector, 1, 1, ft->fd) != 1)
+            {
+                ret = -1;
+            }
+        }
+        else
+        {
+            ret = iso_seek_forward(ft->fd, (int64_t) handle->zero_sectors * SACD_LSN_SIZE);
+        }
+    }
+    else
+    {
+        for (i = 0; i < handle->zero_sectors && ret == 0; i++)
+        {
+            if (fwrite(zero_sector, 1, SACD_LSN_SIZE, ft->fd) != SACD_LSN_SIZE)
+            {
+                ret = -1;
+            }
+        }
+    }
+    handle->zero_sectors = 0;
+
+    return ret;
+}
+
 static size_t iso_write_frame(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
 {
-    return fwrite(buf, 1, len * SACD_LSN_SIZE, ft->fd);
+    iso_handle_t *handle = (iso_handle_t *) ft->priv;
+    size_t        sector = 0;
+
+    while (sector < len)
+    {
+        size_t data_sectors = 0;
+
+        // count the zero sectors, they are written once we know how long the run is
+        while (sector < len && memcmp(buf + sector * SACD_LSN_SIZE, zero_sector, SACD_LSN_SIZE) == 0)
+        {
+            handle->zero_sectors++;
+            sector++;
+        }
+        while (sector + data_sectors < len && memcmp(buf + (sector + data_sectors) * SACD_LSN_SIZE, zero_sector, SACD_LSN_SIZE) != 0)
+        {
+            data_sectors++;
+        }
+
+        if (data_sectors > 0)
+        {
+            if (iso_flush_zero_sectors(ft, 0) != 0 ||
+                fwrite(buf + sector * SACD_LSN_SIZE, 1, data_sectors * SACD_LSN_SIZE, ft->fd) != data_sectors * SACD_LSN_SIZE)
+            {
+                return sector * SACD_LSN_SIZE;
+            }
+            sector += data_sectors;
+        }
+    }
+
+    return len * SACD_LSN_SIZE;
+}
+
+static int iso_close(scarletbook_output_format_t *ft)
+{
+    return iso_flush_zero_sectors(ft, 1);
 }
 
 scarletbook_format_handler_t const * iso_format_fn(void) 
@@ -43,8 +141,11 @@ scarletbook_format_handler_t const * iso_format_fn(void)
         "iso", 
         0, 
         iso_write_frame,
-        0, 
-        OUTPUT_FLAG_RAW,
+        0,
+        iso_close, 
+        OUTPUT_FLAG_RAW | OUTPUT_FLAG_RESUMABLE,
+        sizeof(iso_handle_t),
+        0,
         0
     };
     return &handler;
@@ -19,12 +19,20 @@
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE         // O_DIRECT
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
+#ifndef __lv2ppu__
+#include <pthread.h>
+#endif
 
 #if defined(__lv2ppu__)
 #include <sys/file.h>
@@ -38,6 +46,22 @@
 #include <io.h>
 #endif
 
+#if !defined(__lv2ppu__) && !defined(_WIN32)
+#define SACD_INPUT_MMAP    1
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(O_DIRECT)
+#define SACD_INPUT_DIRECT  1
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(HAVE_ZLIB) && !defined(__lv2ppu__)
+#define SACD_INPUT_SACDZ   1
+#include <zlib.h>
+#endif
+
 #include <utils.h>
 #include <logging.h>
 #include <socket.h>
@@ -47,21 +71,49 @@
 
 #include "scarletbook.h"
 #include "sacd_input.h"
+#include "sacdz.h"
 #include "sacd_pb_stream.h"
 #include "sacd_ripper.pb.h"
 
-sacd_input_t (*sacd_input_open)         (const char *);
-int          (*sacd_input_close)        (sacd_input_t);
-ssize_t      (*sacd_input_read)         (sacd_input_t, int, int, void *);
-char *       (*sacd_input_error)        (sacd_input_t);
-int          (*sacd_input_authenticate) (sacd_input_t);
-int          (*sacd_input_decrypt)      (sacd_input_t, uint8_t *, int);
-uint32_t     (*sacd_input_total_sectors)(sacd_input_t);
+#ifndef __lv2ppu__
+/**
+ * An image is made up out of one or more files, split images (as written
+ * by sacd_extract on FAT32) are accessed as one contiguous device.
+ */
+typedef struct
+{
+    int                 fd;
+    uint32_t            start_sector;       // first sector of this part within the image
+    uint32_t            sector_count;
+    int                 partial_sector;     // size is not a multiple of SACD_LSN_SIZE
+#if defined(SACD_INPUT_MMAP)
+    uint8_t            *mapping;            // private mapping of a regular image file
+    size_t              mapping_size;
+#endif
+#if defined(SACD_INPUT_DIRECT)
+    size_t              direct_alignment;   // block device opened with O_DIRECT, 0 otherwise
+#endif
+}
+sacd_input_part_t;
+#endif
+
+#if defined(SACD_INPUT_SACDZ)
+typedef struct sacdz_input_s sacdz_input_t;
+#endif
 
 struct sacd_input_s
 {
     int                 fd;
     uint8_t            *input_buffer;
+#ifndef __lv2ppu__
+    pthread_mutex_t     lock;               // serializes requests that share a file position or socket
+    sacd_input_part_t  *parts;
+    int                 part_count;
+    uint32_t            total_sectors;
+#endif
+#if defined(SACD_INPUT_SACDZ)
+    sacdz_input_t      *sacdz;
+#endif
 #if defined(__lv2ppu__)
     device_info_t       device_info;
 #endif
@@ -130,6 +182,299 @@ static int sacd_dev_input_decrypt(sacd_input_t dev, uint8_t *buffer, int blocks)
     return 0;
 }
 
+#ifndef __lv2ppu__
+/**
+ * split images are opened through their first part, e.g. "album.iso.001"
+ */
+static int is_split_image(const char *target)
+{
+    size_t len = strlen(target);
+
+    return len > 4 && strcmp(target + len - 4, ".001") == 0;
+}
+
+#if defined(SACD_INPUT_DIRECT)
+/**
+ * block devices are read once from start to end, reading them with O_DIRECT
+ * keeps a rip from pushing everything else out of the page cache. Buffered
+ * reads are used when the device can't be opened with O_DIRECT.
+ */
+static void sacd_dev_input_open_direct(sacd_input_part_t *part, const char *name)
+{
+    int fd, sector_size = 0;
+
+    fd = open(name, O_RDONLY | O_DIRECT);
+    if (fd < 0)
+    {
+        return;
+    }
+    if (ioctl(fd, BLKSSZGET, &sector_size) != 0 || sector_size <= 0)
+    {
+        sector_size = SACD_LSN_SIZE;
+    }
+    close(part->fd);
+    part->fd = fd;
+    part->direct_alignment = (size_t) sector_size;
+}
+#endif
+
+/**
+ * open a file and append it to the image
+ */
+static int sacd_dev_input_open_part(sacd_input_t dev, const char *name)
+{
+    sacd_input_part_t *part, *parts;
+    struct stat        file_stat;
+
+    if (dev->part_count > 0 && dev->parts[dev->part_count - 1].partial_sector)
+    {
+        fprintf(stderr, "libsacdread: %s follows a part that is not sector aligned.\n", name);
+        return -1;
+    }
+
+    parts = (sacd_input_part_t *) realloc(dev->parts, (dev->part_count + 1) * sizeof(sacd_input_part_t));
+    if (!parts)
+    {
+        fprintf(stderr, "libsacdread: Could not allocate memory.\n");
+        return -1;
+    }
+    dev->parts = parts;
+    part = &dev->parts[dev->part_count];
+    memset(part, 0, sizeof(sacd_input_part_t));
+
+#if defined(_WIN32)
+    part->fd = open(name, O_RDONLY | O_BINARY);
+#else
+    part->fd = open(name, O_RDONLY);
+#endif
+    if (part->fd < 0)
+    {
+        return -1;
+    }
+    dev->part_count++;
+
+    if (fstat(part->fd, &file_stat) == 0)
+    {
+        part->start_sector = dev->total_sectors;
+        part->sector_count = (uint32_t) (file_stat.st_size / SACD_LSN_SIZE);
+        part->partial_sector = (file_stat.st_size % SACD_LSN_SIZE) != 0;
+        dev->total_sectors += part->sector_count;
+    }
+
+#if defined(SACD_INPUT_DIRECT)
+    if (S_ISBLK(file_stat.st_mode))
+    {
+        sacd_dev_input_open_direct(part, name);
+    }
+#endif
+
+#if defined(SACD_INPUT_MMAP)
+    // regular image files are mapped, sectors are then served straight from
+    // the page cache. The mapping is private so sectors can be decrypted
+    // in-place without touching the image. Block devices and images that
+    // don't fit in the address space keep using read().
+    if (S_ISREG(file_stat.st_mode) && 
+        file_stat.st_size >= SACD_LSN_SIZE && (uint64_t) file_stat.st_size <= (size_t) -1)
+    {
+        void *mapping = mmap(0, (size_t) file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, part->fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            part->mapping = (uint8_t *) mapping;
+            part->mapping_size = (size_t) file_stat.st_size;
+            madvise(part->mapping, part->mapping_size, MADV_SEQUENTIAL);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static int sacd_dev_input_close_parts(sacd_input_t dev)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < dev->part_count; i++)
+    {
+#if defined(SACD_INPUT_MMAP)
+        if (dev->parts[i].mapping)
+        {
+            munmap(dev->parts[i].mapping, dev->parts[i].mapping_size);
+        }
+#endif
+        ret |= close(dev->parts[i].fd);
+    }
+    free(dev->parts);
+    dev->parts = 0;
+    dev->part_count = 0;
+
+    return ret;
+}
+
+/**
+ * returns the part holding the sector together with the amount of sectors
+ * that can be accessed in that part, starting at the sector.
+ */
+static sacd_input_part_t *sacd_dev_input_find_part(sacd_input_t dev, uint32_t pos, uint32_t *sectors_left)
+{
+    int low = 0, high = dev->part_count - 1;
+
+    // a single file (or block device) is accessed as-is, its size might be unknown
+    if (dev->part_count == 1)
+    {
+        *sectors_left = (pos < dev->parts[0].sector_count) ? dev->parts[0].sector_count - pos : 0;
+        return &dev->parts[0];
+    }
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        sacd_input_part_t *part = &dev->parts[mid];
+
+        if (pos < part->start_sector)
+        {
+            high = mid - 1;
+        }
+        else if (pos >= part->start_sector + part->sector_count)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            *sectors_left = part->start_sector + part->sector_count - pos;
+            return part;
+        }
+    }
+    return 0;
+}
+
+/**
+ * positional read, returns the amount of bytes read (less than len at the
+ * end of the file) or -1 when the read failed.
+ */
+static ssize_t sacd_input_pread(sacd_input_t dev, int fd, off_t offset, size_t len, uint8_t *buffer)
+{
+    ssize_t ret = 0;
+    size_t  left = len;
+
+#if defined(_WIN32)
+    // there is no positional read, seek + read is serialized instead
+    pthread_mutex_lock(&dev->lock);
+    if (lseek(fd, offset, SEEK_SET) < 0)
+    {
+        pthread_mutex_unlock(&dev->lock);
+        return 0;
+    }
+#endif
+
+    while (left > 0)
+    {
+#if defined(_WIN32)
+        ret = read(fd, buffer, (unsigned int) left);
+#else
+        ret = pread(fd, buffer, left, offset);
+#endif
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        /* One of the reads failed, too bad.  We won't even bother
+         * returning the reads that went OK. */
+        if (ret <= 0)
+        {
+            break;
+        }
+
+        buffer += ret;
+        offset += ret;
+        left -= ret;
+    }
+
+#if defined(_WIN32)
+    pthread_mutex_unlock(&dev->lock);
+#endif
+
+    return (ret < 0) ? -1 : (ssize_t) (len - left);
+}
+
+#if defined(SACD_INPUT_DIRECT)
+/**
+ * O_DIRECT requires the buffer, offset and length to be aligned to the
+ * sector size of the device, other requests go through a bounce buffer.
+ */
+static ssize_t sacd_dev_input_read_direct(sacd_input_t dev, sacd_input_part_t *part, off_t offset, size_t len, uint8_t *buffer)
+{
+    size_t  alignment = part->direct_alignment;
+    ssize_t ret;
+
+    if (((uintptr_t) buffer | (uintptr_t) offset | len) & (alignment - 1))
+    {
+        off_t  start = offset & ~((off_t) alignment - 1);
+        size_t span = (size_t) ((offset + len + alignment - 1) & ~((off_t) alignment - 1)) - (size_t) start;
+        void  *bounce;
+
+        if (posix_memalign(&bounce, max(alignment, (size_t) sysconf(_SC_PAGESIZE)), span) != 0)
+        {
+            return -1;
+        }
+        ret = sacd_input_pread(dev, part->fd, start, span, (uint8_t *) bounce);
+        if (ret > 0)
+        {
+            ret = (ssize_t) min((size_t) max(ret - (ssize_t) (offset - start), 0), len);
+            memcpy(buffer, (uint8_t *) bounce + (offset - start), (size_t) ret);
+        }
+        free(bounce);
+    }
+    else
+    {
+        ret = sacd_input_pread(dev, part->fd, offset, len, buffer);
+    }
+
+    if (ret < 0 && errno == EINVAL)
+    {
+        // the device refuses direct I/O after all
+        int flags = fcntl(part->fd, F_GETFL);
+
+        if (flags != -1 && fcntl(part->fd, F_SETFL, flags & ~O_DIRECT) == 0)
+        {
+            part->direct_alignment = 0;
+            ret = sacd_input_pread(dev, part->fd, offset, len, buffer);
+        }
+    }
+    return ret;
+}
+#endif
+
+/**
+ * positional read of whole sectors from a single part
+ */
+static ssize_t sacd_dev_input_read_part(sacd_input_t dev, sacd_input_part_t *part, uint32_t pos, int blocks, uint8_t *buffer)
+{
+    ssize_t ret;
+
+#if defined(SACD_INPUT_MMAP)
+    if (part->mapping)
+    {
+        blocks = (int) min((uint32_t) blocks, part->sector_count - min(pos, part->sector_count));
+        memcpy(buffer, part->mapping + (size_t) pos * SACD_LSN_SIZE, (size_t) blocks * SACD_LSN_SIZE);
+        return blocks;
+    }
+#endif
+
+    // nothing more to read returns all of the whole blocks, if any
+#if defined(SACD_INPUT_DIRECT)
+    if (part->direct_alignment)
+    {
+        ret = sacd_dev_input_read_direct(dev, part, (off_t) pos * (off_t) SACD_LSN_SIZE, (size_t) blocks * SACD_LSN_SIZE, buffer);
+    }
+    else
+#endif
+    ret = sacd_input_pread(dev, part->fd, (off_t) pos * (off_t) SACD_LSN_SIZE, (size_t) blocks * SACD_LSN_SIZE, buffer);
+
+    return (ret < 0) ? ret : ret / SACD_LSN_SIZE;
+}
+#endif
+
 /**
  * initialize and open a SACD device or file.
  */
@@ -146,9 +491,7 @@ static sacd_input_t sacd_dev_input_open(const char *target)
     }
 
     /* Open the device */
-#if defined(WIN32)
-    dev->fd = open(target, O_RDONLY | O_BINARY);
-#elif defined(__lv2ppu__)
+#if defined(__lv2ppu__)
     {
         uint8_t                 buffer[64];
         int                     ret;
@@ -188,20 +531,60 @@ static sacd_input_t sacd_dev_input_open(const char *target)
         }
 
     }
-#elif defined _WIN32
-    dev->fd = open(target, O_RDONLY | O_BINARY);
-#else
-    dev->fd = open(target, O_RDONLY);
-#endif
     if (dev->fd < 0)
     {
         goto error;
     }
+#else
+    pthread_mutex_init(&dev->lock, NULL);
+
+    if (is_split_image(target))
+    {
+        // open image.iso.001, image.iso.002, .. until a part is missing
+        size_t base_len = strlen(target) - 4;
+        char  *part_name = (char *) malloc(base_len + 16);
+        int    i;
+
+        if (!part_name)
+        {
+            goto error;
+        }
+        for (i = 1; i < 1000; i++)
+        {
+            struct stat part_stat;
+
+            snprintf(part_name, base_len + 16, "%.*s.%03d", (int) base_len, target, i);
+            if (stat(part_name, &part_stat) != 0)
+            {
+                break;
+            }
+            if (sacd_dev_input_open_part(dev, part_name) != 0)
+            {
+                free(part_name);
+                goto error;
+            }
+        }
+        free(part_name);
+    }
+    else if (sacd_dev_input_open_part(dev, target) != 0)
+    {
+        goto error;
+    }
+    if (dev->part_count == 0)
+    {
+        goto error;
+    }
+    dev->fd = dev->parts[0].fd;
+#endif
 
     return dev;
 
 error:
 
+#ifndef __lv2ppu__
+    sacd_dev_input_close_parts(dev);
+    pthread_mutex_destroy(&dev->lock);
+#endif
     free(dev);
 
     return 0;
@@ -216,6 +599,42 @@ static char *sacd_dev_input_error(sacd_input_t dev)
     return (char *) "unknown error";
 }
 
+/**
+ * return a pointer to the sectors inside the mapped image, the returned
+ * sectors may be modified (i.e. decrypted) by the caller. Views never
+ * cross the end of a part.
+ */
+static ssize_t sacd_dev_input_view(sacd_input_t dev, int pos, int blocks, uint8_t **data)
+{
+#if defined(SACD_INPUT_MMAP)
+    sacd_input_part_t *part;
+    uint32_t sectors_left;
+    size_t offset, page_mask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+
+    if (pos < 0)
+    {
+        return 0;
+    }
+
+    part = sacd_dev_input_find_part(dev, (uint32_t) pos, &sectors_left);
+    if (!part || !part->mapping || sectors_left == 0)
+    {
+        return 0;
+    }
+
+    blocks = (int) min((uint32_t) blocks, sectors_left);
+    offset = (size_t) ((uint32_t) pos - part->start_sector) * SACD_LSN_SIZE;
+    *data = part->mapping + offset;
+
+    // have the kernel fault in the range before the caller touches it
+    madvise(part->mapping + (offset & ~page_mask), (size_t) blocks * SACD_LSN_SIZE + (offset & page_mask), MADV_WILLNEED);
+
+    return blocks;
+#else
+    return 0;
+#endif
+}
+
 /**
  * read data from the device.
  */
@@ -230,43 +649,45 @@ static ssize_t sacd_dev_input_read(sacd_input_t dev, int pos, int blocks, void *
     return (ret != 0) ? 0 : sectors_read;
 
 #else
-    ssize_t ret, len;
+    uint8_t *ptr = (uint8_t *) buffer;
+    ssize_t  total = 0;
 
-    ret = lseek(dev->fd, (off_t) pos * (off_t) SACD_LSN_SIZE, SEEK_SET);
-    if (ret < 0)
+    // a single read may span several parts of a split image
+    while (blocks > 0)
     {
-        return 0;
-    }
-
-    len = (size_t) blocks * SACD_LSN_SIZE;
+        sacd_input_part_t *part;
+        uint32_t sectors_left;
+        ssize_t  ret;
+        int      part_blocks = blocks;
 
-    while (len > 0)
-    {
-        ret = read(dev->fd, buffer, (unsigned int) len);
+        part = sacd_dev_input_find_part(dev, (uint32_t) pos, &sectors_left);
+        if (!part)
+        {
+            break;
+        }
+        if (dev->part_count > 1)
+        {
+            part_blocks = (int) min((uint32_t) blocks, sectors_left);
+        }
 
+        ret = sacd_dev_input_read_part(dev, part, (uint32_t) pos - part->start_sector, part_blocks, ptr);
         if (ret < 0)
         {
-            /* One of the reads failed, too bad.  We won't even bother
-             * returning the reads that went OK, and as in the POSIX spec
-             * the file position is left unspecified after a failure. */
-            return ret;
+            return total > 0 ? total : ret;
         }
 
-        if (ret == 0)
+        total += ret;
+        if (ret < part_blocks)
         {
-            /* Nothing more to read.  Return all of the whole blocks, if any.
-             * Adjust the file position back to the previous block boundary. */
-            ssize_t bytes     = (ssize_t) blocks * SACD_LSN_SIZE - len;
-            off_t   over_read = -(bytes % SACD_LSN_SIZE);
-            /*off_t pos =*/ lseek(dev->fd, over_read, SEEK_CUR);
-            /* should have pos % 2048 == 0 */
-            return (int) (bytes / SACD_LSN_SIZE);
+            break;
         }
 
-        len -= ret;
+        pos += part_blocks;
+        blocks -= part_blocks;
+        ptr += (size_t) part_blocks * SACD_LSN_SIZE;
     }
 
-    return blocks;
+    return total;
 #endif
 }
 
@@ -292,7 +713,8 @@ static int sacd_dev_input_close(sacd_input_t dev)
 
     ret = sys_storage_close(dev->fd);
 #else
-    ret = close(dev->fd);
+    ret = sacd_dev_input_close_parts(dev);
+    pthread_mutex_destroy(&dev->lock);
 #endif
 
     free(dev);
@@ -308,16 +730,12 @@ static uint32_t sacd_dev_input_total_sectors(sacd_input_t dev)
 #if defined(__lv2ppu__)
     return dev->device_info.total_sectors;
 #else
-    {
-        struct stat file_stat;
-        if(fstat(dev->fd, &file_stat) < 0)    
-            return 0;
-
-        return (uint32_t) (file_stat.st_size / SACD_LSN_SIZE);
-    }
+    return dev->total_sectors;
 #endif
 }
 
+static int sacd_net_input_close(sacd_input_t dev);
+
 /**
  * initialize and open a SACD device or file.
  */
@@ -339,6 +757,9 @@ static sacd_input_t sacd_net_input_open(const char *target)
         fprintf(stderr, "libsacdread: Could not allocate memory.\n");
         return NULL;
     }
+#ifndef __lv2ppu__
+    pthread_mutex_init(&dev->lock, NULL);
+#endif
 
     dev->input_buffer = (uint8_t *) malloc(MAX_PROCESSING_BLOCK_SIZE * SACD_LSN_SIZE + 1024);
     if (dev->input_buffer == NULL)
@@ -394,7 +815,7 @@ static sacd_input_t sacd_net_input_open(const char *target)
 
 error:
 
-    sacd_input_close(dev);
+    sacd_net_input_close(dev);
 
     return 0;
 }
@@ -446,13 +867,16 @@ error:
             free(dev->input_buffer);
             dev->input_buffer = 0;
         }
+#ifndef __lv2ppu__
+        pthread_mutex_destroy(&dev->lock);
+#endif
         free(dev);
         dev = 0;
     }
     return 0;
 }
 
-static uint32_t sacd_net_input_total_sectors(sacd_input_t dev)
+static uint32_t sacd_net_input_request_total_sectors(sacd_input_t dev)
 {
     if (!dev)
     {
@@ -490,7 +914,13 @@ static uint32_t sacd_net_input_total_sectors(sacd_input_t dev)
     }
 }
 
-static ssize_t sacd_net_input_read(sacd_input_t dev, int pos, int blocks, void *buffer)
+static ssize_t sacd_net_input_view(sacd_input_t dev, int pos, int blocks, uint8_t **data)
+{
+    // sectors received over the network can't be referenced in-place
+    return 0;
+}
+
+static ssize_t sacd_net_input_request_read(sacd_input_t dev, int pos, int blocks, void *buffer)
 {
     if (!dev)
     {
@@ -571,10 +1001,544 @@ static ssize_t sacd_net_input_read(sacd_input_t dev, int pos, int blocks, void *
     return 0;
 }
 
+// a request and its response can't be interleaved with other requests on the socket
+static uint32_t sacd_net_input_total_sectors(sacd_input_t dev)
+{
+    uint32_t ret;
+
+    if (!dev)
+        return 0;
+
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&dev->lock);
+#endif
+    ret = sacd_net_input_request_total_sectors(dev);
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&dev->lock);
+#endif
+    return ret;
+}
+
+static ssize_t sacd_net_input_read(sacd_input_t dev, int pos, int blocks, void *buffer)
+{
+    ssize_t ret, total = 0;
+
+    if (!dev)
+        return 0;
+
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&dev->lock);
+#endif
+    // the server handles at most MAX_PROCESSING_BLOCK_SIZE sectors per request
+    while (blocks > 0)
+    {
+        int request_blocks = min(blocks, MAX_PROCESSING_BLOCK_SIZE);
+
+        ret = sacd_net_input_request_read(dev, pos, request_blocks, (uint8_t *) buffer + (size_t) total * SACD_LSN_SIZE);
+        if (ret <= 0)
+            break;
+
+        total += ret;
+        if (ret < request_blocks)
+            break;
+
+        pos += request_blocks;
+        blocks -= request_blocks;
+    }
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&dev->lock);
+#endif
+    return total;
+}
+
+#if defined(SACD_INPUT_SACDZ)
+enum
+{
+    CHUNK_EMPTY = 0,
+    CHUNK_QUEUED,                       // waiting for a decompression thread
+    CHUNK_BUSY,                         // being decompressed
+    CHUNK_READY,
+    CHUNK_FAILED
+};
+
+typedef struct
+{
+    int                 state;
+    uint32_t            chunk;
+    int                 users;          // readers copying sectors out of the chunk
+    uint32_t            last_used;
+    uint8_t            *data;
+    uint8_t            *compressed;
+}
+sacdz_chunk_t;
+
+/**
+ * Compressed images keep a small set of inflated chunks, a pool of threads
+ * inflates the chunks following the one being read so sequential reads
+ * rarely have to wait for zlib.
+ */
+struct sacdz_input_s
+{
+    uint32_t            chunk_sectors;
+    uint32_t            chunk_count;
+    uint64_t           *chunk_offset;
+    uint32_t           *chunk_length;
+
+    sacdz_chunk_t      *chunks;
+    int                 slot_count;
+    uint32_t            clock;
+
+    pthread_t          *threads;
+    int                 thread_count;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      chunk_queued;
+    pthread_cond_t      chunk_ready;
+    int                 stop;
+};
+
+static int is_compressed_image(const char *target)
+{
+    char id[8];
+    int  fd, ret = 0;
+
+    fd = open(target, O_RDONLY);
+    if (fd >= 0)
+    {
+        ret = read(fd, id, 8) == 8 && memcmp(id, SACDZ_ID, 8) == 0;
+        close(fd);
+    }
+    return ret;
+}
+
+static uint32_t sacdz_chunk_sectors(sacd_input_t dev, uint32_t chunk)
+{
+    sacdz_input_t *z = dev->sacdz;
+
+    if (chunk == z->chunk_count - 1)
+    {
+        return dev->total_sectors - chunk * z->chunk_sectors;
+    }
+    return z->chunk_sectors;
+}
+
+/**
+ * reads and inflates a chunk into its slot, called without holding the lock
+ */
+static int sacdz_inflate_chunk(sacd_input_t dev, sacdz_chunk_t *slot)
+{
+    sacdz_input_t *z = dev->sacdz;
+    uLongf   size = sacdz_chunk_sectors(dev, slot->chunk) * SACD_LSN_SIZE;
+    uint32_t length = z->chunk_length[slot->chunk];
+
+    // stored chunks are read as-is
+    if (length == size)
+    {
+        return sacd_input_pread(dev, dev->fd, (off_t) z->chunk_offset[slot->chunk], length, slot->data) == (ssize_t) length ? 0 : -1;
+    }
+
+    if (length > compressBound(z->chunk_sectors * SACD_LSN_SIZE) ||
+        sacd_input_pread(dev, dev->fd, (off_t) z->chunk_offset[slot->chunk], length, slot->compressed) != (ssize_t) length)
+    {
+        return -1;
+    }
+    if (uncompress(slot->data, &size, slot->compressed, length) != Z_OK || size != sacdz_chunk_sectors(dev, slot->chunk) * SACD_LSN_SIZE)
+    {
+        fprintf(stderr, "libsacdread: chunk %u of the compressed image is corrupt.\n", slot->chunk);
+        return -1;
+    }
+    return 0;
+}
+
+static void *sacdz_inflate_thread(void *arg)
+{
+    sacd_input_t   dev = (sacd_input_t) arg;
+    sacdz_input_t *z = dev->sacdz;
+
+    pthread_mutex_lock(&z->mutex);
+    for (;;)
+    {
+        sacdz_chunk_t *slot = 0;
+        int i, ret;
+
+        for (i = 0; i < z->slot_count && !slot; i++)
+        {
+            if (z->chunks[i].state == CHUNK_QUEUED)
+                slot = &z->chunks[i];
+        }
+        if (!slot)
+        {
+            if (z->stop)
+                break;
+            pthread_cond_wait(&z->chunk_queued, &z->mutex);
+            continue;
+        }
+        slot->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&z->mutex);
+
+        ret = sacdz_inflate_chunk(dev, slot);
+
+        pthread_mutex_lock(&z->mutex);
+        slot->state = (ret == 0) ? CHUNK_READY : CHUNK_FAILED;
+        pthread_cond_broadcast(&z->chunk_ready);
+    }
+    pthread_mutex_unlock(&z->mutex);
+
+    return 0;
+}
+
+/**
+ * returns the slot holding the chunk, or the least recently used slot that
+ * can be reused. Must be called with the lock held.
+ */
+static sacdz_chunk_t *sacdz_find_slot(sacdz_input_t *z, uint32_t chunk, int *found)
+{
+    sacdz_chunk_t *lru = 0;
+    int i;
+
+    for (i = 0; i < z->slot_count; i++)
+    {
+        sacdz_chunk_t *slot = &z->chunks[i];
+
+        if (slot->state != CHUNK_EMPTY && slot->chunk == chunk)
+        {
+            *found = 1;
+            return slot;
+        }
+        if (slot->users == 0 && slot->state != CHUNK_QUEUED && slot->state != CHUNK_BUSY &&
+            (!lru || slot->last_used < lru->last_used))
+        {
+            lru = slot;
+        }
+    }
+    *found = 0;
+    return lru;
+}
+
+/**
+ * returns the inflated chunk with an extra user, must be called with the lock held
+ */
+static sacdz_chunk_t *sacdz_get_chunk(sacd_input_t dev, uint32_t chunk)
+{
+    sacdz_input_t *z = dev->sacdz;
+    sacdz_chunk_t *slot;
+    int found;
+
+    for (;;)
+    {
+        slot = sacdz_find_slot(z, chunk, &found);
+        if (!slot)
+        {
+            // all slots are in use, wait for one to become available
+            pthread_cond_wait(&z->chunk_ready, &z->mutex);
+            continue;
+        }
+        if (found && slot->state == CHUNK_BUSY)
+        {
+            pthread_cond_wait(&z->chunk_ready, &z->mutex);
+            continue;
+        }
+        break;
+    }
+
+    slot->users++;
+    slot->last_used = ++z->clock;
+
+    if (!found || slot->state == CHUNK_QUEUED || slot->state == CHUNK_FAILED)
+    {
+        // not inflated (yet), don't wait for the threads and do it right away
+        int ret;
+
+        slot->chunk = chunk;
+        slot->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&z->mutex);
+
+        ret = sacdz_inflate_chunk(dev, slot);
+
+        pthread_mutex_lock(&z->mutex);
+        slot->state = (ret == 0) ? CHUNK_READY : CHUNK_FAILED;
+        pthread_cond_broadcast(&z->chunk_ready);
+    }
+    return slot;
+}
+
+/**
+ * queues the chunks following the one being read, must be called with the lock held
+ */
+static void sacdz_read_ahead(sacd_input_t dev, uint32_t chunk)
+{
+    sacdz_input_t *z = dev->sacdz;
+    uint32_t next;
+
+    for (next = chunk + 1; next <= chunk + (uint32_t) z->thread_count && next < z->chunk_count; next++)
+    {
+        int found;
+        sacdz_chunk_t *slot = sacdz_find_slot(z, next, &found);
+
+        if (found)
+            continue;
+        if (!slot)
+            break;
+
+        slot->chunk = next;
+        slot->state = CHUNK_QUEUED;
+        slot->last_used = ++z->clock;
+        pthread_cond_signal(&z->chunk_queued);
+    }
+}
+
+static ssize_t sacd_sacdz_input_read(sacd_input_t dev, int pos, int blocks, void *buffer)
+{
+    sacdz_input_t *z = dev->sacdz;
+    uint8_t *ptr = (uint8_t *) buffer;
+    ssize_t  total = 0;
+
+    while (blocks > 0 && pos >= 0 && (uint32_t) pos < dev->total_sectors)
+    {
+        uint32_t       chunk = (uint32_t) pos / z->chunk_sectors;
+        uint32_t       first = (uint32_t) pos % z->chunk_sectors;
+        uint32_t       count = min((uint32_t) blocks, sacdz_chunk_sectors(dev, chunk) - first);
+        sacdz_chunk_t *slot;
+        int            failed;
+
+        pthread_mutex_lock(&z->mutex);
+        slot = sacdz_get_chunk(dev, chunk);
+        sacdz_read_ahead(dev, chunk);
+        failed = slot->state == CHUNK_FAILED;
+        pthread_mutex_unlock(&z->mutex);
+
+        if (!failed)
+        {
+            memcpy(ptr, slot->data + (size_t) first * SACD_LSN_SIZE, (size_t) count * SACD_LSN_SIZE);
+        }
+
+        pthread_mutex_lock(&z->mutex);
+        slot->users--;
+        pthread_cond_broadcast(&z->chunk_ready);
+        pthread_mutex_unlock(&z->mutex);
+
+        if (failed)
+        {
+            return total > 0 ? total : -1;
+        }
+
+        total += count;
+        pos += count;
+        blocks -= count;
+        ptr += (size_t) count * SACD_LSN_SIZE;
+    }
+
+    return total;
+}
+
+static ssize_t sacd_sacdz_input_view(sacd_input_t dev, int pos, int blocks, uint8_t **data)
+{
+    // inflated chunks are recycled, sectors can't be referenced
+    return 0;
+}
+
+static uint32_t sacd_sacdz_input_total_sectors(sacd_input_t dev)
+{
+    return dev ? dev->total_sectors : 0;
+}
+
+static int sacd_sacdz_input_close(sacd_input_t dev)
+{
+    sacdz_input_t *z = dev->sacdz;
+    int i, ret;
+
+    if (z)
+    {
+        pthread_mutex_lock(&z->mutex);
+        z->stop = 1;
+        pthread_cond_broadcast(&z->chunk_queued);
+        pthread_mutex_unlock(&z->mutex);
+        for (i = 0; i < z->thread_count; i++)
+        {
+            pthread_join(z->threads[i], NULL);
+        }
+
+        pthread_cond_destroy(&z->chunk_ready);
+        pthread_cond_destroy(&z->chunk_queued);
+        pthread_mutex_destroy(&z->mutex);
+
+        for (i = 0; z->chunks && i < z->slot_count; i++)
+        {
+            free(z->chunks[i].data);
+            free(z->chunks[i].compressed);
+        }
+        free(z->chunks);
+        free(z->threads);
+        free(z->chunk_offset);
+        free(z->chunk_length);
+        free(z);
+    }
+
+    ret = close(dev->fd);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+
+    return ret;
+}
+
+/**
+ * open a compressed image (.sacdz) and read its chunk index
+ */
+static sacd_input_t sacd_sacdz_input_open(const char *target)
+{
+    sacd_input_t   dev;
+    sacdz_input_t *z;
+    sacdz_header_t header;
+    sacdz_index_t *index = 0;
+    uint64_t       index_offset;
+    uint32_t       i;
+    int            thread_count;
+
+    dev = (sacd_input_t) calloc(sizeof(*dev), 1);
+    if (dev == NULL)
+    {
+        fprintf(stderr, "libsacdread: Could not allocate memory.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&dev->lock, NULL);
+
+#if defined(_WIN32)
+    dev->fd = open(target, O_RDONLY | O_BINARY);
+#else
+    dev->fd = open(target, O_RDONLY);
+#endif
+    z = dev->sacdz = (sacdz_input_t *) calloc(1, sizeof(sacdz_input_t));
+    if (dev->fd < 0 || !z)
+    {
+        goto error;
+    }
+    pthread_mutex_init(&z->mutex, NULL);
+    pthread_cond_init(&z->chunk_queued, NULL);
+    pthread_cond_init(&z->chunk_ready, NULL);
+
+    if (sacd_input_pread(dev, dev->fd, 0, SACDZ_HEADER_SIZE, (uint8_t *) &header) != SACDZ_HEADER_SIZE ||
+        memcmp(header.id, SACDZ_ID, 8) != 0 || hton16(header.version) != SACDZ_VERSION)
+    {
+        fprintf(stderr, "libsacdread: %s is not a supported compressed image.\n", target);
+        goto error;
+    }
+    index_offset = hton64(header.index_offset);
+    z->chunk_sectors = hton32(header.chunk_sectors);
+    z->chunk_count = hton32(header.chunk_count);
+    dev->total_sectors = hton32(header.total_sectors);
+    if (z->chunk_sectors == 0 || z->chunk_sectors > SACDZ_MAX_CHUNK_SECTORS)
+    {
+        fprintf(stderr, "libsacdread: %s has an unsupported chunk size.\n", target);
+        goto error;
+    }
+    if (index_offset == 0 || 
+        z->chunk_count != ((uint64_t) dev->total_sectors + z->chunk_sectors - 1) / z->chunk_sectors)
+    {
+        fprintf(stderr, "libsacdread: %s is incomplete.\n", target);
+        goto error;
+    }
+
+    index = (sacdz_index_t *) malloc((size_t) z->chunk_count * SACDZ_INDEX_SIZE + 1);
+    z->chunk_offset = (uint64_t *) calloc(z->chunk_count + 1, sizeof(uint64_t));
+    z->chunk_length = (uint32_t *) calloc(z->chunk_count + 1, sizeof(uint32_t));
+    if (!index || !z->chunk_offset || !z->chunk_length ||
+        sacd_input_pread(dev, dev->fd, (off_t) index_offset, (size_t) z->chunk_count * SACDZ_INDEX_SIZE, (uint8_t *) index) != (ssize_t) z->chunk_count * SACDZ_INDEX_SIZE)
+    {
+        goto error;
+    }
+    for (i = 0; i < z->chunk_count; i++)
+    {
+        z->chunk_offset[i] = hton64(index[i].offset);
+        z->chunk_length[i] = hton32(index[i].length);
+    }
+    free(index);
+    index = 0;
+
+    thread_count = get_processor_count();
+    z->slot_count = thread_count * 2 + 2;
+    z->chunks = (sacdz_chunk_t *) calloc(z->slot_count, sizeof(sacdz_chunk_t));
+    z->threads = (pthread_t *) calloc(thread_count, sizeof(pthread_t));
+    if (!z->chunks || !z->threads)
+    {
+        goto error;
+    }
+    for (i = 0; i < (uint32_t) z->slot_count; i++)
+    {
+        z->chunks[i].data = (uint8_t *) malloc((size_t) z->chunk_sectors * SACD_LSN_SIZE);
+        z->chunks[i].compressed = (uint8_t *) malloc(compressBound((uLong) z->chunk_sectors * SACD_LSN_SIZE));
+        if (!z->chunks[i].data || !z->chunks[i].compressed)
+        {
+            goto error;
+        }
+    }
+    for (i = 0; i < (uint32_t) thread_count; i++)
+    {
+        if (pthread_create(&z->threads[i], NULL, sacdz_inflate_thread, dev) != 0)
+        {
+            break;
+        }
+        z->thread_count++;
+    }
+
+    return dev;
+
+error:
+
+    free(index);
+    if (dev->fd < 0)
+    {
+        free(dev->sacdz);
+        pthread_mutex_destroy(&dev->lock);
+        free(dev);
+        return 0;
+    }
+    sacd_sacdz_input_close(dev);
+
+    return 0;
+}
+#endif
+
+static const sacd_input_ops_t sacd_dev_input_ops =
+{
+    sacd_dev_input_open,
+    sacd_dev_input_close,
+    sacd_dev_input_read,
+    sacd_dev_input_view,
+    sacd_dev_input_error,
+    sacd_dev_input_authenticate,
+    sacd_dev_input_decrypt,
+    sacd_dev_input_total_sectors
+};
+
+static const sacd_input_ops_t sacd_net_input_ops =
+{
+    sacd_net_input_open,
+    sacd_net_input_close,
+    sacd_net_input_read,
+    sacd_net_input_view,
+    sacd_dev_input_error,
+    sacd_dev_input_authenticate,
+    sacd_dev_input_decrypt,
+    sacd_net_input_total_sectors
+};
+
+#if defined(SACD_INPUT_SACDZ)
+static const sacd_input_ops_t sacd_sacdz_input_ops =
+{
+    sacd_sacdz_input_open,
+    sacd_sacdz_input_close,
+    sacd_sacdz_input_read,
+    sacd_sacdz_input_view,
+    sacd_dev_input_error,
+    sacd_dev_input_authenticate,
+    sacd_dev_input_decrypt,
+    sacd_sacdz_input_total_sectors
+};
+#endif
+
 /**
- * Setup read functions with either network or file access
+ * Select the read functions with either network or file access
  */
-int sacd_input_setup(const char* path)
+const sacd_input_ops_t *sacd_input_setup(const char* path)
 {
     int net_conn = 0;
     {
@@ -593,24 +1557,15 @@ int sacd_input_setup(const char* path)
 
     if (net_conn)
     {
-        sacd_input_open = sacd_net_input_open;
-        sacd_input_close = sacd_net_input_close;
-        sacd_input_read = sacd_net_input_read;
-        sacd_input_error = sacd_dev_input_error;
-        sacd_input_authenticate  = sacd_dev_input_authenticate;
-        sacd_input_decrypt = sacd_dev_input_decrypt;
-        sacd_input_total_sectors = sacd_net_input_total_sectors;
-
-        return 1;
+        return &sacd_net_input_ops;
     } 
 
-    sacd_input_open = sacd_dev_input_open;
-    sacd_input_close = sacd_dev_input_close;
-    sacd_input_read = sacd_dev_input_read;
-    sacd_input_error = sacd_dev_input_error;
-    sacd_input_authenticate  = sacd_dev_input_authenticate;
-    sacd_input_decrypt = sacd_dev_input_decrypt;
-    sacd_input_total_sectors = sacd_dev_input_total_sectors;
+#if defined(SACD_INPUT_SACDZ)
+    if (is_compressed_image(path))
+    {
+        return &sacd_sacdz_input_ops;
+    }
+#endif
 
-    return 0;
-} 
\ No newline at end of file
+    return &sacd_dev_input_ops;
+}
@@ -48,14 +48,26 @@
 
 typedef struct sacd_input_s * sacd_input_t;
 
-extern sacd_input_t (*sacd_input_open)         (const char *);
-extern int          (*sacd_input_close)        (sacd_input_t);
-extern ssize_t      (*sacd_input_read)         (sacd_input_t, int, int, void *);
-extern char *       (*sacd_input_error)        (sacd_input_t);
-extern int          (*sacd_input_authenticate) (sacd_input_t);
-extern int          (*sacd_input_decrypt)      (sacd_input_t, uint8_t *, int);
-extern uint32_t     (*sacd_input_total_sectors)(sacd_input_t);
-
-int sacd_input_setup(const char *); 
+/**
+ * Input backend functions, every opened input carries its own table so
+ * several inputs (of different types) can be used at the same time.
+ *
+ * read, view and total_sectors may be called concurrently from several
+ * threads on the same input. authenticate and decrypt may not.
+ */
+typedef struct sacd_input_ops_s
+{
+    sacd_input_t (*open)         (const char *);
+    int          (*close)        (sacd_input_t);
+    ssize_t      (*read)         (sacd_input_t, int, int, void *);
+    ssize_t      (*view)         (sacd_input_t, int, int, uint8_t **);
+    char *       (*error)        (sacd_input_t);
+    int          (*authenticate) (sacd_input_t);
+    int          (*decrypt)      (sacd_input_t, uint8_t *, int);
+    uint32_t     (*total_sectors)(sacd_input_t);
+}
+sacd_input_ops_t;
+
+const sacd_input_ops_t *sacd_input_setup(const char *); 
 
 #endif /* SACD_INPUT_H_INCLUDED */
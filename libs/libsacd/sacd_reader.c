@@ -41,9 +41,34 @@
 #include <mntent.h>
 #endif
 
+#ifndef __lv2ppu__
+#include <pthread.h>
+#endif
+
+#include <utils.h>
+#include <timeout.h>
+
+#include "scarletbook.h"
 #include "sacd_input.h"
 #include "sacd_reader.h"
 
+/**
+ * TOC and text sectors are read with small requests, these are kept in a
+ * small LRU cache so opening the same disc again does not hit the device
+ * (or the network) for every table.
+ */
+#define SACD_CACHE_ENTRIES          8
+#define SACD_CACHE_MAX_SECTORS      64
+
+typedef struct
+{
+    uint8_t    *data;
+    uint32_t    lsn;
+    uint32_t    sectors;                // 0 for an unused entry
+    uint32_t    last_used;
+}
+sacd_cache_entry_t;
+
 struct sacd_reader_s
 {
     /* Basic information. */
@@ -51,6 +76,16 @@ struct sacd_reader_s
 
     /* Information required for an image file. */
     sacd_input_t dev;
+    const sacd_input_ops_t *input;
+
+    /* Sector cache. */
+    sacd_cache_entry_t cache[SACD_CACHE_ENTRIES];
+    uint32_t     cache_clock;
+    uint32_t     cache_hits;
+    uint32_t     cache_misses;
+#ifndef __lv2ppu__
+    pthread_mutex_t cache_lock;
+#endif
 };
 
 /**
@@ -60,24 +95,29 @@ static sacd_reader_t *sacd_open_image_file(const char *location)
 {
     sacd_reader_t *sacd;
     sacd_input_t  dev;
+    const sacd_input_ops_t *input;
 
-    sacd_input_setup(location);
+    input = sacd_input_setup(location);
 
-    dev = sacd_input_open(location);
+    dev = input->open(location);
     if (!dev)
     {
         fprintf(stderr, "libsacdread: Can't open %s for reading\n", location);
         return NULL;
     }
 
-    sacd = (sacd_reader_t *) malloc(sizeof(sacd_reader_t));
+    sacd = (sacd_reader_t *) calloc(1, sizeof(sacd_reader_t));
     if (!sacd)
     {
-        sacd_input_close(dev);
+        input->close(dev);
         return NULL;
     }
     sacd->is_image_file = 1;
     sacd->dev           = dev;
+    sacd->input         = input;
+#ifndef __lv2ppu__
+    pthread_mutex_init(&sacd->cache_lock, NULL);
+#endif
 
     return sacd;
 }
@@ -170,6 +210,21 @@ sacd_reader_t *sacd_open(const char *ppath)
 
     if (ret < 0)
     {
+        /* maybe the name of a split image? open it through its first part */
+        char *first_part = malloc(strlen(path) + 5);
+        if (first_part)
+        {
+            sprintf(first_part, "%s.001", path);
+            if (stat(first_part, &fileinfo) == 0 && S_ISREG(fileinfo.st_mode))
+            {
+                ret_val = sacd_open_image_file(first_part);
+                free(first_part);
+                free(path);
+                return ret_val;
+            }
+            free(first_part);
+        }
+
         /* maybe "host:port" url? try opening it with acCeSS library */
         if (strchr(path, ':'))
         {
@@ -360,35 +415,147 @@ sacd_reader_t *sacd_open(const char *ppath)
 
 void sacd_close(sacd_reader_t *sacd)
 {
+    int i;
+
     if (sacd)
     {
         if (sacd->dev)
-            sacd_input_close(sacd->dev);
+            sacd->input->close(sacd->dev);
+        for (i = 0; i < SACD_CACHE_ENTRIES; i++)
+        {
+            free(sacd->cache[i].data);
+        }
+#ifndef __lv2ppu__
+        pthread_mutex_destroy(&sacd->cache_lock);
+#endif
         free(sacd);
     }
 }
 
-ssize_t sacd_read_block_raw(sacd_reader_t *sacd, uint32_t lb_number,
-                            size_t block_count, unsigned char *data)
+/**
+ * copies the requested sectors from the cache, returns 0 on a miss
+ */
+static int sacd_cache_lookup(sacd_reader_t *sacd, uint32_t lb_number, size_t block_count, unsigned char *data)
+{
+    int i;
+
+    for (i = 0; i < SACD_CACHE_ENTRIES; i++)
+    {
+        sacd_cache_entry_t *entry = &sacd->cache[i];
+
+        if (entry->sectors > 0 && lb_number >= entry->lsn &&
+            lb_number + block_count <= entry->lsn + entry->sectors)
+        {
+            memcpy(data, entry->data + (lb_number - entry->lsn) * SACD_LSN_SIZE, block_count * SACD_LSN_SIZE);
+            entry->last_used = ++sacd->cache_clock;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * stores the sectors in the least recently used entry
+ */
+static void sacd_cache_insert(sacd_reader_t *sacd, uint32_t lb_number, size_t block_count, const unsigned char *data)
+{
+    sacd_cache_entry_t *entry = &sacd->cache[0];
+    int i;
+
+    for (i = 1; i < SACD_CACHE_ENTRIES && entry->sectors > 0; i++)
+    {
+        if (sacd->cache[i].sectors == 0 || sacd->cache[i].last_used < entry->last_used)
+            entry = &sacd->cache[i];
+    }
+
+    if (!entry->data)
+    {
+        entry->data = (uint8_t *) malloc(SACD_CACHE_MAX_SECTORS * SACD_LSN_SIZE);
+        if (!entry->data)
+            return;
+    }
+    memcpy(entry->data, data, block_count * SACD_LSN_SIZE);
+    entry->lsn = lb_number;
+    entry->sectors = (uint32_t) block_count;
+    entry->last_used = ++sacd->cache_clock;
+}
+
+static ssize_t sacd_read_block_uncached(sacd_reader_t *sacd, uint32_t lb_number,
+                                        size_t block_count, unsigned char *data)
 {
-    ssize_t ret;
     if (!sacd->dev)
     {
         fprintf(stderr, "libsacdread: Fatal error in block read.\n");
         return 0;
     }
 
-    ret = sacd_input_read(sacd->dev, (int) lb_number, (int) block_count, (char *) data);
+    return sacd->input->read(sacd->dev, (int) lb_number, (int) block_count, (char *) data);
+}
+
+ssize_t sacd_read_block_raw(sacd_reader_t *sacd, uint32_t lb_number,
+                            size_t block_count, unsigned char *data)
+{
+    ssize_t ret;
+
+    // large (audio) reads bypass the cache
+    if (block_count == 0 || block_count > SACD_CACHE_MAX_SECTORS)
+    {
+        return sacd_read_block_uncached(sacd, lb_number, block_count, data);
+    }
+
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&sacd->cache_lock);
+#endif
+    if (sacd_cache_lookup(sacd, lb_number, block_count, data))
+    {
+        sacd->cache_hits++;
+        ret = (ssize_t) block_count;
+    }
+    else
+    {
+        sacd->cache_misses++;
+        ret = sacd_read_block_uncached(sacd, lb_number, block_count, data);
+        if (ret == (ssize_t) block_count)
+        {
+            sacd_cache_insert(sacd, lb_number, block_count, data);
+        }
+    }
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&sacd->cache_lock);
+#endif
 
     return ret;
 }
 
+void sacd_get_cache_stats(sacd_reader_t *sacd, uint32_t *hits, uint32_t *misses)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&sacd->cache_lock);
+#endif
+    if (hits)
+        *hits = sacd->cache_hits;
+    if (misses)
+        *misses = sacd->cache_misses;
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&sacd->cache_lock);
+#endif
+}
+
+ssize_t sacd_read_block_view(sacd_reader_t *sacd, uint32_t lb_number,
+                             size_t block_count, uint8_t **data)
+{
+    if (!sacd->dev)
+        return 0;
+
+    return sacd->input->view(sacd->dev, (int) lb_number, (int) block_count, data);
+}
+
 int sacd_authenticate(sacd_reader_t *sacd)
 {
     if (!sacd->dev)
         return 0;
 
-    return sacd_input_authenticate(sacd->dev);
+    return sacd->input->authenticate(sacd->dev);
 }
 
 int sacd_decrypt(sacd_reader_t *sacd, uint8_t *buffer, int blocks)
@@ -396,7 +563,7 @@ int sacd_decrypt(sacd_reader_t *sacd, uint8_t *buffer, int blocks)
     if (!sacd->dev)
         return 0;
 
-    return sacd_input_decrypt(sacd->dev, buffer, blocks);
+    return sacd->input->decrypt(sacd->dev, buffer, blocks);
 }
 
 uint32_t sacd_get_total_sectors(sacd_reader_t *sacd)
@@ -404,6 +571,547 @@ uint32_t sacd_get_total_sectors(sacd_reader_t *sacd)
     if (!sacd->dev)
         return 0;
 
-    return sacd_input_total_sectors(sacd->dev);
+    return sacd->input->total_sectors(sacd->dev);
+}
+
+/**
+ * Sectors that have to be copied (block devices, network) are read with a
+ * transfer size that follows the measured throughput: starting at
+ * MAX_PROCESSING_BLOCK_SIZE the size is doubled (or halved) for as long as
+ * every READ_AHEAD_WINDOW_SECTORS read gets faster.
+ */
+#define READ_AHEAD_MIN_TRANSFER         32
+#define READ_AHEAD_WINDOW_SECTORS       (16 * MAX_PROCESSING_BLOCK_SIZE)
+
+// block buffers are aligned for O_DIRECT reads
+#define READ_AHEAD_BUFFER_ALIGNMENT     4096
+
+// attempts per range before a failing range is split in half (recovery mode)
+#define READ_AHEAD_RETRIES              2
+
+typedef struct
+{
+    uint8_t            *buffer;
+    uint8_t            *data;           // either buffer or a view into the image
+    uint32_t            lsn;
+    ssize_t             sectors;
+    int                 refs;           // the consumer and the holds on the block
+
+    uint32_t           *bad_sectors;    // unreadable sectors that were zero filled
+    int                 bad_sector_count;
+    int                 bad_sector_size;
+}
+sacd_read_ahead_block_t;
+
+struct sacd_read_ahead_s
+{
+    sacd_reader_t              *sacd;
+
+    sacd_read_ahead_block_t    *blocks;
+    int                         block_count;
+    int                         head;           // next block to fill
+    int                         tail;           // oldest block that is still in use
+    int                         out;            // next block to hand out
+    int                         current;        // block last handed out
+    int                         filled;         // blocks from tail to head
+    int                         ready;          // completed blocks waiting for the consumer
+
+    uint32_t                    lsn;
+    uint32_t                    end_lsn;
+    sacd_block_size_callback_t  block_size_callback;
+    void                       *userdata;
+
+    int                         stop;
+    int                         done;
+    int                         recovery;
+
+    uint32_t                    transfer_size;  // sectors per read
+    int                         adaptive;       // transfer_size follows the measured throughput
+    int                         adapt_direction;
+    int                         adapt_reversals;
+    uint32_t                    best_transfer_size;
+    double                      best_throughput;
+    uint32_t                    window_sectors;
+    double                      window_time;
+#ifndef __lv2ppu__
+    int                         running;
+    pthread_t                   thread_id;
+    pthread_mutex_t             mutex;
+    pthread_cond_t              block_filled;
+    pthread_cond_t              block_released;
+#endif
+};
+
+static uint32_t read_ahead_block_size(sacd_read_ahead_t *ra)
+{
+    uint32_t block_size = min(ra->end_lsn - ra->lsn, ra->transfer_size);
+
+    if (ra->block_size_callback)
+    {
+        block_size = min(block_size, ra->block_size_callback(ra->lsn, ra->end_lsn, ra->userdata));
+    }
+    return block_size;
+}
+
+/**
+ * hill-climbs the transfer size, settles on the fastest size once both
+ * directions stopped improving. Called with the lock held.
+ */
+static void read_ahead_adapt(sacd_read_ahead_t *ra, uint32_t sectors, double elapsed)
+{
+    double   throughput;
+    uint32_t next;
+
+    if (!ra->adaptive || ra->adapt_reversals >= 2)
+        return;
+
+    ra->window_sectors += sectors;
+    ra->window_time += elapsed;
+    if (ra->window_sectors < READ_AHEAD_WINDOW_SECTORS || ra->window_time <= 0.0)
+        return;
+
+    throughput = ra->window_sectors / ra->window_time;
+    ra->window_sectors = 0;
+    ra->window_time = 0.0;
+
+    if (throughput > ra->best_throughput * 1.05)
+    {
+        ra->best_throughput = throughput;
+        ra->best_transfer_size = ra->transfer_size;
+    }
+    else
+    {
+        // no gain, continue from the best size in the other direction
+        ra->adapt_direction = -ra->adapt_direction;
+        ra->adapt_reversals++;
+    }
+
+    while (ra->adapt_reversals < 2)
+    {
+        next = (ra->adapt_direction > 0) ? ra->best_transfer_size * 2 : ra->best_transfer_size / 2;
+        if (next >= READ_AHEAD_MIN_TRANSFER && next <= READ_AHEAD_MAX_TRANSFER)
+        {
+            ra->transfer_size = next;
+            return;
+        }
+        ra->adapt_direction = -ra->adapt_direction;
+        ra->adapt_reversals++;
+    }
+    ra->transfer_size = ra->best_transfer_size;
 }
 
+/**
+ * reads a range that failed, the range is retried and then split in half
+ * until the unreadable sectors are isolated. These are zero filled and
+ * recorded with the block.
+ */
+static void read_ahead_recover(sacd_read_ahead_t *ra, sacd_read_ahead_block_t *block, uint32_t lsn, uint32_t sectors, uint8_t *data)
+{
+    uint32_t half;
+    int      retry;
+
+    for (retry = 0; retry < READ_AHEAD_RETRIES; retry++)
+    {
+        if (sacd_read_block_uncached(ra->sacd, lsn, sectors, data) == (ssize_t) sectors)
+            return;
+    }
+
+    if (sectors == 1)
+    {
+        memset(data, 0, SACD_LSN_SIZE);
+        if (block->bad_sector_count == block->bad_sector_size)
+        {
+            uint32_t *bad_sectors;
+            
+            bad_sectors = (uint32_t *) realloc(block->bad_sectors, (block->bad_sector_size + 16) * sizeof(uint32_t));
+            if (!bad_sectors)
+                return;
+            block->bad_sectors = bad_sectors;
+            block->bad_sector_size += 16;
+        }
+        block->bad_sectors[block->bad_sector_count++] = lsn;
+        fprintf(stderr, "libsacdread: unreadable sector %u\n", lsn);
+        return;
+    }
+
+    half = sectors / 2;
+    read_ahead_recover(ra, block, lsn, half, data);
+    read_ahead_recover(ra, block, lsn + half, sectors - half, data + (size_t) half * SACD_LSN_SIZE);
+}
+
+/**
+ * reads a block into its buffer, in recovery mode the block is always
+ * completed
+ */
+static ssize_t read_ahead_read_block(sacd_read_ahead_t *ra, sacd_read_ahead_block_t *block, uint32_t lsn, uint32_t block_size)
+{
+    double  elapsed;
+    ssize_t ret;
+
+    block->data = block->buffer;
+    block->bad_sector_count = 0;
+
+    elapsed = timeout_gettime();
+    ret = sacd_read_block_uncached(ra->sacd, lsn, block_size, block->data);
+    elapsed = timeout_gettime() - elapsed;
+
+    if (ret == (ssize_t) block_size)
+    {
+        // the transfer size is shared with sacd_read_ahead_set_transfer_size
+#ifndef __lv2ppu__
+        pthread_mutex_lock(&ra->mutex);
+#endif
+        read_ahead_adapt(ra, (uint32_t) ret, elapsed);
+#ifndef __lv2ppu__
+        pthread_mutex_unlock(&ra->mutex);
+#endif
+    }
+    else if (ra->recovery)
+    {
+        uint32_t good = (ret > 0) ? (uint32_t) ret : 0;
+
+        read_ahead_recover(ra, block, lsn + good, block_size - good, block->data + (size_t) good * SACD_LSN_SIZE);
+        ret = block_size;
+    }
+    return ret;
+}
+
+#ifndef __lv2ppu__
+static void *read_ahead_thread(void *arg)
+{
+    sacd_read_ahead_t *ra = (sacd_read_ahead_t *) arg;
+
+    pthread_mutex_lock(&ra->mutex);
+    while (!ra->stop)
+    {
+        sacd_read_ahead_block_t *block;
+        uint32_t lsn, block_size;
+        ssize_t ret;
+
+        while (ra->filled == ra->block_count && !ra->stop)
+        {
+            pthread_cond_wait(&ra->block_released, &ra->mutex);
+        }
+        if (ra->stop)
+            break;
+
+        if (ra->lsn >= ra->end_lsn)
+        {
+            break;
+        }
+
+        // the block at head is never handed out while not filled, so it
+        // is safe to read into it without holding the lock
+        block = &ra->blocks[ra->head];
+        lsn = ra->lsn;
+        block_size = read_ahead_block_size(ra);
+        pthread_mutex_unlock(&ra->mutex);
+
+        // image files are referenced in-place, other inputs are copied into the block buffer
+        ret = sacd_read_block_view(ra->sacd, lsn, block_size, &block->data);
+        if (ret > 0)
+        {
+            block->bad_sector_count = 0;
+        }
+        else
+        {
+            ret = read_ahead_read_block(ra, block, lsn, block_size);
+        }
+
+        pthread_mutex_lock(&ra->mutex);
+        if (ret <= 0)
+        {
+            fprintf(stderr, "libsacdread: read-ahead failed at sector %u\n", lsn);
+            break;
+        }
+        block->lsn = lsn;
+        block->sectors = ret;
+        ra->lsn += (uint32_t) ret;
+        ra->head = (ra->head + 1) % ra->block_count;
+        ra->filled++;
+        ra->ready++;
+        pthread_cond_signal(&ra->block_filled);
+    }
+    ra->done = 1;
+    pthread_cond_signal(&ra->block_filled);
+    pthread_mutex_unlock(&ra->mutex);
+
+    return 0;
+}
+#endif
+
+sacd_read_ahead_t *sacd_read_ahead_create(sacd_reader_t *sacd, int block_count)
+{
+    sacd_read_ahead_t *ra;
+    int i;
+
+    ra = (sacd_read_ahead_t *) calloc(1, sizeof(sacd_read_ahead_t));
+    if (!ra)
+        return NULL;
+
+#ifdef __lv2ppu__
+    // blocks are read synchronously on the caller's thread
+    block_count = 1;
+#endif
+    ra->sacd = sacd;
+    ra->transfer_size = MAX_PROCESSING_BLOCK_SIZE;
+    ra->best_transfer_size = MAX_PROCESSING_BLOCK_SIZE;
+    ra->adaptive = 1;
+    ra->adapt_direction = 1;
+#ifndef __lv2ppu__
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->block_filled, NULL);
+    pthread_cond_init(&ra->block_released, NULL);
+#endif
+    ra->block_count = max(block_count, 1);
+    ra->blocks = (sacd_read_ahead_block_t *) calloc(ra->block_count, sizeof(sacd_read_ahead_block_t));
+    if (!ra->blocks)
+    {
+        sacd_read_ahead_destroy(ra);
+        return NULL;
+    }
+    for (i = 0; i < ra->block_count; i++)
+    {
+#if defined(_WIN32)
+        ra->blocks[i].buffer = (uint8_t *) _aligned_malloc(READ_AHEAD_MAX_TRANSFER * SACD_LSN_SIZE, READ_AHEAD_BUFFER_ALIGNMENT);
+#elif defined(__lv2ppu__)
+        ra->blocks[i].buffer = (uint8_t *) memalign(READ_AHEAD_BUFFER_ALIGNMENT, READ_AHEAD_MAX_TRANSFER * SACD_LSN_SIZE);
+#else
+        if (posix_memalign((void **) &ra->blocks[i].buffer, READ_AHEAD_BUFFER_ALIGNMENT, READ_AHEAD_MAX_TRANSFER * SACD_LSN_SIZE) != 0)
+            ra->blocks[i].buffer = 0;
+#endif
+        if (!ra->blocks[i].buffer)
+        {
+            sacd_read_ahead_destroy(ra);
+            return NULL;
+        }
+    }
+
+    return ra;
+}
+
+void sacd_read_ahead_set_recovery(sacd_read_ahead_t *ra, int recovery)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&ra->mutex);
+#endif
+    ra->recovery = recovery;
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&ra->mutex);
+#endif
+}
+
+void sacd_read_ahead_set_transfer_size(sacd_read_ahead_t *ra, uint32_t sectors)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&ra->mutex);
+#endif
+    if (sectors == 0)
+    {
+        ra->adaptive = 1;
+        ra->adapt_reversals = 0;
+        ra->best_throughput = 0.0;
+        ra->window_sectors = 0;
+        ra->window_time = 0.0;
+    }
+    else
+    {
+        ra->adaptive = 0;
+        ra->transfer_size = min(sectors, READ_AHEAD_MAX_TRANSFER);
+    }
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&ra->mutex);
+#endif
+}
+
+int sacd_read_ahead_start(sacd_read_ahead_t *ra, uint32_t start_lsn, uint32_t end_lsn, sacd_block_size_callback_t block_size_callback, void *userdata)
+{
+    int i;
+
+    sacd_read_ahead_stop(ra);
+
+    ra->lsn = start_lsn;
+    ra->end_lsn = end_lsn;
+    ra->block_size_callback = block_size_callback;
+    ra->userdata = userdata;
+    ra->head = ra->tail = ra->out = ra->current = 0;
+    ra->filled = ra->ready = 0;
+    for (i = 0; i < ra->block_count; i++)
+    {
+        ra->blocks[i].refs = 0;
+    }
+    ra->stop = 0;
+    ra->done = 0;
+
+#ifndef __lv2ppu__
+    if (pthread_create(&ra->thread_id, NULL, read_ahead_thread, ra) != 0)
+    {
+        fprintf(stderr, "libsacdread: Could not create read-ahead thread.\n");
+        ra->done = 1;
+        return -1;
+    }
+    ra->running = 1;
+#endif
+    return 0;
+}
+
+ssize_t sacd_read_ahead_next(sacd_read_ahead_t *ra, uint32_t *lsn, uint8_t **data)
+{
+    sacd_read_ahead_block_t *block;
+
+#ifdef __lv2ppu__
+    {
+        ssize_t ret;
+
+        if (ra->stop || ra->done || ra->lsn >= ra->end_lsn)
+            return 0;
+
+        block = &ra->blocks[0];
+        ret = read_ahead_read_block(ra, block, ra->lsn, read_ahead_block_size(ra));
+        if (ret <= 0)
+        {
+            ra->done = 1;
+            return 0;
+        }
+        block->lsn = ra->lsn;
+        block->sectors = ret;
+        ra->lsn += (uint32_t) ret;
+    }
+#else
+    pthread_mutex_lock(&ra->mutex);
+    while (ra->ready == 0 && !ra->done && !ra->stop)
+    {
+        pthread_cond_wait(&ra->block_filled, &ra->mutex);
+    }
+    if (ra->ready == 0 || ra->stop)
+    {
+        pthread_mutex_unlock(&ra->mutex);
+        return 0;
+    }
+    ra->current = ra->out;
+    ra->out = (ra->out + 1) % ra->block_count;
+    ra->ready--;
+    block = &ra->blocks[ra->current];
+    block->refs = 1;
+    pthread_mutex_unlock(&ra->mutex);
+#endif
+
+    *lsn = block->lsn;
+    *data = block->data;
+    return block->sectors;
+}
+
+int sacd_read_ahead_bad_sectors(sacd_read_ahead_t *ra, const uint32_t **lsns)
+{
+#ifdef __lv2ppu__
+    sacd_read_ahead_block_t *block = &ra->blocks[0];
+#else
+    sacd_read_ahead_block_t *block = &ra->blocks[ra->current];
+#endif
+
+    *lsns = block->bad_sectors;
+    return block->bad_sector_count;
+}
+
+#ifndef __lv2ppu__
+// blocks are reused in order, a held block keeps the blocks after it as well
+static void read_ahead_free_blocks(sacd_read_ahead_t *ra)
+{
+    while (ra->filled > ra->ready && ra->blocks[ra->tail].refs == 0)
+    {
+        ra->tail = (ra->tail + 1) % ra->block_count;
+        ra->filled--;
+        pthread_cond_signal(&ra->block_released);
+    }
+}
+#endif
+
+void sacd_read_ahead_release(sacd_read_ahead_t *ra)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&ra->mutex);
+    if (ra->filled > ra->ready && ra->blocks[ra->current].refs > 0)
+    {
+        ra->blocks[ra->current].refs--;
+        read_ahead_free_blocks(ra);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+#endif
+}
+
+void *sacd_read_ahead_hold(sacd_read_ahead_t *ra)
+{
+#ifdef __lv2ppu__
+    return &ra->blocks[0];
+#else
+    sacd_read_ahead_block_t *block;
+
+    pthread_mutex_lock(&ra->mutex);
+    block = &ra->blocks[ra->current];
+    block->refs++;
+    pthread_mutex_unlock(&ra->mutex);
+
+    return block;
+#endif
+}
+
+void sacd_read_ahead_unhold(sacd_read_ahead_t *ra, void *held)
+{
+#ifndef __lv2ppu__
+    sacd_read_ahead_block_t *block = (sacd_read_ahead_block_t *) held;
+
+    pthread_mutex_lock(&ra->mutex);
+    if (block->refs > 0)
+    {
+        block->refs--;
+        read_ahead_free_blocks(ra);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+#endif
+}
+
+void sacd_read_ahead_stop(sacd_read_ahead_t *ra)
+{
+#ifdef __lv2ppu__
+    ra->stop = 1;
+#else
+    if (!ra->running)
+        return;
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->block_released);
+    pthread_cond_broadcast(&ra->block_filled);
+    pthread_mutex_unlock(&ra->mutex);
+
+    pthread_join(ra->thread_id, NULL);
+    ra->running = 0;
+#endif
+}
+
+void sacd_read_ahead_destroy(sacd_read_ahead_t *ra)
+{
+    int i;
+
+    if (!ra)
+        return;
+
+    sacd_read_ahead_stop(ra);
+
+#ifndef __lv2ppu__
+    pthread_cond_destroy(&ra->block_released);
+    pthread_cond_destroy(&ra->block_filled);
+    pthread_mutex_destroy(&ra->mutex);
+#endif
+    for (i = 0; ra->blocks && i < ra->block_count; i++)
+    {
+#ifdef _WIN32
+        _aligned_free(ra->blocks[i].buffer);
+#else
+        free(ra->blocks[i].buffer);
+#endif
+        free(ra->blocks[i].bad_sectors);
+    }
+    free(ra->blocks);
+    free(ra);
+}
@@ -45,12 +45,20 @@ extern "C" {
 
 /**
  * Opaque type that is used as a handle for one instance of an opened SACD.
+ *
+ * Readers are independent of each other, several SACDs can be opened and
+ * read at the same time. A single reader may be shared between threads for
+ * sacd_read_block_raw, sacd_read_block_view and sacd_get_total_sectors;
+ * sacd_authenticate and sacd_decrypt must be called from one thread only.
  */
 typedef struct sacd_reader_s   sacd_reader_t;
 
 /**
  * Opens a block device of a SACD-ROM file, or an image file.
  *
+ * Split images (image.iso.001, image.iso.002, ..) are opened as one image
+ * by passing either the first part or the name without the part number.
+ *
  * @param path Specifies the the device or file to be used.
  * @return If successful a a read handle is returned. Otherwise 0 is returned.
  *
@@ -81,6 +89,156 @@ void sacd_close(sacd_reader_t *);
  */
 ssize_t sacd_read_block_raw(sacd_reader_t *, uint32_t, size_t, unsigned char *);
 
+/**
+ * Returns the hit and miss counters of the sector cache. Small reads (TOC,
+ * text and other metadata) are served from a per-reader LRU cache, reads
+ * done by the read-ahead engine are never cached.
+ *
+ * @param sacd A read handle that should have been returned by sacd_open.
+ * @param hits Set to the amount of reads served from the cache, may be 0.
+ * @param misses Set to the amount of reads passed on to the input, may be 0.
+ *
+ * sacd_get_cache_stats(sacd, &hits, &misses);
+ */
+void sacd_get_cache_stats(sacd_reader_t *, uint32_t *, uint32_t *);
+
+/**
+ * Returns a pointer to block_count sectors starting at lb_number without
+ * copying them, this is only supported for (memory mapped) image files.
+ * The sectors stay valid until the reader is closed and may be modified
+ * in-place (e.g. decrypted) without affecting the image.
+ *
+ * @param sacd A read handle that should have been returned by sacd_open.
+ * @param lb_number The block number to start at.
+ * @param block_count The amount of blocks to reference.
+ * @param data Set to the first referenced sector.
+ * @return The amount of sectors available (can be less than block_count at
+ *         the end of the image or of a part of a split image), 0 when views
+ *         are not supported.
+ *
+ * sectors = sacd_read_block_view(sacd, lb_number, block_count, &data);
+ */
+ssize_t sacd_read_block_view(sacd_reader_t *, uint32_t, size_t, uint8_t **);
+
+/**
+ * Opaque type that is used as a handle for the asynchronous read-ahead engine.
+ */
+typedef struct sacd_read_ahead_s sacd_read_ahead_t;
+
+// the most sectors a read-ahead block holds
+#ifdef __lv2ppu__
+#define READ_AHEAD_MAX_TRANSFER         MAX_PROCESSING_BLOCK_SIZE
+#else
+#define READ_AHEAD_MAX_TRANSFER         (4 * MAX_PROCESSING_BLOCK_SIZE)
+#endif
+
+/**
+ * Returns the maximum amount of sectors that can be read as one block starting
+ * at lsn, this allows the consumer to split blocks at (encryption) boundaries.
+ */
+typedef uint32_t (*sacd_block_size_callback_t)(uint32_t lsn, uint32_t end_lsn, void *userdata);
+
+/**
+ * Creates a read-ahead engine that keeps up to block_count blocks in flight
+ * on a background thread. Blocks referencing a memory mapped image hold up
+ * to MAX_PROCESSING_BLOCK_SIZE sectors, blocks that are read (devices,
+ * network) follow the transfer size, see sacd_read_ahead_set_transfer_size.
+ *
+ * @param sacd The read handle the blocks are read from.
+ * @param block_count The amount of blocks to read ahead.
+ *
+ * read_ahead = sacd_read_ahead_create(sacd, 4);
+ */
+sacd_read_ahead_t *sacd_read_ahead_create(sacd_reader_t *, int);
+
+/**
+ * Enables or disables recovery mode. A block that can't be read is retried
+ * and split in half until the unreadable sectors are found, these are zero
+ * filled so the block is always completed.
+ *
+ * sacd_read_ahead_set_recovery(read_ahead, 1);
+ */
+void sacd_read_ahead_set_recovery(sacd_read_ahead_t *, int);
+
+/**
+ * Sets the amount of sectors requested per read, 0 (the default) has the
+ * engine pick the size that gives the highest measured throughput. Can be
+ * called while reading ahead, the next block that is read uses the size.
+ *
+ * @param read_ahead The read-ahead engine.
+ * @param sectors The transfer size, limited to READ_AHEAD_MAX_TRANSFER.
+ *
+ * sacd_read_ahead_set_transfer_size(read_ahead, 0);
+ */
+void sacd_read_ahead_set_transfer_size(sacd_read_ahead_t *, uint32_t);
+
+/**
+ * Starts reading ahead from start_lsn up to (not including) end_lsn.
+ *
+ * @param read_ahead The read-ahead engine.
+ * @param start_lsn The first block number to read.
+ * @param end_lsn The block number to stop at.
+ * @param block_size_callback Optional callback that limits the block sizes.
+ * @param userdata Passed to the block size callback.
+ *
+ * sacd_read_ahead_start(read_ahead, start_lsn, end_lsn, block_size_callback, userdata);
+ */
+int sacd_read_ahead_start(sacd_read_ahead_t *, uint32_t, uint32_t, sacd_block_size_callback_t, void *);
+
+/**
+ * Waits for the next completed block. The block stays valid until it is
+ * handed back with sacd_read_ahead_release.
+ *
+ * @return The amount of sectors in the block, 0 at the end of the range or
+ *         when the read failed.
+ *
+ * sectors = sacd_read_ahead_next(read_ahead, &lsn, &data);
+ */
+ssize_t sacd_read_ahead_next(sacd_read_ahead_t *, uint32_t *, uint8_t **);
+
+/**
+ * Returns the sectors of the block returned by sacd_read_ahead_next that
+ * could not be read in recovery mode, these sectors are zero filled.
+ *
+ * @return The amount of unreadable sectors in the block.
+ *
+ * count = sacd_read_ahead_bad_sectors(read_ahead, &lsns);
+ */
+int sacd_read_ahead_bad_sectors(sacd_read_ahead_t *, const uint32_t **);
+
+/**
+ * Hands the block returned by sacd_read_ahead_next back to the engine.
+ */
+void sacd_read_ahead_release(sacd_read_ahead_t *);
+
+/**
+ * Keeps the block returned by sacd_read_ahead_next valid after it has been
+ * released, e.g. while another thread writes it out. Blocks are reused in
+ * order, so a held block stalls the read-ahead once the others are used up.
+ * All blocks need to be unheld before the engine is started again.
+ *
+ * @return The hold, to be passed to sacd_read_ahead_unhold.
+ *
+ * hold = sacd_read_ahead_hold(read_ahead);
+ */
+void *sacd_read_ahead_hold(sacd_read_ahead_t *);
+
+/**
+ * Hands back a block kept by sacd_read_ahead_hold, can be called from any
+ * thread.
+ */
+void sacd_read_ahead_unhold(sacd_read_ahead_t *, void *);
+
+/**
+ * Stops reading ahead and waits for outstanding reads to complete.
+ */
+void sacd_read_ahead_stop(sacd_read_ahead_t *);
+
+/**
+ * Stops and frees the read-ahead engine.
+ */
+void sacd_read_ahead_destroy(sacd_read_ahead_t *);
+
 /**
  * Decrypts audio sectors, only available on PS3
  */
@@ -0,0 +1,92 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef SACDZ_H_INCLUDED
+#define SACDZ_H_INCLUDED
+
+#include <inttypes.h>
+#include "endianess.h"
+
+#undef ATTRIBUTE_PACKED
+#undef PRAGMA_PACK_BEGIN
+#undef PRAGMA_PACK_END
+
+#if defined(__GNUC__)
+#if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 95)
+#define ATTRIBUTE_PACKED    __attribute__ ((packed))
+#define PRAGMA_PACK         0
+#endif
+#endif
+
+#if !defined(ATTRIBUTE_PACKED)
+#define ATTRIBUTE_PACKED
+#define PRAGMA_PACK                            1
+#endif
+
+/**
+ * Compressed SACD image (.sacdz)
+ *
+ * The image is cut into chunks of SACDZ_CHUNK_SECTORS sectors, every chunk
+ * is deflated on its own so any sector can be reached by inflating a
+ * single chunk. The chunk index is stored at the end of the file, the
+ * header (which is rewritten when the image is complete) points to it.
+ *
+ *   header | chunk 0 | chunk 1 | .. | chunk n-1 | index
+ *
+ * All values are stored in big endian. A chunk of which the stored length
+ * equals its uncompressed length is stored as-is.
+ */
+
+#define SACDZ_ID                            "SACDZIMG"
+#define SACDZ_VERSION                       1
+#define SACDZ_CHUNK_SECTORS                 32          // 64KB chunks
+#define SACDZ_MAX_CHUNK_SECTORS             512         // largest chunk a reader accepts
+
+#if PRAGMA_PACK
+#pragma pack(1)
+#endif
+
+struct sacdz_header_t
+{
+    char     id[8];                         // SACDZIMG
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t chunk_sectors;
+    uint32_t total_sectors;
+    uint32_t chunk_count;
+    uint64_t index_offset;                  // 0 while the image is being written
+} ATTRIBUTE_PACKED;
+typedef struct sacdz_header_t   sacdz_header_t;
+#define SACDZ_HEADER_SIZE    32U
+
+struct sacdz_index_t
+{
+    uint64_t offset;
+    uint32_t length;
+} ATTRIBUTE_PACKED;
+typedef struct sacdz_index_t   sacdz_index_t;
+#define SACDZ_INDEX_SIZE    12U
+
+#if PRAGMA_PACK
+#pragma pack()
+#endif
+
+#endif  /* SACDZ_H_INCLUDED */
@@ -0,0 +1,399 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifdef HAVE_ZLIB
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <utils.h>
+#include <logging.h>
+
+#include "scarletbook_output.h"
+#include "sacdz.h"
+
+#define SACDZ_CHUNK_SIZE    (SACDZ_CHUNK_SECTORS * SACD_LSN_SIZE)
+
+enum
+{
+    SLOT_FREE = 0,                      // available for new sectors
+    SLOT_QUEUED,                        // waiting for a compression thread
+    SLOT_BUSY,                          // being compressed
+    SLOT_DONE                           // compressed, waiting to be written
+};
+
+typedef struct
+{
+    int                 state;
+    uint8_t            *data;
+    uint32_t            sectors;
+    uint8_t            *compressed;
+    uLongf              compressed_size;
+}
+sacdz_slot_t;
+
+/**
+ * Chunks are compressed by a pool of threads, the ring of slots keeps them
+ * in order: the slot that is filled next is always written out first.
+ */
+typedef struct
+{
+    sacdz_slot_t       *slots;
+    int                 slot_count;
+    int                 fill;           // slot receiving sectors
+    int                 flush;          // oldest slot that still needs to be written
+
+    pthread_t          *threads;
+    int                 thread_count;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      slot_queued;
+    pthread_cond_t      slot_done;
+    int                 stop;
+
+    sacdz_index_t      *index;
+    uint32_t            chunk_count;
+    uint32_t            index_size;
+    uint64_t            offset;
+    uint32_t            total_sectors;
+    int                 error;          // a chunk or the index could not be written
+}
+sacdz_handle_t;
+
+static void sacdz_compress_slot(sacdz_slot_t *slot)
+{
+    slot->compressed_size = compressBound(SACDZ_CHUNK_SIZE);
+    if (compress2(slot->compressed, &slot->compressed_size, slot->data, slot->sectors * SACD_LSN_SIZE, Z_DEFAULT_COMPRESSION) != Z_OK ||
+        slot->compressed_size >= slot->sectors * SACD_LSN_SIZE)
+    {
+        // incompressible chunks are stored as-is
+        slot->compressed_size = 0;
+    }
+}
+
+static void *sacdz_compress_thread(void *arg)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) arg;
+
+    pthread_mutex_lock(&handle->mutex);
+    for (;;)
+    {
+        sacdz_slot_t *slot = 0;
+        int i;
+
+        // pick the oldest queued chunk
+        for (i = 0; i < handle->slot_count && !slot; i++)
+        {
+            sacdz_slot_t *candidate = &handle->slots[(handle->flush + i) % handle->slot_count];
+            if (candidate->state == SLOT_QUEUED)
+                slot = candidate;
+        }
+        if (!slot)
+        {
+            if (handle->stop)
+                break;
+            pthread_cond_wait(&handle->slot_queued, &handle->mutex);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&handle->mutex);
+
+        sacdz_compress_slot(slot);
+
+        pthread_mutex_lock(&handle->mutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&handle->slot_done);
+    }
+    pthread_mutex_unlock(&handle->mutex);
+
+    return 0;
+}
+
+static int sacdz_write_header(scarletbook_output_format_t *ft, uint64_t index_offset)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    sacdz_header_t  header;
+
+    memset(&header, 0, sizeof(sacdz_header_t));
+    memcpy(header.id, SACDZ_ID, 8);
+    header.version = hton16(SACDZ_VERSION);
+    header.chunk_sectors = hton32(SACDZ_CHUNK_SECTORS);
+    header.total_sectors = hton32(handle->total_sectors);
+    header.chunk_count = hton32(handle->chunk_count);
+    header.index_offset = hton64(index_offset);
+
+    return fwrite(&header, 1, SACDZ_HEADER_SIZE, ft->fd) == SACDZ_HEADER_SIZE ? 0 : -1;
+}
+
+/**
+ * waits for the oldest chunk and appends it to the image, returns -1 when
+ * it could not be written
+ */
+static int sacdz_flush_slot(scarletbook_output_format_t *ft)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    sacdz_slot_t   *slot = &handle->slots[handle->flush];
+    const uint8_t  *data;
+    uint32_t        length;
+
+    pthread_mutex_lock(&handle->mutex);
+    while (slot->state != SLOT_DONE)
+    {
+        pthread_cond_wait(&handle->slot_done, &handle->mutex);
+    }
+    pthread_mutex_unlock(&handle->mutex);
+
+    // the slot is released in any case, so closing does not wait for it again
+    slot->state = SLOT_FREE;
+    handle->flush = (handle->flush + 1) % handle->slot_count;
+
+    if (handle->error)
+    {
+        slot->sectors = 0;
+        return -1;
+    }
+
+    if (handle->chunk_count == handle->index_size)
+    {
+        uint32_t       index_size = max(handle->index_size * 2, 1024);
+        sacdz_index_t *index = (sacdz_index_t *) realloc(handle->index, index_size * sizeof(sacdz_index_t));
+
+        if (!index)
+        {
+            LOG(lm_main, LOG_ERROR, ("could not grow the chunk index of %s", ft->filename));
+            handle->error = 1;
+            slot->sectors = 0;
+            return -1;
+        }
+        handle->index = index;
+        handle->index_size = index_size;
+    }
+
+    if (slot->compressed_size > 0)
+    {
+        data = slot->compressed;
+        length = (uint32_t) slot->compressed_size;
+    }
+    else
+    {
+        data = slot->data;
+        length = slot->sectors * SACD_LSN_SIZE;
+    }
+    slot->sectors = 0;
+    if (fwrite(data, 1, length, ft->fd) != length)
+    {
+        LOG(lm_main, LOG_ERROR, ("error writing %s, errno: %d, %s", ft->filename, errno, strerror(errno)));
+        handle->error = 1;
+        return -1;
+    }
+    handle->index[handle->chunk_count].offset = hton64(handle->offset);
+    handle->index[handle->chunk_count].length = hton32(length);
+    handle->chunk_count++;
+    handle->offset += length;
+
+    return 0;
+}
+
+/**
+ * hands the chunk being filled to the compression threads, without them it
+ * is compressed right here
+ */
+static int sacdz_queue_slot(scarletbook_output_format_t *ft)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    sacdz_slot_t   *slot = &handle->slots[handle->fill];
+
+    if (handle->thread_count == 0)
+    {
+        sacdz_compress_slot(slot);
+        slot->state = SLOT_DONE;
+    }
+    else
+    {
+        pthread_mutex_lock(&handle->mutex);
+        slot->state = SLOT_QUEUED;
+        pthread_cond_signal(&handle->slot_queued);
+        pthread_mutex_unlock(&handle->mutex);
+    }
+
+    handle->fill = (handle->fill + 1) % handle->slot_count;
+
+    // the ring is full, make room by writing out the oldest chunk
+    if (handle->slots[handle->fill].state != SLOT_FREE)
+    {
+        return sacdz_flush_slot(ft);
+    }
+    return 0;
+}
+
+static int sacdz_create(scarletbook_output_format_t *ft)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    int thread_count = get_processor_count();
+    int i;
+
+    pthread_mutex_init(&handle->mutex, NULL);
+    pthread_cond_init(&handle->slot_queued, NULL);
+    pthread_cond_init(&handle->slot_done, NULL);
+
+    handle->slot_count = thread_count * 2 + 2;
+    handle->slots = (sacdz_slot_t *) calloc(handle->slot_count, sizeof(sacdz_slot_t));
+    handle->threads = (pthread_t *) calloc(thread_count, sizeof(pthread_t));
+    if (!handle->slots || !handle->threads)
+    {
+        handle->error = 1;
+        return -1;
+    }
+    for (i = 0; i < handle->slot_count; i++)
+    {
+        handle->slots[i].data = (uint8_t *) malloc(SACDZ_CHUNK_SIZE);
+        handle->slots[i].compressed = (uint8_t *) malloc(compressBound(SACDZ_CHUNK_SIZE));
+        if (!handle->slots[i].data || !handle->slots[i].compressed)
+        {
+            handle->error = 1;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&handle->threads[i], NULL, sacdz_compress_thread, handle) != 0)
+        {
+            LOG(lm_main, LOG_ERROR, ("could not create compression thread"));
+            break;
+        }
+    }
+    // without threads the chunks are compressed while they are written
+    handle->thread_count = i;
+
+    // the final header is written once the index is known
+    handle->offset = SACDZ_HEADER_SIZE;
+
+    if (sacdz_write_header(ft, 0) != 0)
+    {
+        handle->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static size_t sacdz_write_frame(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    size_t          sectors_left = len;
+
+    if (handle->error)
+    {
+        return 0;
+    }
+
+    while (sectors_left > 0)
+    {
+        sacdz_slot_t *slot = &handle->slots[handle->fill];
+        uint32_t      sectors = (uint32_t) min(sectors_left, (size_t) (SACDZ_CHUNK_SECTORS - slot->sectors));
+
+        memcpy(slot->data + slot->sectors * SACD_LSN_SIZE, buf, sectors * SACD_LSN_SIZE);
+        slot->sectors += sectors;
+        buf += sectors * SACD_LSN_SIZE;
+        sectors_left -= sectors;
+        handle->total_sectors += sectors;
+
+        if (slot->sectors == SACDZ_CHUNK_SECTORS && sacdz_queue_slot(ft) != 0)
+        {
+            return (len - sectors_left) * SACD_LSN_SIZE;
+        }
+    }
+
+    return len * SACD_LSN_SIZE;
+}
+
+static int sacdz_close(scarletbook_output_format_t *ft)
+{
+    sacdz_handle_t *handle = (sacdz_handle_t *) ft->priv;
+    int i, ret = 0;
+
+    // queue the partial last chunk and write out all pending chunks
+    if (!handle->error && handle->slots[handle->fill].sectors > 0)
+    {
+        sacdz_queue_slot(ft);
+    }
+    while (!handle->error && handle->slots[handle->flush].state != SLOT_FREE)
+    {
+        sacdz_flush_slot(ft);
+    }
+
+    // the header keeps index offset 0 when the image is incomplete
+    if (!handle->error &&
+        (fwrite(handle->index, SACDZ_INDEX_SIZE, handle->chunk_count, ft->fd) != handle->chunk_count ||
+         fseek(ft->fd, 0, SEEK_SET) != 0 || sacdz_write_header(ft, handle->offset) != 0 || fflush(ft->fd) != 0))
+    {
+        LOG(lm_main, LOG_ERROR, ("error writing %s, errno: %d, %s", ft->filename, errno, strerror(errno)));
+        handle->error = 1;
+    }
+    ret = handle->error ? -1 : 0;
+
+    pthread_mutex_lock(&handle->mutex);
+    handle->stop = 1;
+    pthread_cond_broadcast(&handle->slot_queued);
+    pthread_mutex_unlock(&handle->mutex);
+    for (i = 0; i < handle->thread_count; i++)
+    {
+        pthread_join(handle->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&handle->slot_done);
+    pthread_cond_destroy(&handle->slot_queued);
+    pthread_mutex_destroy(&handle->mutex);
+
+    for (i = 0; handle->slots && i < handle->slot_count; i++)
+    {
+        free(handle->slots[i].data);
+        free(handle->slots[i].compressed);
+    }
+    free(handle->slots);
+    free(handle->threads);
+    free(handle->index);
+
+    return ret;
+}
+
+scarletbook_format_handler_t const * sacdz_format_fn(void)
+{
+    static scarletbook_format_handler_t handler =
+    {
+        "Compressed ISO Image",
+        "sacdz",
+        sacdz_create,
+        sacdz_write_frame,
+        0,
+        sacdz_close,
+        OUTPUT_FLAG_RAW | OUTPUT_FLAG_SEEKABLE,
+        sizeof(sacdz_handle_t),
+        0,
+        0
+    };
+    return &handler;
+}
+
+#endif
@@ -65,6 +65,7 @@
 #define MAX_DST_SIZE                   (1024 * 64)
 #define SAMPLES_PER_FRAME              588
 #define FRAME_SIZE_64                 (SAMPLES_PER_FRAME * 64 / 8)
+#define DSD_SILENCE_BYTE               0x69
 #define SUPPORTED_VERSION_MAJOR        1
 #define SUPPORTED_VERSION_MINOR        20
 
@@ -540,6 +541,34 @@ typedef struct
 } 
 ATTRIBUTE_PACKED audio_sector_t;
 
+// the header of an audio sector decoded into plain fields, the same on
+// little and big endian systems
+typedef struct
+{
+    uint16_t                packet_length;
+    uint8_t                 frame_start;
+    uint8_t                 data_type;
+}
+audio_packet_desc_t;
+
+typedef struct
+{
+    int                     timecode;           // frame number, as TIME_FRAMECOUNT
+    int                     sector_count;       // DST encoded frames only
+    int                     channel_count;
+}
+audio_frame_desc_t;
+
+typedef struct
+{
+    int                     packet_count;
+    int                     frame_count;
+    int                     dst_encoded;
+    audio_packet_desc_t     packet[7];
+    audio_frame_desc_t      frame[7];
+}
+audio_sector_desc_t;
+
 typedef struct  
 {
     uint8_t                  * area_data;
@@ -557,19 +586,53 @@ typedef struct
 }
 scarletbook_area_t;
 
+// most pieces a frame is handed out in before it is copied together
+#define MAX_FRAME_SEGMENTS 32
+
+// a piece of an audio frame, it points into the sectors that were read
+typedef struct scarletbook_frame_segment_t
+{
+    const uint8_t      *data;
+    size_t              size;
+}
+scarletbook_frame_segment_t;
+
 typedef struct scarletbook_audio_frame_t
 {
-    uint8_t            *data;
+    uint8_t            *data;                   // the frame is copied here when it has to be contiguous
     int                 size;
     int                 started;
 
+    scarletbook_frame_segment_t segments[MAX_FRAME_SEGMENTS];
+    int                 segment_count;
+
     int                 sector_count;
     int                 channel_count;
 
     int                 dst_encoded;
+
+    int                 timecode;               // frame number of the frame being read
+    uint32_t            start_lsn;              // sector the frame starts in, 0 when not known
+    int                 start_offset;           // of the frame in that sector
+    uint32_t            end_lsn;                // sector the frame ends in
+    int                 last_timecode;          // frame number of the last complete frame, -1 for none
+    int                 last_size;
+    int                 damaged;                // sectors were lost since the last complete frame
 } 
 scarletbook_audio_frame_t;
 
+// frame reassembly state of a track being read
+typedef struct
+{
+    scarletbook_audio_frame_t  frame;
+    audio_sector_desc_t        audio_sector;
+    int                        packet_info_idx;
+    uint32_t                   lsn;             // of the next sector to be parsed, set by the caller, 0 when not known
+    uint32_t                   stop_lsn;        // parsing stops at the first frame that starts here or later, 0 for never
+    int                        stopped;
+}
+scarletbook_frame_parser_t;
+
 typedef struct
 {
     void                     * sacd;                                      // sacd_reader_t
@@ -583,10 +646,6 @@ typedef struct
     int                        mulch_area_idx;
     int                        area_count;
     scarletbook_area_t         area[2];
-
-    scarletbook_audio_frame_t  frame;
-    audio_sector_t             audio_sector;
-    int                        packet_info_idx;
 } 
 scarletbook_handle_t;
 
@@ -0,0 +1,307 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <charset.h>
+#include <logging.h>
+
+#include "scarletbook_index.h"
+
+#define INDEX_MAGIC         "SBIX"
+#define INDEX_VERSION       1
+#define INDEX_HEADER_SIZE   20
+#define INDEX_ENTRY_SIZE    8
+
+struct scarletbook_index_s
+{
+    char                       *path;
+    uint64_t                    identity;
+    int                         area_count;
+    uint32_t                    area_start[2];          // first sector of the audio of each area
+    int                         frame_count[2];
+    scarletbook_index_entry_t  *entries[2];
+    int                         modified;
+};
+
+static FILE *index_fopen(const char *path, const char *mode)
+{
+#ifdef _WIN32
+    wchar_t *wide_filename = (wchar_t *) charset_convert(path, strlen(path), "UTF-8", "UCS-2-INTERNAL");
+    wchar_t  wide_mode[4];
+    FILE    *fd;
+
+    mbstowcs(wide_mode, mode, 4);
+    fd = _wfopen(wide_filename, wide_mode);
+    free(wide_filename);
+    return fd;
+#else
+    return fopen(path, mode);
+#endif
+}
+
+// FNV-1a, the TOC sectors differ between discs and releases
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+    while (size--)
+    {
+        hash ^= *data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void load_index(scarletbook_index_t *index)
+{
+    uint8_t header[INDEX_HEADER_SIZE], count[4];
+    uint8_t *data;
+    FILE *fd = index_fopen(index->path, "rb");
+    int area, i;
+
+    if (!fd)
+        return;
+
+    if (fread(header, 1, INDEX_HEADER_SIZE, fd) != INDEX_HEADER_SIZE || memcmp(header, INDEX_MAGIC, 4) != 0 ||
+        get_be32(header + 4) != INDEX_VERSION ||
+        ((uint64_t) get_be32(header + 8) << 32 | get_be32(header + 12)) != index->identity ||
+        get_be32(header + 16) != (uint32_t) index->area_count)
+    {
+        fclose(fd);
+        return;
+    }
+
+    for (area = 0; area < index->area_count; area++)
+    {
+        if (fread(count, 1, 4, fd) != 4 || get_be32(count) != (uint32_t) index->frame_count[area])
+            break;
+
+        data = (uint8_t *) malloc((size_t) index->frame_count[area] * INDEX_ENTRY_SIZE);
+        if (!data)
+            break;
+
+        // a file that was cut short is not used
+        if (fread(data, INDEX_ENTRY_SIZE, index->frame_count[area], fd) != (size_t) index->frame_count[area])
+        {
+            free(data);
+            break;
+        }
+        for (i = 0; i < index->frame_count[area]; i++)
+        {
+            scarletbook_index_entry_t *entry = &index->entries[area][i];
+            const uint8_t *p = data + i * INDEX_ENTRY_SIZE;
+
+            entry->lsn = get_be32(p);
+            entry->offset = (uint16_t) (p[4] << 8 | p[5]);
+            entry->sector_count = p[6];
+        }
+        free(data);
+    }
+    fclose(fd);
+}
+
+scarletbook_index_t *scarletbook_index_open(scarletbook_handle_t *handle, const char *dir)
+{
+    scarletbook_index_t *index = (scarletbook_index_t *) calloc(1, sizeof(scarletbook_index_t));
+    char filename[32];
+    uint64_t identity = 0xcbf29ce484222325ULL;
+    int area;
+
+    if (!index)
+        return 0;
+
+    identity = hash_bytes(identity, handle->master_data, SACD_LSN_SIZE);
+    for (area = 0; area < handle->area_count; area++)
+    {
+        identity = hash_bytes(identity, handle->area[area].area_data, SACD_LSN_SIZE);
+
+        index->area_start[area] = handle->area[area].area_toc->track_start;
+        index->frame_count[area] = TIME_FRAMECOUNT(&handle->area[area].area_toc->total_playtime);
+        index->entries[area] = (scarletbook_index_entry_t *) calloc(index->frame_count[area] + 1, sizeof(scarletbook_index_entry_t));
+        if (!index->entries[area])
+        {
+            scarletbook_index_close(index);
+            return 0;
+        }
+    }
+    index->area_count = handle->area_count;
+    index->identity = identity;
+
+    // without a directory the index is kept in memory only
+    if (!dir)
+        return index;
+
+    snprintf(filename, sizeof(filename), "%016" PRIx64 ".index", identity);
+    index->path = (char *) malloc(strlen(dir) + strlen(filename) + 2);
+    if (!index->path)
+    {
+        scarletbook_index_close(index);
+        return 0;
+    }
+    sprintf(index->path, "%s/%s", dir, filename);
+
+    load_index(index);
+
+    return index;
+}
+
+int scarletbook_index_save(scarletbook_index_t *index)
+{
+    uint8_t header[INDEX_HEADER_SIZE], count[4];
+    uint8_t *data;
+    FILE *fd;
+    int area, i, result = 0;
+
+    fd = index_fopen(index->path, "wb");
+    if (!fd)
+    {
+        LOG(lm_main, LOG_ERROR, ("error writing index %s, errno: %d, %s", index->path, errno, strerror(errno)));
+        return -1;
+    }
+
+    memcpy(header, INDEX_MAGIC, 4);
+    put_be32(header + 4, INDEX_VERSION);
+    put_be32(header + 8, (uint32_t) (index->identity >> 32));
+    put_be32(header + 12, (uint32_t) index->identity);
+    put_be32(header + 16, (uint32_t) index->area_count);
+    if (fwrite(header, 1, INDEX_HEADER_SIZE, fd) != INDEX_HEADER_SIZE)
+        result = -1;
+
+    for (area = 0; area < index->area_count && result == 0; area++)
+    {
+        data = (uint8_t *) calloc(index->frame_count[area], INDEX_ENTRY_SIZE);
+        if (!data)
+        {
+            result = -1;
+            break;
+        }
+        for (i = 0; i < index->frame_count[area]; i++)
+        {
+            const scarletbook_index_entry_t *entry = &index->entries[area][i];
+            uint8_t *p = data + i * INDEX_ENTRY_SIZE;
+
+            put_be32(p, entry->lsn);
+            p[4] = (uint8_t) (entry->offset >> 8);
+            p[5] = (uint8_t) entry->offset;
+            p[6] = entry->sector_count;
+        }
+        put_be32(count, (uint32_t) index->frame_count[area]);
+        if (fwrite(count, 1, 4, fd) != 4 ||
+            fwrite(data, INDEX_ENTRY_SIZE, index->frame_count[area], fd) != (size_t) index->frame_count[area])
+        {
+            result = -1;
+        }
+        free(data);
+    }
+
+    if (fclose(fd) != 0)
+        result = -1;
+    if (result != 0)
+    {
+        LOG(lm_main, LOG_ERROR, ("error writing index %s", index->path));
+        return -1;
+    }
+
+    index->modified = 0;
+    return 0;
+}
+
+void scarletbook_index_close(scarletbook_index_t *index)
+{
+    int area;
+
+    if (!index)
+        return;
+
+    if (index->modified && index->path)
+    {
+        scarletbook_index_save(index);
+    }
+    for (area = 0; area < 2; area++)
+    {
+        free(index->entries[area]);
+    }
+    free(index->path);
+    free(index);
+}
+
+void scarletbook_index_add(scarletbook_index_t *index, int area, int frame, uint32_t lsn, int offset, int sector_count)
+{
+    scarletbook_index_entry_t *entry;
+
+    if (area < 0 || area >= index->area_count || frame < 0 || frame >= index->frame_count[area])
+        return;
+
+    entry = &index->entries[area][frame];
+    if (entry->lsn == lsn && entry->offset == offset)
+        return;
+
+    // the tracks of an area are indexed by several threads, each frame only by one of them
+    entry->lsn = lsn;
+    entry->offset = (uint16_t) offset;
+    entry->sector_count = (uint8_t) (sector_count > 255 ? 255 : sector_count);
+    index->modified = 1;
+}
+
+const scarletbook_index_entry_t *scarletbook_index_find(scarletbook_index_t *index, int area, int frame)
+{
+    if (area < 0 || area >= index->area_count || frame < 0 || frame >= index->frame_count[area])
+        return 0;
+
+    return index->entries[area][frame].lsn != 0 ? &index->entries[area][frame] : 0;
+}
+
+int scarletbook_index_get_frame_count(scarletbook_index_t *index, int area)
+{
+    return area >= 0 && area < index->area_count ? index->frame_count[area] : 0;
+}
+
+uint32_t scarletbook_index_seek(scarletbook_index_t *index, int area, int frame)
+{
+    if (area < 0 || area >= index->area_count)
+        return 0;
+
+    if (frame >= index->frame_count[area])
+        frame = index->frame_count[area] - 1;
+
+    for (; frame >= 0; frame--)
+    {
+        if (index->entries[area][frame].lsn != 0)
+            return index->entries[area][frame].lsn;
+    }
+    return index->area_start[area];
+}
@@ -0,0 +1,75 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef SCARLETBOOK_INDEX_H_INCLUDED
+#define SCARLETBOOK_INDEX_H_INCLUDED
+
+#include <stdint.h>
+
+#include "scarletbook.h"
+
+/**
+ * The frame index tells for each frame of an area in which sector it
+ * starts. It is filled while the frames are parsed and kept in a file named
+ * after the identity of the disc, a hash of its TOC sectors:
+ *
+ *   "SBIX" <version> <identity> <area count>
+ *   per area: <frame count> followed by an entry per frame
+ *
+ * All numbers are big endian, an entry is the lsn (32 bits), the offset in
+ * the sector (16 bits), the number of sectors (8 bits) and a reserved byte.
+ */
+typedef struct scarletbook_index_s scarletbook_index_t;
+
+typedef struct
+{
+    uint32_t            lsn;                        // sector the frame starts in, 0 when it was not indexed
+    uint16_t            offset;                     // of the first byte of the frame in that sector
+    uint8_t             sector_count;               // sectors the frame is spread over
+    uint8_t             reserved;
+}
+scarletbook_index_entry_t;
+
+// opens the index of the disc in directory dir, loading what was indexed before,
+// a NULL dir gives an index that is neither loaded nor saved
+scarletbook_index_t *scarletbook_index_open(scarletbook_handle_t *, const char *dir);
+
+// writes the index when frames were added, and frees it
+void scarletbook_index_close(scarletbook_index_t *);
+
+int scarletbook_index_save(scarletbook_index_t *);
+
+// frame is the frame number in the area, as in TIME_FRAMECOUNT
+void scarletbook_index_add(scarletbook_index_t *, int area, int frame, uint32_t lsn, int offset, int sector_count);
+
+// returns the entry of a frame, 0 when it was not indexed
+const scarletbook_index_entry_t *scarletbook_index_find(scarletbook_index_t *, int area, int frame);
+
+// returns the frames of an area that the index has room for
+int scarletbook_index_get_frame_count(scarletbook_index_t *, int area);
+
+/**
+ * returns the sector to start parsing at to read frame and the frames after
+ * it, that of the closest indexed frame before it or the start of the area
+ */
+uint32_t scarletbook_index_seek(scarletbook_index_t *, int area, int frame);
+
+#endif /* SCARLETBOOK_INDEX_H_INCLUDED */
@@ -0,0 +1,393 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __lv2ppu__
+#include <sys/file.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <charset.h>
+#include <logging.h>
+
+#include "scarletbook_journal.h"
+
+#define JOURNAL_LINE_SIZE 1024
+
+typedef struct
+{
+    char               *filename;
+    int                 done;
+    uint64_t            size;                       // of a completed file
+    uint32_t            lsn;                        // first sector that was not written
+
+    int                 has_state;                  // the file can be resumed at a frame
+    uint32_t            frame;
+    uint64_t            length;
+    uint8_t            *state;
+    size_t              state_size;
+    uint8_t            *log;
+    size_t              log_size;
+}
+journal_entry_t;
+
+struct scarletbook_journal_s
+{
+    FILE               *fd;
+    char               *path;
+    journal_entry_t    *entries;
+    int                 entry_count;
+#ifndef __lv2ppu__
+    pthread_mutex_t     lock;                       // files are written by several threads
+#endif
+};
+
+static FILE *journal_fopen(const char *path, const char *mode)
+{
+#ifdef _WIN32
+    wchar_t *wide_filename = (wchar_t *) charset_convert(path, strlen(path), "UTF-8", "UCS-2-INTERNAL");
+    wchar_t  wide_mode[4];
+    FILE    *fd;
+
+    mbstowcs(wide_mode, mode, 4);
+    fd = _wfopen(wide_filename, wide_mode);
+    free(wide_filename);
+    return fd;
+#else
+    return fopen(path, mode);
+#endif
+}
+
+static journal_entry_t *find_entry(scarletbook_journal_t *journal, const char *filename, int create)
+{
+    journal_entry_t *entries, *entry;
+    int i;
+
+    for (i = 0; i < journal->entry_count; i++)
+    {
+        if (strcmp(journal->entries[i].filename, filename) == 0)
+        {
+            return &journal->entries[i];
+        }
+    }
+    if (!create)
+        return 0;
+
+    entries = (journal_entry_t *) realloc(journal->entries, (journal->entry_count + 1) * sizeof(journal_entry_t));
+    if (!entries)
+        return 0;
+
+    journal->entries = entries;
+    entry = &journal->entries[journal->entry_count++];
+    memset(entry, 0, sizeof(journal_entry_t));
+    entry->filename = strdup(filename);
+
+    return entry;
+}
+
+// reads size bytes following a record, returns 0 when the record was cut short
+static uint8_t *read_blob(FILE *fd, uint64_t size)
+{
+    uint8_t *blob = (uint8_t *) malloc(size > 0 ? (size_t) size : 1);
+
+    if (blob && fread(blob, 1, (size_t) size, fd) != (size_t) size)
+    {
+        free(blob);
+        return 0;
+    }
+    return blob;
+}
+
+// the state of a frame record replaces the one before, its log replaces the
+// log of the earlier records from log_offset on
+static int load_state(FILE *fd, journal_entry_t *entry, uint64_t state_size, uint64_t log_offset, uint64_t log_size)
+{
+    uint8_t *state, *log, *grown;
+
+    state = read_blob(fd, state_size);
+    if (!state)
+        return -1;
+    log = read_blob(fd, log_size);
+    if (!log)
+    {
+        free(state);
+        return -1;
+    }
+
+    if (entry && log_offset <= entry->log_size)
+    {
+        grown = (uint8_t *) realloc(entry->log, (size_t) (log_offset + log_size) + 1);
+        if (grown)
+        {
+            memcpy(grown + log_offset, log, (size_t) log_size);
+            free(entry->state);
+            entry->log = grown;
+            entry->log_size = (size_t) (log_offset + log_size);
+            entry->state = state;
+            entry->state_size = (size_t) state_size;
+            entry->has_state = 1;
+            state = 0;
+        }
+        else
+        {
+            entry->has_state = 0;
+        }
+    }
+    else if (entry)
+    {
+        // the log has a gap, the file cannot be resumed at a frame
+        entry->has_state = 0;
+    }
+    free(state);
+    free(log);
+
+    return 0;
+}
+
+static void load_journal(scarletbook_journal_t *journal)
+{
+    char line[JOURNAL_LINE_SIZE];
+    FILE *fd = journal_fopen(journal->path, "rb");
+
+    if (!fd)
+        return;
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        journal_entry_t *entry;
+        uint64_t size, length, state_size, log_offset, log_size;
+        uint32_t lsn, frame;
+        int done, name_offset = 0;
+
+        // a line that was cut short by a crash has no line end
+        if (!strchr(line, '\n'))
+            break;
+        line[strcspn(line, "\r\n")] = 0;
+
+        if (sscanf(line, "done %" SCNu64 " %n", &size, &name_offset) == 1 && name_offset > 0)
+        {
+            done = 1;
+            lsn = 0;
+        }
+        else if (sscanf(line, "sector %" SCNu32 " %n", &lsn, &name_offset) == 1 && name_offset > 0)
+        {
+            done = 0;
+            size = 0;
+        }
+        else if (sscanf(line, "frame %" SCNu32 " %" SCNu32 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %n", 
+                        &frame, &lsn, &length, &state_size, &log_offset, &log_size, &name_offset) == 6 && name_offset > 0)
+        {
+            entry = find_entry(journal, line + name_offset, 1);
+            if (load_state(fd, entry, state_size, log_offset, log_size) != 0)
+                break;
+            if (entry && entry->has_state)
+            {
+                entry->done = 0;
+                entry->size = 0;
+                entry->lsn = lsn;
+                entry->frame = frame;
+                entry->length = length;
+            }
+            continue;
+        }
+        else
+        {
+            continue;
+        }
+
+        entry = find_entry(journal, line + name_offset, 1);
+        if (entry)
+        {
+            entry->done = done;
+            entry->size = size;
+            entry->lsn = lsn;
+        }
+    }
+    fclose(fd);
+}
+
+scarletbook_journal_t *scarletbook_journal_open(const char *path)
+{
+    scarletbook_journal_t *journal = (scarletbook_journal_t *) calloc(1, sizeof(scarletbook_journal_t));
+
+    if (!journal)
+        return 0;
+
+    journal->path = strdup(path);
+    load_journal(journal);
+
+    journal->fd = journal_fopen(path, "ab");
+    if (!journal->fd)
+    {
+        LOG(lm_main, LOG_ERROR, ("error opening journal %s, errno: %d, %s", path, errno, strerror(errno)));
+        scarletbook_journal_close(journal, 0);
+        return 0;
+    }
+#ifndef __lv2ppu__
+    pthread_mutex_init(&journal->lock, NULL);
+#endif
+
+    return journal;
+}
+
+void scarletbook_journal_close(scarletbook_journal_t *journal, int completed)
+{
+    int i;
+
+    if (!journal)
+        return;
+
+    if (journal->fd)
+    {
+        fclose(journal->fd);
+#ifndef __lv2ppu__
+        pthread_mutex_destroy(&journal->lock);
+#endif
+        // nothing is left to resume
+        if (completed)
+        {
+#ifdef __lv2ppu__
+            sysFsUnlink(journal->path);
+#else
+            remove(journal->path);
+#endif
+        }
+    }
+    for (i = 0; i < journal->entry_count; i++)
+    {
+        free(journal->entries[i].filename);
+        free(journal->entries[i].state);
+        free(journal->entries[i].log);
+    }
+    free(journal->entries);
+    free(journal->path);
+    free(journal);
+}
+
+static int get_file_size(const char *filename, uint64_t *size)
+{
+    struct stat stat_file;
+
+    if (stat(filename, &stat_file) != 0)
+        return -1;
+
+    *size = (uint64_t) stat_file.st_size;
+    return 0;
+}
+
+static void append_record(scarletbook_journal_t *journal, const char *record, uint64_t value, const char *filename)
+{
+    // the record is flushed right away, it must survive a crash
+    fprintf(journal->fd, "%s %" PRIu64 " %s\n", record, value, filename);
+    fflush(journal->fd);
+}
+
+int scarletbook_journal_is_done(scarletbook_journal_t *journal, const char *filename)
+{
+    journal_entry_t *entry = find_entry(journal, filename, 0);
+    uint64_t size;
+
+    return entry && entry->done && get_file_size(filename, &size) == 0 && size == entry->size;
+}
+
+uint32_t scarletbook_journal_get_sector(scarletbook_journal_t *journal, const char *filename)
+{
+    journal_entry_t *entry = find_entry(journal, filename, 0);
+    uint64_t size;
+
+    if (!entry || entry->done || get_file_size(filename, &size) != 0)
+        return 0;
+
+    return entry->lsn;
+}
+
+int scarletbook_journal_get_state(scarletbook_journal_t *journal, const char *filename, scarletbook_journal_state_t *state)
+{
+    journal_entry_t *entry = find_entry(journal, filename, 0);
+    uint64_t size;
+
+    // the file must still hold what was written up to the frame
+    if (!entry || entry->done || !entry->has_state || get_file_size(filename, &size) != 0 || size < entry->length)
+        return -1;
+
+    state->frame = entry->frame;
+    state->lsn = entry->lsn;
+    state->length = entry->length;
+    state->state = entry->state;
+    state->state_size = entry->state_size;
+    state->log = entry->log;
+    state->log_offset = 0;
+    state->log_size = entry->log_size;
+
+    return 0;
+}
+
+void scarletbook_journal_set_done(scarletbook_journal_t *journal, const char *filename)
+{
+    uint64_t size;
+
+    if (get_file_size(filename, &size) != 0)
+        return;
+
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&journal->lock);
+#endif
+    append_record(journal, "done", size, filename);
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&journal->lock);
+#endif
+}
+
+void scarletbook_journal_set_sector(scarletbook_journal_t *journal, const char *filename, uint32_t lsn)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&journal->lock);
+#endif
+    append_record(journal, "sector", lsn, filename);
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&journal->lock);
+#endif
+}
+
+void scarletbook_journal_set_state(scarletbook_journal_t *journal, const char *filename, const scarletbook_journal_state_t *state)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&journal->lock);
+#endif
+    // a record cut short by a crash is dropped when the journal is loaded
+    fprintf(journal->fd, "frame %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", 
+            state->frame, state->lsn, state->length, (uint64_t) state->state_size, 
+            (uint64_t) state->log_offset, (uint64_t) state->log_size, filename);
+    if (state->state_size > 0)
+        fwrite(state->state, 1, state->state_size, journal->fd);
+    if (state->log_size > 0)
+        fwrite(state->log, 1, state->log_size, journal->fd);
+    fflush(journal->fd);
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&journal->lock);
+#endif
+}
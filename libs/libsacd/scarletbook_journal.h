@@ -0,0 +1,79 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef SCARLETBOOK_JOURNAL_H_INCLUDED
+#define SCARLETBOOK_JOURNAL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The journal is a file next to the output that records the progress of a
+ * rip, one line per event:
+ *
+ *   done <size> <filename>     the file has been written completely
+ *   sector <lsn> <filename>    the sectors before lsn have been written
+ *   frame <frame> <lsn> <length> <state size> <log offset> <log size> <filename>
+ *                              the frames before frame have been written to
+ *                              the first length bytes of the file, the line is
+ *                              followed by the state and the log of the writer
+ *
+ * Later lines overrule earlier ones. A rip that was interrupted or crashed
+ * is resumed from it.
+ */
+typedef struct scarletbook_journal_s scarletbook_journal_t;
+
+// the writer of a file at a frame boundary
+typedef struct scarletbook_journal_state_t
+{
+    uint32_t            frame;                      // first frame that was not written
+    uint32_t            lsn;                        // the frame starts at or after this sector
+    uint64_t            length;                     // of the file up to the frame
+
+    const uint8_t      *state;                      // replaces the state of an earlier record
+    size_t              state_size;
+    const uint8_t      *log;                        // replaces the log of earlier records from log_offset on
+    size_t              log_offset;
+    size_t              log_size;
+}
+scarletbook_journal_state_t;
+
+// opens the journal, the records of an earlier rip are loaded
+scarletbook_journal_t *scarletbook_journal_open(const char *path);
+
+// the journal is removed when the rip has completed
+void scarletbook_journal_close(scarletbook_journal_t *, int completed);
+
+// returns 1 when the file was completed and has not changed since
+int scarletbook_journal_is_done(scarletbook_journal_t *, const char *filename);
+
+// returns the first sector that was not written to the file, 0 for none
+uint32_t scarletbook_journal_get_sector(scarletbook_journal_t *, const char *filename);
+
+// returns 0 when the file can be resumed at a frame, the state and the log
+// stay owned by the journal
+int scarletbook_journal_get_state(scarletbook_journal_t *, const char *filename, scarletbook_journal_state_t *);
+
+void scarletbook_journal_set_done(scarletbook_journal_t *, const char *filename);
+void scarletbook_journal_set_sector(scarletbook_journal_t *, const char *filename, uint32_t lsn);
+void scarletbook_journal_set_state(scarletbook_journal_t *, const char *filename, const scarletbook_journal_state_t *);
+
+#endif /* SCARLETBOOK_JOURNAL_H_INCLUDED */
@@ -19,21 +19,31 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE                 // fallocate
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #ifndef __APPLE__
 #include <malloc.h>
 #endif
 #include <errno.h>
 #include <assert.h>
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
 #ifdef __lv2ppu__
 #include <sys/file.h>
 #include <sys/thread.h>
 #elif defined(WIN32)
 #include <io.h>
+#else
+#include <unistd.h>
 #endif
 #ifndef __lv2ppu__
 #include <pthread.h>
@@ -43,17 +53,91 @@
 #include <charset.h>
 #include <utils.h>
 #include <logging.h>
+#include <timeout.h>
 
 #include "scarletbook_output.h"
 #include "scarletbook_read.h"
+#include "scarletbook_journal.h"
+#include "scarletbook_index.h"
 #include "sacd_reader.h"
 
 #define WRITE_CACHE_SIZE 1 * 1024 * 1024
 
+// number of MAX_PROCESSING_BLOCK_SIZE blocks read ahead of the processing thread
+#define READ_AHEAD_BLOCK_COUNT 4
+
+// the writer thread is fed through a ring of fixed size slots, a slot holds
+// a batch of frames or a run of sectors
+#define WRITE_QUEUE_SLOTS 8
+#define WRITE_QUEUE_SLOT_SIZE (512 * SACD_LSN_SIZE)
+#define WRITE_QUEUE_BATCH (WRITE_QUEUE_SLOTS / 2)
+
+// frames are handed on in batches of up to a second of audio that fit a
+// write queue slot, so the cost of a hand over is paid once per batch
+#define FRAME_BATCH_COUNT SACD_FRAME_RATE
+#define FRAME_BATCH_SIZE WRITE_QUEUE_SLOT_SIZE
+
+// upper limit of the number of files ripped at the same time
+#define MAX_WORKER_COUNT 16
+
+// a block is split in parts of at least two of the largest frames, so that
+// each part ends in the one after it
+#define MAX_PARSE_THREAD_COUNT 8
+#define MIN_PARSE_CHUNK_SIZE (2 * MAX_DST_SIZE / SACD_LSN_SIZE)
+
+// a part runs up to the end of its block, which is read ahead as one, and
+// its first frame may have started in the block before
+#define PARSE_CHUNK_DATA_SIZE (READ_AHEAD_MAX_TRANSFER * SACD_LSN_SIZE + MAX_DST_SIZE)
+#define PARSE_CHUNK_FRAME_COUNT (READ_AHEAD_MAX_TRANSFER * 7 + 1)
+
+// the progress of a resumable file is journaled every 32MB
+#define JOURNAL_INTERVAL_SIZE (16384 * SACD_LSN_SIZE)
+
 extern scarletbook_format_handler_t const * dsdiff_format_fn(void);
 extern scarletbook_format_handler_t const * dsdiff_edit_master_format_fn(void);
 extern scarletbook_format_handler_t const * dsf_format_fn(void);
 extern scarletbook_format_handler_t const * iso_format_fn(void);
+#ifdef HAVE_ZLIB
+extern scarletbook_format_handler_t const * sacdz_format_fn(void);
+#endif
+
+#ifndef __lv2ppu__
+typedef struct
+{
+    scarletbook_output_format_t *ft;                // the file the data belongs to
+    uint8_t            *data;
+    size_t              len;                        // as passed to the format handler
+    size_t             *frame_sizes;
+    int                 frame_count;                // frames in data, 0 for a run of sectors
+
+    // a run of sectors is written from the read-ahead block itself
+    const uint8_t      *sectors;
+    sacd_read_ahead_t  *read_ahead;
+    void               *held_block;
+}
+write_queue_slot_t;
+
+/**
+ * Frames and raw sectors are handed from the processing thread to the writer
+ * thread in order. The processing thread fills slots at head, the writer
+ * thread empties them at tail, both block when the ring is full or empty.
+ */
+typedef struct write_queue_s
+{
+    write_queue_slot_t  slots[WRITE_QUEUE_SLOTS];
+    int                 head;                       // next slot to fill, only used by the processing thread
+    int                 tail;                       // next slot to write, only used by the writer thread
+    int                 count;
+    int                 stop;
+    int                 running;
+
+    pthread_t           thread_id;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      slot_filled;
+    pthread_cond_t      slot_written;
+}
+write_queue_t;
+#endif
 
 typedef const scarletbook_format_handler_t *(*sacd_output_format_fn_t)(void); 
 static sacd_output_format_fn_t s_sacd_output_format_fns[] = 
@@ -62,14 +146,93 @@ static sacd_output_format_fn_t s_sacd_output_format_fns[] =
     dsdiff_edit_master_format_fn,
     dsf_format_fn,
     iso_format_fn,
+#ifdef HAVE_ZLIB
+    sacdz_format_fn,
+#endif
     NULL
 }; 
 
+#ifndef __lv2ppu__
+// a frame parsed by a parse thread, waiting to be handed out in order
+typedef struct
+{
+    size_t              offset;                     // in the data of the chunk
+    int                 size;
+    int                 timecode;
+    uint32_t            start_lsn;
+    int                 start_offset;
+    uint32_t            end_lsn;
+}
+parsed_frame_t;
+
+// a part of a block that is parsed by a thread of its own
+typedef struct
+{
+    scarletbook_frame_parser_t *parser;
+    scarletbook_handle_t *handle;
+    uint8_t            *sector_data;
+    int                 sector_count;               // up to the end of the block
+    int                 last_block;
+
+    uint8_t            *data;
+    size_t              length;
+    parsed_frame_t     *frames;
+    int                 frame_count;
+    int                 overflowed;                 // frames were dropped, they did not fit
+
+    pthread_t           thread_id;
+    int                 threaded;                   // parsed by a thread of its own, to be joined
+}
+parse_chunk_t;
+#endif
+
+/**
+ * A worker rips one file at a time, it owns everything that is needed to do
+ * so. Workers run next to each other when several files are ripped at once.
+ */
+typedef struct
+{
+    struct scarletbook_output_s *output;
+
+    sacd_read_ahead_t  *read_ahead;
+#ifndef __lv2ppu__
+    write_queue_t      *write_queue;
+    pthread_t           thread_id;
+
+    parse_chunk_t       parse_chunks[MAX_PARSE_THREAD_COUNT];
+    int                 parse_chunk_count;          // 0 when blocks are parsed by the worker alone
+#endif
+
+    int                 non_encrypted_disc;
+    int                 checked_for_non_encrypted_disc;
+
+    uint32_t            current_file_total_sectors;
+    uint32_t            current_file_sectors_processed;
+    uint32_t            current_file_bad_sectors;
+}
+output_worker_t;
+
 struct scarletbook_output_s
 {
     struct list_head    ripping_queue;
-
-    uint8_t            *read_buffer;
+    struct list_head    open_files;                 // files taken from the queue that are being ripped
+
+    output_worker_t    *workers;
+    int                 worker_count;
+    int                 parse_thread_count;         // per worker
+    int                 recovery;
+    uint32_t            transfer_size;              // sectors per read, 0 to adapt it
+    int                 single_pass;                // all files are ripped in a single read pass
+    int                 area_stream;                // tracks are split from a single parse of their area
+    scarletbook_journal_t *journal;                 // progress of the rip, to resume it
+    scarletbook_index_t *index;                     // the sectors of the frames that were parsed
+    int                 completed;                  // all files have been ripped
+    int                 failed_files;               // files that could not be written completely
+    size_t              memory_limit;               // of the DST decoding, 0 for no limit
+    size_t              decoder_memory_limit;       // share of each DST decoder in memory_limit
+#ifndef __lv2ppu__
+    pthread_mutex_t     lock;                       // protects the ripping queue and the totals
+#endif
 
 #ifdef __lv2ppu__
     sys_ppu_thread_t    processing_thread_id;
@@ -84,10 +247,10 @@ struct scarletbook_output_s
     int                 stats_current_track;
     uint32_t            stats_total_sectors;
     uint32_t            stats_total_sectors_processed;
-    uint32_t            stats_current_file_total_sectors;
-    uint32_t            stats_current_file_sectors_processed;
     stats_progress_callback_t stats_progress_callback;
     stats_track_callback_t stats_track_callback;
+    stats_stage_callback_t stats_stage_callback;
+    scarletbook_output_stats_t stats;
 
     fwprintf_callback_t fwprintf_callback;
 
@@ -118,6 +281,7 @@ static void destroy_ripping_queue(scarletbook_output_t *output)
         node_ptr = output->ripping_queue.next;
         output_format_ptr = list_entry(node_ptr, scarletbook_output_format_t, siblings);
         list_del(node_ptr);
+        free(output_format_ptr->filename);
         free(output_format_ptr);
     }
 }
@@ -140,16 +304,21 @@ int scarletbook_output_enqueue_track(scarletbook_output_t *output, int area, int
         output_format_ptr->channel_count = sb_handle->area[area].area_toc->channel_count;
         output_format_ptr->dst_encoded_import = sb_handle->area[area].area_toc->frame_format == FRAME_FORMAT_DST;
         output_format_ptr->dsd_encoded_export = dsd_encoded_export;
+        output_format_ptr->first_frame = 0;
+        output_format_ptr->end_frame = INT_MAX;
         if (handler->flags & OUTPUT_FLAG_EDIT_MASTER)
         {
             output_format_ptr->start_lsn = sb_handle->area[area].area_toc->track_start;
             output_format_ptr->length_lsn = sb_handle->area[area].area_toc->track_end - sb_handle->area[area].area_toc->track_start + 1;
+            output_format_ptr->frame_count = TIME_FRAMECOUNT(&sb_handle->area[area].area_toc->total_playtime);
         }
         else
         {
+            output_format_ptr->frame_count = TIME_FRAMECOUNT(&sb_handle->area[area].area_tracklist_time->duration[track]);
             if (track > 0) 
             {
                 output_format_ptr->start_lsn = sb_handle->area[area].area_tracklist_offset->track_start_lsn[track];
+                output_format_ptr->first_frame = TIME_FRAMECOUNT(&sb_handle->area[area].area_tracklist_time->start[track]);
             }
             else 
             {
@@ -158,6 +327,7 @@ int scarletbook_output_enqueue_track(scarletbook_output_t *output, int area, int
             if (track < sb_handle->area[area].area_toc->track_count - 1) 
             {
                 output_format_ptr->length_lsn = sb_handle->area[area].area_tracklist_offset->track_start_lsn[track + 1] - output_format_ptr->start_lsn + 1;
+                output_format_ptr->end_frame = TIME_FRAMECOUNT(&sb_handle->area[area].area_tracklist_time->start[track + 1]);
             }
             else 
             {
@@ -174,6 +344,76 @@ int scarletbook_output_enqueue_track(scarletbook_output_t *output, int area, int
     return -1;
 }
 
+int scarletbook_output_enqueue_range(scarletbook_output_t *output, int area, int first_frame, int end_frame, char *file_path, char *fmt, int dsd_encoded_export)
+{
+    scarletbook_format_handler_t const * handler;
+    scarletbook_output_format_t * output_format_ptr;
+    scarletbook_handle_t *sb_handle = output->sb_handle;
+    area_toc_t *area_toc = sb_handle->area[area].area_toc;
+    uint32_t start_lsn = area_toc->track_start, end_lsn = area_toc->track_end + 1;
+    int track;
+
+    end_frame = min(end_frame, TIME_FRAMECOUNT(&area_toc->total_playtime));
+    if (first_frame < 0 || first_frame >= end_frame)
+        return -1;
+
+    handler = find_output_format(fmt);
+    if (!handler || (handler->flags & (OUTPUT_FLAG_RAW | OUTPUT_FLAG_EDIT_MASTER)))
+        return -1;
+
+    // the sectors of a track hold its frames, a frame may spill into the first sector of the next track
+    for (track = 1; track < area_toc->track_count; track++)
+    {
+        int track_frame = TIME_FRAMECOUNT(&sb_handle->area[area].area_tracklist_time->start[track]);
+        uint32_t track_lsn = sb_handle->area[area].area_tracklist_offset->track_start_lsn[track];
+
+        if (track_frame <= first_frame)
+        {
+            start_lsn = track_lsn;
+        }
+        else if (track_frame >= end_frame)
+        {
+            end_lsn = track_lsn + 1;
+            break;
+        }
+    }
+
+    // the index tells the sectors of the frames themselves
+    if (output->index)
+    {
+        const scarletbook_index_entry_t *last = scarletbook_index_find(output->index, area, end_frame - 1);
+
+        start_lsn = max(start_lsn, scarletbook_index_seek(output->index, area, first_frame));
+        if (last)
+        {
+            end_lsn = min(end_lsn, last->lsn + last->sector_count);
+        }
+    }
+
+    output_format_ptr = calloc(sizeof(scarletbook_output_format_t), 1);
+    output_format_ptr->sb_handle = sb_handle;
+    output_format_ptr->cb_fwprintf = output->fwprintf_callback;
+    output_format_ptr->area = area;
+    output_format_ptr->track = 0;
+    output_format_ptr->handler = *handler;
+    output_format_ptr->filename = strdup(file_path);
+    output_format_ptr->channel_count = area_toc->channel_count;
+    output_format_ptr->dst_encoded_import = area_toc->frame_format == FRAME_FORMAT_DST;
+    output_format_ptr->dsd_encoded_export = dsd_encoded_export;
+    output_format_ptr->first_frame = first_frame;
+    output_format_ptr->end_frame = end_frame;
+    output_format_ptr->trimmed = 1;
+    output_format_ptr->frame_count = end_frame - first_frame;
+    output_format_ptr->start_lsn = start_lsn;
+    output_format_ptr->length_lsn = end_lsn - start_lsn;
+
+    LOG(lm_main, LOG_NOTICE, ("Queuing range: %s, area: %d, frames: %d-%d, start_lsn: %d, length_lsn: %d", file_path, area, first_frame, end_frame, output_format_ptr->start_lsn, output_format_ptr->length_lsn));
+
+    list_add_tail(&output_format_ptr->siblings, &output->ripping_queue);
+
+    return 0;
+}
+
 int scarletbook_output_enqueue_raw_sectors(scarletbook_output_t *output, int start_lsn, int length_lsn, char *file_path, char *fmt)
 {
     scarletbook_format_handler_t const * handler;
@@ -199,33 +439,164 @@ int scarletbook_output_enqueue_raw_sectors(scarletbook_output_t *output, int sta
     return -1;
 }
 
+// expected size of the audio data of a file, 0 when it is not known up front
+static uint64_t expected_output_size(scarletbook_output_format_t *ft)
+{
+    uint64_t size;
+
+    // ISO output is sparse and compressed output is smaller than its sectors
+    if (ft->handler.flags & OUTPUT_FLAG_RAW)
+        return 0;
+
+    size = (uint64_t) ft->frame_count * FRAME_SIZE_64 * ft->channel_count;
+
+    // DST frames are never larger than the sectors they are stored in
+    if (ft->dst_encoded_import && !ft->dsd_encoded_export)
+    {
+        size = min(size, (uint64_t) ft->length_lsn * SACD_LSN_SIZE);
+    }
+
+    return size;
+}
+
+/**
+ * reserves the disk space of a file up front so slow targets do not stall
+ * on block allocation and the file is not fragmented. The reservation is
+ * not part of the file size, what is left of it is released on close.
+ */
+static void preallocate_output_file(scarletbook_output_format_t *ft)
+{
+#ifdef __linux__
+    uint64_t size = expected_output_size(ft);
+
+    if (size > 0 && fallocate(fileno(ft->fd), FALLOC_FL_KEEP_SIZE, 0, (off_t) size) == 0)
+    {
+        ft->preallocated = size;
+    }
+#endif
+}
+
+static void release_preallocation(scarletbook_output_format_t *ft)
+{
+#ifdef __linux__
+    struct stat st;
+
+    if (!ft->preallocated)
+        return;
+
+    // truncating to the current size frees the blocks past the end of the file
+    fflush(ft->fd);
+    if (fstat(fileno(ft->fd), &st) == 0 && ftruncate(fileno(ft->fd), st.st_size) != 0)
+    {
+        LOG(lm_main, LOG_ERROR, ("error releasing the space reserved for %s, errno: %d, %s", ft->filename, errno, strerror(errno)));
+    }
+#endif
+}
+
+static int seek_output_file(scarletbook_output_format_t *ft, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(ft->fd, (int64_t) offset, SEEK_SET);
+#else
+    return fseeko(ft->fd, (off_t) offset, SEEK_SET);
+#endif
+}
+
+// what an earlier rip wrote past the frame a file is resumed at is dropped
+static int truncate_output_file(scarletbook_output_format_t *ft)
+{
+#ifdef _WIN32
+    return _chsize_s(_fileno(ft->fd), (__int64) ft->write_offset) == 0 ? 0 : -1;
+#elif defined(__lv2ppu__)
+    // the PS3 does not resume rips
+    return 0;
+#else
+    return ftruncate(fileno(ft->fd), (off_t) ft->write_offset);
+#endif
+}
+
 static int create_output_file(scarletbook_output_format_t *ft)
 {
+    int resumed_at_frame = ft->write_offset && ft->handler.resume;
     int result;
 
+#ifndef __lv2ppu__
+    // "-" writes to a copy of stdout, closing the file leaves stdout itself open
+    if (strcmp(ft->filename, "-") == 0)
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fflush(stdout);
+        ft->fd = fdopen(dup(fileno(stdout)), "wb");
+    }
+    else
+#endif
+    {
+        // a resumed file is written from where the previous rip stopped
 #ifdef _WIN32
-    wchar_t *wide_filename = (wchar_t *) charset_convert(ft->filename, strlen(ft->filename), "UTF-8", "UCS-2-INTERNAL");
-    ft->fd = _wfopen(wide_filename, L"wb");
-    free(wide_filename);
+        wchar_t *wide_filename = (wchar_t *) charset_convert(ft->filename, strlen(ft->filename), "UTF-8", "UCS-2-INTERNAL");
+        ft->fd = _wfopen(wide_filename, ft->write_offset ? L"r+b" : L"wb");
+        free(wide_filename);
 #else
-    ft->fd = fopen(ft->filename, "wb");	
+        ft->fd = fopen(ft->filename, ft->write_offset ? "r+b" : "wb");	
 #endif
+    }
     if (ft->fd == 0)
     {   
         LOG(lm_main, LOG_ERROR, ("error creating %s, errno: %d, %s", ft->filename, errno, strerror(errno)));
         goto error;
     }
+    if ((resumed_at_frame && truncate_output_file(ft) != 0) || 
+        (ft->write_offset && !resumed_at_frame && seek_output_file(ft, ft->write_offset) != 0))
+    {
+        LOG(lm_main, LOG_ERROR, ("error resuming %s, errno: %d, %s", ft->filename, errno, strerror(errno)));
+        goto error;
+    }
 
 #ifdef __lv2ppu__
     sysFsChmod(ft->filename, S_IFMT | 0777); 
 #endif
 
+    // pipes and sockets cannot seek, the headers are written once up front
+#ifdef _WIN32
+    ft->sequential = _fseeki64(ft->fd, 0, SEEK_CUR) != 0;
+#else
+    ft->sequential = fseeko(ft->fd, 0, SEEK_CUR) != 0;
+#endif
+    if (ft->sequential && (ft->handler.flags & OUTPUT_FLAG_SEEKABLE))
+    {
+        LOG(lm_main, LOG_ERROR, ("%s cannot be written to a stream, it needs to seek", ft->handler.description));
+        goto error;
+    }
+
     ft->write_cache = malloc(WRITE_CACHE_SIZE);
     setvbuf(ft->fd, ft->write_cache, _IOFBF , WRITE_CACHE_SIZE);
 
+    if (!ft->sequential)
+    {
+        preallocate_output_file(ft);
+    }
+
     ft->priv = calloc(1, ft->handler.priv_size);
 
-    result = ft->handler.startwrite ? (*ft->handler.startwrite)(ft) : 0;
+    if (resumed_at_frame)
+    {
+        // the header is written again, the frames go on at the end of the file
+        result = (*ft->handler.resume)(ft, &ft->resume_state);
+        if (result == 0 && seek_output_file(ft, ft->write_offset) != 0)
+        {
+            result = -1;
+        }
+        if (result != 0)
+        {
+            LOG(lm_main, LOG_ERROR, ("error resuming %s at frame %u", ft->filename, ft->resume_state.frame));
+        }
+    }
+    else
+    {
+        result = ft->handler.startwrite ? (*ft->handler.startwrite)(ft) : 0;
+    }
 
     return result;
 
@@ -239,13 +610,17 @@ static inline int close_output_file(scarletbook_output_format_t * ft)
 {
     int result;
 
-    result = ft->handler.stopwrite ? (*ft->handler.stopwrite)(ft) : 0;
+    // no handler state when the file could not be created
+    result = ft->handler.stopwrite && ft->priv ? (*ft->handler.stopwrite)(ft) : 0;
 
     if (ft->fd)
     {
+        release_preallocation(ft);
         fclose(ft->fd);
     }
     free(ft->write_cache);
+    free(ft->frame_batch);
+    free(ft->frame_batch_sizes);
     free(ft->filename);
     free(ft->priv);
     free(ft);
@@ -253,254 +628,1503 @@ static inline int close_output_file(scarletbook_output_format_t * ft)
     return result;
 }
 
+/**
+ * returns the number of sectors of a range that are not covered by the
+ * ranges before it, the ranges must be passed in order of their start
+ */
+static uint32_t merge_range(uint32_t *merged_end, uint32_t start_lsn, uint32_t length_lsn)
+{
+    uint32_t end_lsn = start_lsn + length_lsn;
+    uint32_t sectors = end_lsn > max(start_lsn, *merged_end) ? end_lsn - max(start_lsn, *merged_end) : 0;
+
+    *merged_end = max(*merged_end, end_lsn);
+
+    return sectors;
+}
+
+// orders the ripping queue by the first sector of each file
+static void sort_ripping_queue(scarletbook_output_t *output)
+{
+    struct list_head sorted;
+
+    INIT_LIST_HEAD(&sorted);
+    while (!list_empty(&output->ripping_queue))
+    {
+        scarletbook_output_format_t *ft = list_entry(output->ripping_queue.next, scarletbook_output_format_t, siblings);
+        struct list_head *pos = sorted.prev;
+
+        list_del(&ft->siblings);
+        while (pos != &sorted)
+        {
+            scarletbook_output_format_t *before = list_entry(pos, scarletbook_output_format_t, siblings);
+            if (before->start_lsn <= ft->start_lsn)
+                break;
+            pos = pos->prev;
+        }
+        list_add(&ft->siblings, pos);
+    }
+    list_splice(&sorted, &output->ripping_queue);
+}
+
+// in area stream mode the tracks and edit masters of an area share a single frame parser
+static int is_streamed(scarletbook_output_t *output, scarletbook_output_format_t *ft)
+{
+    // a range reads only the sectors that hold its frames
+    return output->area_stream && !(ft->handler.flags & OUTPUT_FLAG_RAW) && !ft->trimmed &&
+           (ft->handler.flags & OUTPUT_FLAG_DSD || ft->handler.flags & OUTPUT_FLAG_DST);
+}
+
+/**
+ * a file resumed at a frame is read from the sector the frame starts in or
+ * before it, the frames before it are dropped
+ */
+static void resume_at_frame(scarletbook_output_t *output, scarletbook_output_format_t *ft, const scarletbook_journal_state_t *state)
+{
+    uint32_t end_lsn = ft->start_lsn + ft->length_lsn;
+
+    LOG(lm_main, LOG_NOTICE, ("Resuming: %s at frame %u", ft->filename, state->frame));
+    ft->write_offset = state->length;
+    ft->resume_state = *state;
+
+    // a streamed track is split by timecode, it keeps that without the stream
+    if (is_streamed(output, ft))
+    {
+        area_toc_t *area_toc = output->sb_handle->area[ft->area].area_toc;
+
+        end_lsn = min(end_lsn + 1, area_toc->track_end + 1);
+        ft->first_frame = max(ft->first_frame, (int) state->frame);
+        ft->trimmed = 1;
+    }
+    else
+    {
+        ft->resume_frame = (int) state->frame;
+    }
+    ft->start_lsn = max(ft->start_lsn, state->lsn);
+    ft->length_lsn = end_lsn - ft->start_lsn;
+}
+
+/**
+ * drops the files that an earlier rip completed from the queue, resumable
+ * files continue at the first sector or frame that was not written
+ */
+static void apply_journal(scarletbook_output_t *output)
+{
+    struct list_head * node_ptr, * next_ptr;
+    scarletbook_output_format_t * output_format_ptr;
+
+    list_for_each_safe(node_ptr, next_ptr, &output->ripping_queue)
+    {
+        scarletbook_journal_state_t state;
+        uint32_t lsn;
+
+        output_format_ptr = list_entry(node_ptr, scarletbook_output_format_t, siblings);
+        if (scarletbook_journal_is_done(output->journal, output_format_ptr->filename))
+        {
+            LOG(lm_main, LOG_NOTICE, ("Skipping: %s, completed by an earlier rip", output_format_ptr->filename));
+            list_del(node_ptr);
+            free(output_format_ptr->filename);
+            free(output_format_ptr);
+            continue;
+        }
+
+        if ((output_format_ptr->handler.flags & OUTPUT_FLAG_RESUMABLE) && output_format_ptr->handler.resume)
+        {
+            if (scarletbook_journal_get_state(output->journal, output_format_ptr->filename, &state) == 0 && 
+                state.lsn < output_format_ptr->start_lsn + output_format_ptr->length_lsn)
+            {
+                resume_at_frame(output, output_format_ptr, &state);
+            }
+            continue;
+        }
+
+        lsn = scarletbook_journal_get_sector(output->journal, output_format_ptr->filename);
+        if ((output_format_ptr->handler.flags & OUTPUT_FLAG_RESUMABLE) &&
+            lsn > output_format_ptr->start_lsn && lsn < output_format_ptr->start_lsn + output_format_ptr->length_lsn)
+        {
+            LOG(lm_main, LOG_NOTICE, ("Resuming: %s at sector %u", output_format_ptr->filename, lsn));
+            output_format_ptr->write_offset = (uint64_t) (lsn - output_format_ptr->start_lsn) * SACD_LSN_SIZE;
+            output_format_ptr->length_lsn -= lsn - output_format_ptr->start_lsn;
+            output_format_ptr->start_lsn = lsn;
+        }
+    }
+}
+
+// a streamed track is read from the first to the last sector of its area
+static void widen_streamed_tracks(scarletbook_output_t *output)
+{
+    struct list_head * node_ptr;
+    scarletbook_output_format_t * output_format_ptr;
+
+    list_for_each(node_ptr, &output->ripping_queue)
+    {
+        output_format_ptr = list_entry(node_ptr, scarletbook_output_format_t, siblings);
+        if (is_streamed(output, output_format_ptr))
+        {
+            area_toc_t *area_toc = output->sb_handle->area[output_format_ptr->area].area_toc;
+
+            output_format_ptr->start_lsn = area_toc->track_start;
+            output_format_ptr->length_lsn = area_toc->track_end - area_toc->track_start + 1;
+        }
+    }
+}
+
 static void scarletbook_output_init_stats(scarletbook_output_t *output)
 {
     struct list_head * node_ptr;
     scarletbook_output_format_t * output_format_ptr;
+    uint32_t merged_end = 0;
 
     output->stats_total_sectors = 0;
     output->stats_total_sectors_processed = 0;
-    output->stats_current_file_total_sectors = 0;
-    output->stats_current_file_sectors_processed = 0;
     output->stats_current_track = 0;
     output->stats_total_tracks = 0;
+    memset(&output->stats, 0, sizeof(scarletbook_output_stats_t));
     list_for_each(node_ptr, &output->ripping_queue)
     {
         output_format_ptr = list_entry(node_ptr, scarletbook_output_format_t, siblings);
-        output->stats_total_sectors += output_format_ptr->length_lsn;
+        if (output->single_pass)
+        {
+            // sectors shared by several files are read once
+            output->stats_total_sectors += merge_range(&merged_end, output_format_ptr->start_lsn, output_format_ptr->length_lsn);
+        }
+        else
+        {
+            output->stats_total_sectors += output_format_ptr->length_lsn;
+        }
         output->stats_total_tracks++;
     }
 }
 
 static inline size_t write_block(scarletbook_output_format_t * ft, const uint8_t *buf, size_t len)
 {
+    double start = timeout_gettime();
     size_t actual = ft->handler.write? (*ft->handler.write)(ft, buf, len) : 0;
     ft->write_length += actual;
+    ft->stats.write_time += timeout_gettime() - start;
+    ft->stats.bytes_written += actual;
+
+    // raw sectors are written in order, what is flushed can be resumed from
+    if (ft->journal && (ft->handler.flags & OUTPUT_FLAG_RESUMABLE) &&
+        (ft->write_length - actual) / JOURNAL_INTERVAL_SIZE != ft->write_length / JOURNAL_INTERVAL_SIZE)
+    {
+        fflush(ft->fd);
+        scarletbook_journal_set_sector(ft->journal, ft->filename, ft->start_lsn + (uint32_t) (ft->write_length / SACD_LSN_SIZE));
+    }
     return actual;
 }
 
-static void frame_decoded_callback(uint8_t* frame_data, size_t frame_size, void *userdata)
+/**
+ * journals the writer of a file after the frames written so far, the file
+ * is resumed there reading from the sector of the frame before
+ */
+static void journal_writer_state(scarletbook_output_format_t *ft)
 {
-    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
-    write_block(ft, frame_data, frame_size);
-}
+    scarletbook_journal_state_t state;
+    int frame = ft->first_written_frame + (int) ft->frames_written;
+    int64_t length;
 
-static void frame_error_callback(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata)
-{
-    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
+    if (ft->sequential || ft->first_written_frame < 0 || ft->frames_written == 0)
+        return;
+
+    fflush(ft->fd);
 #ifdef _WIN32
-    wchar_t *wide_errormessage = (wchar_t *) charset_convert(frame_error_message, strlen(frame_error_message), "UTF-8", sizeof(wchar_t) == 2 ? "UCS-2-INTERNAL" : "UCS-4-INTERNAL");
+    length = _ftelli64(ft->fd);
 #else
-    wchar_t *wide_errormessage = (wchar_t *) charset_convert(frame_error_message, strlen(frame_error_message), "UTF-8", "WCHAR_T");
+    length = (int64_t) ftello(ft->fd);
 #endif
-    ft->cb_fwprintf(stderr, L"\nERROR %ls in frame: %d\n", wide_errormessage, frame_count);
-    free(wide_errormessage);
+    memset(&state, 0, sizeof(scarletbook_journal_state_t));
+    if (length <= 0 || (*ft->handler.save_state)(ft, &state) != 0)
+        return;
+
+    state.frame = (uint32_t) frame;
+    state.length = (uint64_t) length;
+    state.lsn = ft->start_lsn;
+    if (ft->index)
+    {
+        state.lsn = max(state.lsn, scarletbook_index_seek(ft->index, ft->area, frame - 1));
+    }
+    scarletbook_journal_set_state(ft->journal, ft->filename, &state);
 }
 
-static void frame_read_callback(scarletbook_handle_t *handle, uint8_t* frame_data, size_t frame_size, void *userdata)
+static size_t write_frames(scarletbook_output_format_t *ft, const uint8_t *buf, const size_t *frame_sizes, int frame_count)
 {
-    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
+    double start = timeout_gettime();
+    size_t actual = 0;
+    int i;
 
-    if (ft->dsd_encoded_export && ft->dst_encoded_import)
+    if (ft->handler.write_frames)
     {
-        dst_decoder_decode(ft->dst_decoder, frame_data, frame_size);
+        actual = (*ft->handler.write_frames)(ft, buf, frame_sizes, frame_count);
     }
-    else
+    else if (ft->handler.write)
+    {
+        for (i = 0; i < frame_count; i++)
+        {
+            actual += (*ft->handler.write)(ft, buf, frame_sizes[i]);
+            buf += frame_sizes[i];
+        }
+    }
+    ft->write_length += actual;
+    ft->frames_written += frame_count;
+    ft->stats.write_time += timeout_gettime() - start;
+    ft->stats.bytes_written += actual;
+
+    // the writer is between two frames here
+    if (ft->journal && ft->handler.save_state &&
+        (ft->write_length - actual) / JOURNAL_INTERVAL_SIZE != ft->write_length / JOURNAL_INTERVAL_SIZE)
     {
-        write_block(ft, frame_data, frame_size);
+        journal_writer_state(ft);
     }
+    return actual;
 }
 
-#ifdef __lv2ppu__
-static void processing_thread(void *arg)
-#else
-static void *processing_thread(void *arg)
-#endif
+#ifndef __lv2ppu__
+static void *write_queue_thread(void *arg)
 {
-    scarletbook_output_t *output = (scarletbook_output_t *) arg;
-    scarletbook_handle_t *handle = output->sb_handle;
-    struct list_head * node_ptr;
-    scarletbook_output_format_t * ft;
-    int non_encrypted_disc = 0;
-    int checked_for_non_encrypted_disc = 0;
+    write_queue_t *wq = (write_queue_t *) arg;
 
-    sysAtomicSet(&output->processing, 1);
-    while (!list_empty(&output->ripping_queue))
+    pthread_mutex_lock(&wq->mutex);
+    for (;;)
     {
-        node_ptr = output->ripping_queue.next;
+        int batch, i;
 
-        ft = list_entry(node_ptr, scarletbook_output_format_t, siblings);
-        list_del(node_ptr);
+        while (wq->count == 0 && !wq->stop)
+        {
+            pthread_cond_wait(&wq->slot_filled, &wq->mutex);
+        }
+        if (wq->count == 0)
+            break;
+
+        // the filled slots are written as a batch and handed back together,
+        // at most half of the ring so the processing thread can keep filling
+        batch = min(wq->count, WRITE_QUEUE_BATCH);
+        pthread_mutex_unlock(&wq->mutex);
+
+        for (i = 0; i < batch; i++)
+        {
+            write_queue_slot_t *slot = &wq->slots[(wq->tail + i) % WRITE_QUEUE_SLOTS];
+
+            if (slot->frame_count > 0)
+            {
+                write_frames(slot->ft, slot->data, slot->frame_sizes, slot->frame_count);
+            }
+            else
+            {
+                write_block(slot->ft, slot->sectors, slot->len);
+                sacd_read_ahead_unhold(slot->read_ahead, slot->held_block);
+            }
+        }
+
+        pthread_mutex_lock(&wq->mutex);
+        wq->tail = (wq->tail + batch) % WRITE_QUEUE_SLOTS;
+        wq->count -= batch;
+        pthread_cond_signal(&wq->slot_written);
+    }
+    pthread_mutex_unlock(&wq->mutex);
+
+    return 0;
+}
+
+static write_queue_t *write_queue_create(void)
+{
+    write_queue_t *wq = (write_queue_t *) calloc(1, sizeof(write_queue_t));
+    int i;
+
+    if (!wq)
+        return 0;
+
+    for (i = 0; i < WRITE_QUEUE_SLOTS; i++)
+    {
+        wq->slots[i].data = (uint8_t *) malloc(WRITE_QUEUE_SLOT_SIZE);
+        wq->slots[i].frame_sizes = (size_t *) malloc(FRAME_BATCH_COUNT * sizeof(size_t));
+        if (!wq->slots[i].data || !wq->slots[i].frame_sizes)
+        {
+            do
+            {
+                free(wq->slots[i].data);
+                free(wq->slots[i].frame_sizes);
+            }
+            while (i-- > 0);
+            free(wq);
+            return 0;
+        }
+    }
+    pthread_mutex_init(&wq->mutex, NULL);
+    pthread_cond_init(&wq->slot_filled, NULL);
+    pthread_cond_init(&wq->slot_written, NULL);
+
+    return wq;
+}
+
+static void write_queue_destroy(write_queue_t *wq)
+{
+    int i;
+
+    if (!wq)
+        return;
+
+    pthread_cond_destroy(&wq->slot_written);
+    pthread_cond_destroy(&wq->slot_filled);
+    pthread_mutex_destroy(&wq->mutex);
+    for (i = 0; i < WRITE_QUEUE_SLOTS; i++)
+    {
+        free(wq->slots[i].data);
+        free(wq->slots[i].frame_sizes);
+    }
+    free(wq);
+}
+
+// starts the writer thread, when that fails files are written by the processing thread
+static void write_queue_start(write_queue_t *wq)
+{
+    if (!wq)
+        return;
+
+    wq->head = wq->tail = wq->count = 0;
+    wq->stop = 0;
+    if (pthread_create(&wq->thread_id, NULL, write_queue_thread, wq) != 0)
+    {
+        LOG(lm_main, LOG_ERROR, ("could not create writer thread"));
+        return;
+    }
+    wq->running = 1;
+}
+
+// waits until everything that has been queued is written
+static void write_queue_drain(write_queue_t *wq)
+{
+    pthread_mutex_lock(&wq->mutex);
+    while (wq->count > 0)
+    {
+        pthread_cond_wait(&wq->slot_written, &wq->mutex);
+    }
+    pthread_mutex_unlock(&wq->mutex);
+}
+
+// waits until everything has been written and stops the writer thread
+static void write_queue_finish(write_queue_t *wq)
+{
+    if (!wq || !wq->running)
+        return;
+
+    pthread_mutex_lock(&wq->mutex);
+    wq->stop = 1;
+    pthread_cond_signal(&wq->slot_filled);
+    pthread_mutex_unlock(&wq->mutex);
+    pthread_join(wq->thread_id, NULL);
+
+    wq->running = 0;
+}
+#endif
+
+#ifndef __lv2ppu__
+// returns the slot at head once the writer thread has emptied it
+static write_queue_slot_t *write_queue_wait_for_slot(write_queue_t *wq)
+{
+    pthread_mutex_lock(&wq->mutex);
+    while (wq->count == WRITE_QUEUE_SLOTS)
+    {
+        pthread_cond_wait(&wq->slot_written, &wq->mutex);
+    }
+    pthread_mutex_unlock(&wq->mutex);
+
+    return &wq->slots[wq->head];
+}
+
+static void write_queue_push_slot(write_queue_t *wq)
+{
+    pthread_mutex_lock(&wq->mutex);
+    wq->head = (wq->head + 1) % WRITE_QUEUE_SLOTS;
+    wq->count++;
+    pthread_cond_signal(&wq->slot_filled);
+    pthread_mutex_unlock(&wq->mutex);
+}
+#endif
+
+/**
+ * hands a run of sectors of the block last returned by the read-ahead
+ * engine to the writer thread, waits when the queue is full. The block is
+ * held until it has been written, the sectors are not copied.
+ */
+static void queue_block(scarletbook_output_format_t *ft, sacd_read_ahead_t *read_ahead, const uint8_t *buf, size_t len)
+{
+#ifndef __lv2ppu__
+    write_queue_t *wq = ft->write_queue;
+
+    if (wq)
+    {
+        double start = timeout_gettime();
+        write_queue_slot_t *slot = write_queue_wait_for_slot(wq);
+
+        slot->ft = ft;
+        slot->sectors = buf;
+        slot->len = len;
+        slot->frame_count = 0;
+        slot->read_ahead = read_ahead;
+        slot->held_block = sacd_read_ahead_hold(read_ahead);
+        write_queue_push_slot(wq);
+
+        ft->stats.write_queue_time += timeout_gettime() - start;
+        return;
+    }
+#endif
+    write_block(ft, buf, len);
+}
+
+/**
+ * hands the frames collected for a file to the DST decoder or the writer
+ * thread. The batch buffer is swapped with the emptied buffer of a write
+ * queue slot, so the frames are not copied again.
+ */
+static void flush_frame_batch(scarletbook_output_format_t *ft)
+{
+    double start;
+
+    if (ft->frame_batch_count == 0)
+        return;
+
+    start = timeout_gettime();
+    if (ft->dsd_encoded_export && ft->dst_encoded_import)
+    {
+        dst_decoder_decode_frames(ft->dst_decoder, ft->frame_batch, ft->frame_batch_sizes, ft->frame_batch_count);
+        ft->stats.dst_queue_time += timeout_gettime() - start;
+    }
+#ifndef __lv2ppu__
+    else if (ft->write_queue)
+    {
+        write_queue_slot_t *slot = write_queue_wait_for_slot(ft->write_queue);
+        uint8_t *data = slot->data;
+        size_t *frame_sizes = slot->frame_sizes;
+
+        slot->data = ft->frame_batch;
+        slot->frame_sizes = ft->frame_batch_sizes;
+        slot->ft = ft;
+        slot->len = ft->frame_batch_length;
+        slot->frame_count = ft->frame_batch_count;
+        write_queue_push_slot(ft->write_queue);
+
+        ft->frame_batch = data;
+        ft->frame_batch_sizes = frame_sizes;
+        ft->stats.write_queue_time += timeout_gettime() - start;
+    }
+#endif
+    else
+    {
+        write_frames(ft, ft->frame_batch, ft->frame_batch_sizes, ft->frame_batch_count);
+    }
+    ft->frame_batch_count = 0;
+    ft->frame_batch_length = 0;
+}
+
+// the decoder hands over the frames of a decoding job at once
+static void frame_decoded_callback(uint8_t* frame_data, size_t frame_size, void *userdata)
+{
+    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
+    size_t dsd_frame_size = FRAME_SIZE_64 * ft->channel_count;
+    size_t frame_sizes[FRAME_BATCH_COUNT];
+    int frame_count, i;
+
+    while (frame_size >= dsd_frame_size)
+    {
+        frame_count = (int) min(frame_size / dsd_frame_size, FRAME_BATCH_COUNT);
+        for (i = 0; i < frame_count; i++)
+        {
+            frame_sizes[i] = dsd_frame_size;
+        }
+        write_frames(ft, frame_data, frame_sizes, frame_count);
+
+        frame_data += frame_count * dsd_frame_size;
+        frame_size -= frame_count * dsd_frame_size;
+    }
+}
+
+static void frame_error_callback(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata)
+{
+    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
+#ifdef _WIN32
+    wchar_t *wide_errormessage = (wchar_t *) charset_convert(frame_error_message, strlen(frame_error_message), "UTF-8", sizeof(wchar_t) == 2 ? "UCS-2-INTERNAL" : "UCS-4-INTERNAL");
+#else
+    wchar_t *wide_errormessage = (wchar_t *) charset_convert(frame_error_message, strlen(frame_error_message), "UTF-8", "WCHAR_T");
+#endif
+    ft->cb_fwprintf(stderr, L"\nERROR %ls in frame: %d\n", wide_errormessage, frame_count);
+    free(wide_errormessage);
+}
+
+static void frame_read_callback(scarletbook_handle_t *handle, scarletbook_audio_frame_t *frame, void *userdata)
+{
+    scarletbook_output_format_t *ft = (scarletbook_output_format_t *) userdata;
+    size_t frame_size = frame->size;
+    double start = timeout_gettime();
+    int i;
+
+    // silence put in for lost frames has no sector
+    if (ft->index && frame->start_lsn)
+    {
+        scarletbook_index_add(ft->index, ft->area, frame->last_timecode, frame->start_lsn, frame->start_offset, 
+                              (int) (frame->end_lsn - frame->start_lsn + 1));
+    }
+
+    if ((ft->trimmed && (frame->last_timecode < ft->first_frame || frame->last_timecode >= ft->end_frame)) || 
+        frame->last_timecode < ft->resume_frame)
+    {
+        ft->frame_callback_time += timeout_gettime() - start;
+        return;
+    }
+    ft->stats.frames_parsed++;
+    if (ft->first_written_frame < 0)
+    {
+        ft->first_written_frame = frame->last_timecode;
+    }
+
+    // the frames are collected and handed on in batches
+    if (ft->frame_batch_count == FRAME_BATCH_COUNT || ft->frame_batch_length + frame_size > FRAME_BATCH_SIZE)
+    {
+        flush_frame_batch(ft);
+    }
+    // the frame is copied together from the sectors it was read from
+    for (i = 0; i < frame->segment_count; i++)
+    {
+        memcpy(ft->frame_batch + ft->frame_batch_length, frame->segments[i].data, frame->segments[i].size);
+        ft->frame_batch_length += frame->segments[i].size;
+    }
+    ft->frame_batch_sizes[ft->frame_batch_count++] = frame_size;
+
+    ft->frame_callback_time += timeout_gettime() - start;
+}
+
+#ifndef __lv2ppu__
+// runs in a parse thread, the frames are copied as the block is parsed further
+static void collect_frame_callback(scarletbook_handle_t *handle, scarletbook_audio_frame_t *frame, void *userdata)
+{
+    parse_chunk_t *chunk = (parse_chunk_t *) userdata;
+    parsed_frame_t *parsed;
+    int i;
+
+    if (chunk->frame_count == PARSE_CHUNK_FRAME_COUNT || chunk->length + frame->size > PARSE_CHUNK_DATA_SIZE)
+    {
+        chunk->overflowed = 1;
+        return;
+    }
+    parsed = &chunk->frames[chunk->frame_count++];
+    parsed->offset = chunk->length;
+    parsed->size = frame->size;
+    parsed->timecode = frame->last_timecode;
+    parsed->start_lsn = frame->start_lsn;
+    parsed->start_offset = frame->start_offset;
+    parsed->end_lsn = frame->end_lsn;
+    for (i = 0; i < frame->segment_count; i++)
+    {
+        memcpy(chunk->data + chunk->length, frame->segments[i].data, frame->segments[i].size);
+        chunk->length += frame->segments[i].size;
+    }
+}
+
+static void *parse_chunk_thread(void *arg)
+{
+    parse_chunk_t *chunk = (parse_chunk_t *) arg;
+
+    scarletbook_process_frame_segments(chunk->handle, chunk->parser, chunk->sector_data, chunk->sector_count, chunk->last_block, 
+                                       collect_frame_callback, chunk);
+    return 0;
+}
+
+/**
+ * parses the sectors [first_lsn, end_lsn) split in parts by a thread each.
+ * A part hands out the frames that start in it and the part after it skips
+ * them, the frames are then handed to the callback in order. The parser of
+ * the part that holds the last frame carries on with the next block.
+ */
+static void parse_block_parallel(output_worker_t *worker, scarletbook_handle_t *handle, scarletbook_frame_parser_t **parser, 
+                                 frame_segments_callback_t callback, void *userdata, 
+                                 uint8_t *sector_data, uint32_t first_lsn, uint32_t end_lsn, int last_block)
+{
+    int sector_count = (int) (end_lsn - first_lsn);
+    int chunk_count = min(worker->parse_chunk_count, sector_count / MIN_PARSE_CHUNK_SIZE);
+    int chunk_size = sector_count / chunk_count;
+    int carry = chunk_count - 1, i, j;
+    scarletbook_frame_parser_t *swap;
+    scarletbook_audio_frame_t frame;
+
+    for (i = 0; i < chunk_count; i++)
+    {
+        parse_chunk_t *chunk = &worker->parse_chunks[i];
+        uint32_t stop_lsn = i < chunk_count - 1 ? first_lsn + (i + 1) * chunk_size : 0;
+
+        if (i == 0)
+        {
+            chunk->parser = *parser;
+            chunk->parser->lsn = first_lsn;
+            chunk->parser->stop_lsn = stop_lsn;
+        }
+        else
+        {
+            scarletbook_frame_parser_resync(chunk->parser, first_lsn + i * chunk_size, stop_lsn);
+        }
+        chunk->handle = handle;
+        chunk->sector_data = sector_data + i * chunk_size * SACD_LSN_SIZE;
+        chunk->sector_count = sector_count - i * chunk_size;
+        chunk->last_block = last_block;
+        chunk->length = 0;
+        chunk->frame_count = 0;
+        chunk->overflowed = 0;
+
+        chunk->threaded = i > 0 && pthread_create(&chunk->thread_id, NULL, parse_chunk_thread, chunk) == 0;
+    }
+    for (i = 0; i < chunk_count; i++)
+    {
+        if (worker->parse_chunks[i].threaded)
+        {
+            pthread_join(worker->parse_chunks[i].thread_id, NULL);
+        }
+        else
+        {
+            parse_chunk_thread(&worker->parse_chunks[i]);
+        }
+    }
+
+    // a part that did not stop found no frame in the parts after it
+    for (i = 0; i < chunk_count; i++)
+    {
+        if (worker->parse_chunks[i].overflowed)
+        {
+            LOG(lm_main, LOG_ERROR, ("frames of sectors %u to %u did not fit the parse buffer", first_lsn, end_lsn));
+        }
+    }
+    for (i = 0; i < chunk_count; i++)
+    {
+        if (!worker->parse_chunks[i].parser->stopped)
+        {
+            carry = i;
+            break;
+        }
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.segment_count = 1;
+    for (i = 0; i <= carry; i++)
+    {
+        parse_chunk_t *chunk = &worker->parse_chunks[i];
+
+        for (j = 0; j < chunk->frame_count; j++)
+        {
+            parsed_frame_t *parsed = &chunk->frames[j];
+
+            frame.segments[0].data = chunk->data + parsed->offset;
+            frame.segments[0].size = parsed->size;
+            frame.size = parsed->size;
+            frame.timecode = frame.last_timecode = parsed->timecode;
+            frame.start_lsn = parsed->start_lsn;
+            frame.start_offset = parsed->start_offset;
+            frame.end_lsn = parsed->end_lsn;
+            callback(handle, &frame, userdata);
+        }
+    }
+
+    swap = *parser;
+    *parser = worker->parse_chunks[carry].parser;
+    (*parser)->stop_lsn = 0;
+    worker->parse_chunks[carry].parser = carry > 0 ? swap : 0;
+    worker->parse_chunks[0].parser = 0;
+}
+#endif
+
+/**
+ * parses the sectors [first_lsn, end_lsn) of a block, unreadable sectors
+ * are skipped by the frame parser
+ */
+static void parse_block(output_worker_t *worker, scarletbook_handle_t *handle, scarletbook_frame_parser_t **parser, 
+                        frame_segments_callback_t callback, void *userdata, 
+                        uint8_t *block_data, uint32_t block_lsn, uint32_t first_lsn, uint32_t end_lsn, int last_block,
+                        const uint32_t *bad_sectors, int bad_sector_count)
+{
+    uint32_t lsn = first_lsn;
+    int i;
+
+#ifndef __lv2ppu__
+    // blocks with damage are parsed in one go, the silence for lost frames
+    // has to follow the frame before it
+    if (worker->parse_chunk_count > 1 && !(*parser)->frame.damaged && end_lsn - first_lsn >= 2 * MIN_PARSE_CHUNK_SIZE)
+    {
+        for (i = 0; i < bad_sector_count; i++)
+        {
+            if (bad_sectors[i] >= first_lsn && bad_sectors[i] < end_lsn)
+                break;
+        }
+        if (i == bad_sector_count)
+        {
+            parse_block_parallel(worker, handle, parser, callback, userdata, block_data + (first_lsn - block_lsn) * SACD_LSN_SIZE, 
+                                 first_lsn, end_lsn, last_block);
+            return;
+        }
+    }
+#endif
+
+    for (i = 0; i < bad_sector_count; i++)
+    {
+        if (bad_sectors[i] < first_lsn || bad_sectors[i] >= end_lsn)
+            continue;
+
+        if (bad_sectors[i] > lsn)
+        {
+            (*parser)->lsn = lsn;
+            scarletbook_process_frame_segments(handle, *parser, block_data + (lsn - block_lsn) * SACD_LSN_SIZE, bad_sectors[i] - lsn, 0, callback, userdata);
+        }
+        scarletbook_process_bad_sector(*parser);
+        lsn = bad_sectors[i] + 1;
+    }
+    if (lsn < end_lsn || last_block)
+    {
+        (*parser)->lsn = lsn;
+        scarletbook_process_frame_segments(handle, *parser, block_data + (lsn - block_lsn) * SACD_LSN_SIZE, end_lsn - lsn, last_block, callback, userdata);
+    }
+}
+
+// adds the stats of a finished file to the totals
+static void add_stage_stats(scarletbook_output_stats_t *total, scarletbook_output_format_t *ft)
+{
+    total->read_time += ft->stats.read_time;
+    total->decrypt_time += ft->stats.decrypt_time;
+    total->parse_time += ft->stats.parse_time;
+    total->dst_queue_time += ft->stats.dst_queue_time;
+    total->write_queue_time += ft->stats.write_queue_time;
+    total->decode_time += ft->dst_decoder_stats.decode_time;
+    total->write_time += ft->stats.write_time;
+    total->sectors_read += ft->stats.sectors_read;
+    total->frames_parsed += ft->stats.frames_parsed;
+    total->frames_decoded += ft->dst_decoder_stats.frame_count;
+    total->bytes_written += ft->stats.bytes_written;
+}
+
+// returns 1 when the sector lies inside one of the (encrypted) audio areas
+static int is_encrypted_lsn(scarletbook_handle_t *handle, uint32_t lsn)
+{
+    int i;
+
+    for (i = 0; i < handle->area_count; i++)
+    {
+        if (handle->area[i].area_toc != 0 && 
+            lsn >= handle->area[i].area_toc->track_start && lsn <= handle->area[i].area_toc->track_end)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// makes sure a read-ahead block never crosses an encryption boundary
+static uint32_t encryption_block_size_callback(uint32_t lsn, uint32_t end_lsn, void *userdata)
+{
+    scarletbook_handle_t *handle = (scarletbook_handle_t *) userdata;
+    uint32_t block_size = end_lsn - lsn;
+    int i;
+
+    for (i = 0; i < handle->area_count; i++)
+    {
+        if (handle->area[i].area_toc != 0)
+        {
+            uint32_t encrypted_start = handle->area[i].area_toc->track_start;
+            uint32_t encrypted_end = handle->area[i].area_toc->track_end;
+
+            if (lsn < encrypted_start)
+            {
+                block_size = min(encrypted_start - lsn, block_size);
+            }
+            else if (lsn <= encrypted_end)
+            {
+                block_size = min(encrypted_end + 1 - lsn, block_size);
+            }
+        }
+    }
+    return block_size;
+}
+
+static inline void output_lock(scarletbook_output_t *output)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_lock(&output->lock);
+#endif
+}
+
+static inline void output_unlock(scarletbook_output_t *output)
+{
+#ifndef __lv2ppu__
+    pthread_mutex_unlock(&output->lock);
+#endif
+}
+
+static void destroy_worker(output_worker_t *worker)
+{
+#ifndef __lv2ppu__
+    int i;
+#endif
+
+    sacd_read_ahead_destroy(worker->read_ahead);
+#ifndef __lv2ppu__
+    write_queue_destroy(worker->write_queue);
+    for (i = 0; i < MAX_PARSE_THREAD_COUNT; i++)
+    {
+        scarletbook_frame_parser_destroy(worker->parse_chunks[i].parser);
+        free(worker->parse_chunks[i].data);
+        free(worker->parse_chunks[i].frames);
+    }
+#endif
+}
+
+#ifndef __lv2ppu__
+static int create_parse_chunks(output_worker_t *worker, int count)
+{
+    int i;
+
+    // the first part is parsed by the parser of the file, it may hold the
+    // start of a frame from the block before
+    for (i = 0; i < count; i++)
+    {
+        parse_chunk_t *chunk = &worker->parse_chunks[i];
+
+        chunk->parser = i > 0 ? scarletbook_frame_parser_create() : 0;
+        chunk->data = (uint8_t *) malloc(PARSE_CHUNK_DATA_SIZE);
+        chunk->frames = (parsed_frame_t *) malloc(PARSE_CHUNK_FRAME_COUNT * sizeof(parsed_frame_t));
+        if ((i > 0 && !chunk->parser) || !chunk->data || !chunk->frames)
+            return -1;
+    }
+    worker->parse_chunk_count = count;
+
+    return 0;
+}
+#endif
+
+static int create_worker(scarletbook_output_t *output, output_worker_t *worker)
+{
+    worker->output = output;
+    worker->read_ahead = sacd_read_ahead_create(output->sb_handle->sacd, READ_AHEAD_BLOCK_COUNT);
+#ifndef __lv2ppu__
+    worker->write_queue = write_queue_create();
+    if (output->parse_thread_count > 1 && create_parse_chunks(worker, output->parse_thread_count) != 0)
+    {
+        destroy_worker(worker);
+        memset(worker, 0, sizeof(output_worker_t));
+        return -1;
+    }
+#endif
+    if (!worker->read_ahead)
+    {
+        destroy_worker(worker);
+        memset(worker, 0, sizeof(output_worker_t));
+        return -1;
+    }
+    sacd_read_ahead_set_recovery(worker->read_ahead, output->recovery);
+    sacd_read_ahead_set_transfer_size(worker->read_ahead, output->transfer_size);
+
+    return 0;
+}
+
+enum
+{
+    SINK_PENDING = 0,                   // not reached yet
+    SINK_OPEN,
+    SINK_CLOSED
+};
+
+// how a sink ended
+enum
+{
+    CLOSE_FINISHED = 0,
+    CLOSE_UNFINISHED,                   // the read stopped early
+    CLOSE_CANCELLED
+};
+
+/**
+ * In area stream mode the sectors of an area are parsed once, the frames
+ * are handed to the tracks (sinks) by their timecode.
+ */
+typedef struct
+{
+    output_worker_t                *worker;
+    scarletbook_frame_parser_t     *parser;
+    scarletbook_output_format_t   **sinks;          // of the job
+    int                            *state;          // of the job sinks
+    int                            *members;        // job sinks of this area
+    int                             member_count;
+    uint32_t                        start_lsn;
+    uint32_t                        end_lsn;
+
+    double                          parse_time;
+    double                          callback_time;
+}
+area_stream_t;
+
+/**
+ * creates the file of a sink once the read reaches it, returns 0 when the
+ * file could not be created
+ */
+static int open_sink(output_worker_t *worker, scarletbook_output_format_t *ft)
+{
+    scarletbook_output_t *output = worker->output;
+    int current_track;
+
+    output_lock(output);
+    current_track = ++output->stats_current_track;
+    output_unlock(output);
+
+    if (output->stats_track_callback)
+    {
+        output->stats_track_callback(ft->filename, current_track, output->stats_total_tracks);
+    }
+
+    ft->current_lsn = ft->start_lsn;
+    ft->open_time = timeout_gettime();
+    ft->journal = output->journal;
+    ft->index = output->index;
+    ft->first_written_frame = -1;
+    ft->frame_parser = scarletbook_frame_parser_create();
+    if (!(ft->handler.flags & OUTPUT_FLAG_RAW))
+    {
+        ft->frame_batch = (uint8_t *) malloc(FRAME_BATCH_SIZE);
+        ft->frame_batch_sizes = (size_t *) malloc(FRAME_BATCH_COUNT * sizeof(size_t));
+    }
+    if (!ft->frame_parser || (!(ft->handler.flags & OUTPUT_FLAG_RAW) && (!ft->frame_batch || !ft->frame_batch_sizes)) || 
+        create_output_file(ft) != 0)
+    {
+        scarletbook_frame_parser_destroy(ft->frame_parser);
+        close_output_file(ft);
+        return 0;
+    }
+
+    if (ft->dsd_encoded_export && ft->dst_encoded_import)
+    {
+        ft->dst_decoder = dst_decoder_create(ft->channel_count, frame_decoded_callback, frame_error_callback, ft);
+        if (ft->dst_decoder)
+        {
+            dst_decoder_set_stats(ft->dst_decoder, &ft->dst_decoder_stats);
+            dst_decoder_set_memory_limit(ft->dst_decoder, output->decoder_memory_limit);
+        }
+    }
+#ifndef __lv2ppu__
+    // decoded DST is written by the decoder, everything else by the writer thread
+    else if (worker->write_queue && worker->write_queue->running)
+    {
+        ft->write_queue = worker->write_queue;
+    }
+#endif
+
+    output_lock(output);
+    list_add_tail(&ft->siblings, &output->open_files);
+    output_unlock(output);
+
+    return 1;
+}
+
+/**
+ * finishes the file of a sink and journals how far it got. The file is
+ * removed when the user cancelled, unless it can be resumed.
+ */
+static void close_sink(output_worker_t *worker, scarletbook_output_format_t *ft, int how)
+{
+    scarletbook_output_t *output = worker->output;
+    scarletbook_journal_t *journal = ft->journal;
+    int resumable = journal && (ft->handler.flags & OUTPUT_FLAG_RESUMABLE);
+    int by_sector = !ft->handler.save_state;
+    char *filename = strdup(ft->filename);
+    double close_start;
+    uint32_t end_lsn;
+    int result;
+
+    flush_frame_batch(ft);
+
+#ifndef __lv2ppu__
+    if (ft->write_queue)
+    {
+        double start = timeout_gettime();
+        write_queue_drain(ft->write_queue);
+        ft->stats.write_queue_time += timeout_gettime() - start;
+    }
+#endif
+
+    close_start = timeout_gettime();
+    if (ft->dsd_encoded_export && ft->dst_encoded_import)
+    {
+        // frames still in flight are decoded and written here
+        dst_decoder_destroy(ft->dst_decoder);
+        ft->stats.dst_queue_time += timeout_gettime() - close_start;
+    }
+    scarletbook_frame_parser_destroy(ft->frame_parser);
+
+    output_lock(output);
+    list_del(&ft->siblings);
+    add_stage_stats(&output->stats, ft);
+    output_unlock(output);
+
+    // an unfinished file is resumed from the last frame that was written
+    if (resumable && ft->handler.save_state && how != CLOSE_FINISHED)
+    {
+        journal_writer_state(ft);
+    }
+
+    // the file is flushed and its header is finalized on close
+    end_lsn = ft->start_lsn + (uint32_t) (ft->write_length / SACD_LSN_SIZE);
+    close_start = timeout_gettime();
+    result = close_output_file(ft);
+    if (result != 0)
+    {
+        LOG(lm_main, LOG_ERROR, ("error finishing %s", filename ? filename : ""));
+        output_lock(output);
+        output->failed_files++;
+        output_unlock(output);
+    }
+
+    output_lock(output);
+    output->stats.write_time += timeout_gettime() - close_start;
+    output_unlock(output);
+
+    if (filename && journal)
+    {
+        if (how == CLOSE_FINISHED && result == 0)
+        {
+            scarletbook_journal_set_done(journal, filename);
+        }
+        else if (resumable && by_sector)
+        {
+            scarletbook_journal_set_sector(journal, filename, end_lsn);
+        }
+    }
+    if (filename && how == CLOSE_CANCELLED && !resumable)
+    {
+        // remove the file being worked on
+#ifdef __lv2ppu__
+        if (sysFsUnlink(filename) != 0)
+#else
+        if (remove(filename) != 0)
+#endif
+        {
+            LOG(lm_main, LOG_ERROR, ("user cancelled, error removing: %s, [%s]", filename, strerror(errno)));
+        }
+    }
+    free(filename);
+}
+
+/**
+ * hands the part of a block that lies within the range of a sink to it
+ */
+static void process_sink_block(output_worker_t *worker, scarletbook_output_format_t *ft, uint8_t *block_data, uint32_t block_lsn, uint32_t first_lsn, uint32_t end_lsn,
+                               const uint32_t *bad_sectors, int bad_sector_count)
+{
+    double start, callback_time;
+
+    ft->current_lsn = end_lsn;
+
+    // ISO output is written without frame processing                        
+    if (ft->handler.flags & OUTPUT_FLAG_RAW)
+    {
+        queue_block(ft, worker->read_ahead, block_data + (first_lsn - block_lsn) * SACD_LSN_SIZE, end_lsn - first_lsn);
+        return;
+    }
+    if (!(ft->handler.flags & OUTPUT_FLAG_DSD || ft->handler.flags & OUTPUT_FLAG_DST))
+        return;
+
+    // parse time is the time spent in the frame parser minus the time spent in the frame callbacks
+    start = timeout_gettime();
+    callback_time = ft->frame_callback_time;
+
+    parse_block(worker, ft->sb_handle, &ft->frame_parser, frame_read_callback, ft, block_data, block_lsn, first_lsn, end_lsn, 
+                end_lsn == ft->start_lsn + ft->length_lsn, bad_sectors, bad_sector_count);
 
-        if (ft->dsd_encoded_export && ft->dst_encoded_import)
+    ft->stats.parse_time += timeout_gettime() - start - (ft->frame_callback_time - callback_time);
+}
+
+/**
+ * hands the frames of an area to the tracks they belong to, a track is
+ * opened by its first frame and closed by the first frame past its end
+ */
+static void stream_frame_callback(scarletbook_handle_t *handle, scarletbook_audio_frame_t *frame, void *userdata)
+{
+    area_stream_t *stream = (area_stream_t *) userdata;
+    int timecode = frame->last_timecode;
+    double start = timeout_gettime();
+    int i;
+
+    for (i = 0; i < stream->member_count; i++)
+    {
+        int idx = stream->members[i];
+        scarletbook_output_format_t *ft = stream->sinks[idx];
+
+        if (stream->state[idx] == SINK_CLOSED || timecode < ft->first_frame)
+            continue;
+
+        if (stream->state[idx] == SINK_PENDING)
+        {
+            stream->state[idx] = open_sink(stream->worker, ft) ? SINK_OPEN : SINK_CLOSED;
+            if (stream->state[idx] == SINK_CLOSED)
+                continue;
+        }
+
+        if (timecode >= ft->end_frame)
         {
-            ft->dst_decoder = dst_decoder_create(ft->channel_count, frame_decoded_callback, frame_error_callback, ft);
+            close_sink(stream->worker, ft, CLOSE_FINISHED);
+            stream->state[idx] = SINK_CLOSED;
+            continue;
         }
 
-        output->stats_current_file_total_sectors = ft->length_lsn;
-        output->stats_current_file_sectors_processed = 0;
-        output->stats_current_track++;
+        frame_read_callback(handle, frame, ft);
+    }
+
+    stream->callback_time += timeout_gettime() - start;
+}
+
+static void process_stream_block(area_stream_t *stream, uint8_t *block_data, uint32_t block_lsn, uint32_t first_lsn, uint32_t end_lsn,
+                                 const uint32_t *bad_sectors, int bad_sector_count)
+{
+    double start = timeout_gettime();
+    double callback_time = stream->callback_time;
+
+    parse_block(stream->worker, stream->worker->output->sb_handle, &stream->parser, stream_frame_callback, stream, block_data, block_lsn, first_lsn, end_lsn, 
+                end_lsn == stream->end_lsn, bad_sectors, bad_sector_count);
+
+    stream->parse_time += timeout_gettime() - start - (stream->callback_time - callback_time);
+}
+
+/**
+ * rips the files (sinks) of a job in a single pass, every sector is read and
+ * decrypted once and handed to all sinks that cover it. The sinks are sorted
+ * by their first sector, sinks that overlap or touch are read as one segment.
+ * Returns 0 when the user cancelled.
+ */
+static int process_job(output_worker_t *worker, scarletbook_output_format_t **sinks, int sink_count)
+{
+    scarletbook_output_t *output = worker->output;
+    scarletbook_handle_t *handle = output->sb_handle;
+    scarletbook_output_stats_t job_stats;
+    area_stream_t streams[2];               // two channel and multi channel area
+    int *state;
+    int first = 0, last, i, area;
+    int cancelled = 0;
+    uint32_t merged_end = 0;
+
+    state = (int *) calloc(sink_count, sizeof(int));
+    if (!state)
+        return 1;
+
+    memset(streams, 0, sizeof(streams));
+    for (i = 0; i < sink_count; i++)
+    {
+        area_stream_t *stream = &streams[sinks[i]->area];
+
+        if (!is_streamed(output, sinks[i]))
+            continue;
 
-        if (output->stats_track_callback)
+        if (!stream->worker)
         {
-            output->stats_track_callback(ft->filename, output->stats_current_track, output->stats_total_tracks);
+            stream->worker = worker;
+            stream->sinks = sinks;
+            stream->state = state;
+            stream->start_lsn = sinks[i]->start_lsn;
+            stream->end_lsn = sinks[i]->start_lsn + sinks[i]->length_lsn;
+            stream->members = (int *) calloc(sink_count, sizeof(int));
+            stream->parser = scarletbook_frame_parser_create();
+            if (!stream->members || !stream->parser)
+            {
+                LOG(lm_main, LOG_ERROR, ("could not create the stream of area %d", sinks[i]->area));
+            }
         }
+        // without a stream the sinks end up empty
+        if (!stream->members || !stream->parser)
+            continue;
+
+        stream->members[stream->member_count++] = i;
+    }
 
-        scarletbook_frame_init(handle);
+    memset(&job_stats, 0, sizeof(scarletbook_output_stats_t));
+    worker->current_file_total_sectors = 0;
+    worker->current_file_sectors_processed = 0;
+    worker->current_file_bad_sectors = 0;
+    for (i = 0; i < sink_count; i++)
+    {
+        worker->current_file_total_sectors += merge_range(&merged_end, sinks[i]->start_lsn, sinks[i]->length_lsn);
+    }
+
+#ifndef __lv2ppu__
+    write_queue_start(worker->write_queue);
+#endif
+
+    while (first < sink_count && !cancelled)
+    {
+        uint32_t segment_start = sinks[first]->start_lsn;
+        uint32_t segment_end = segment_start + sinks[first]->length_lsn;
+        uint32_t current_lsn = segment_start;
 
-        if (create_output_file(ft) == 0)
+        for (last = first + 1; last < sink_count && sinks[last]->start_lsn <= segment_end; last++)
         {
-            uint32_t block_size, end_lsn;
-            uint32_t encrypted_start_1 = 0;
-            uint32_t encrypted_start_2 = 0;
-            uint32_t encrypted_end_1 = 0;
-            uint32_t encrypted_end_2 = 0;
-            int encrypted;
+            segment_end = max(segment_end, sinks[last]->start_lsn + sinks[last]->length_lsn);
+        }
 
-            // set the encryption range
-            if (handle->area[0].area_toc != 0)
+        // sectors are read by the read-ahead engine while the previous block is being processed
+        sacd_read_ahead_start(worker->read_ahead, segment_start, segment_end, encryption_block_size_callback, handle);
+
+        while (sysAtomicRead(&output->stop_processing) == 0)
+        {
+            uint32_t block_size, block_lsn, total_sectors_processed;
+            uint8_t *block_data;
+            const uint32_t *bad_sectors;
+            int encrypted, bad_sector_count;
+            double start = timeout_gettime();
+            ssize_t ret = sacd_read_ahead_next(worker->read_ahead, &block_lsn, &block_data);
+
+            job_stats.read_time += timeout_gettime() - start;
+            if (ret <= 0)
+            {
+                if (current_lsn < segment_end)
+                {
+                    LOG(lm_main, LOG_ERROR, ("could not read sector %u of %s", current_lsn, sinks[first]->filename));
+                }
+                break;
+            }
+            block_size = (uint32_t) ret;
+            encrypted = is_encrypted_lsn(handle, block_lsn);
+
+            current_lsn = block_lsn + block_size;
+            job_stats.sectors_read += block_size;
+            worker->current_file_sectors_processed += block_size;
+
+            output_lock(output);
+            output->stats_total_sectors_processed += block_size;
+            total_sectors_processed = output->stats_total_sectors_processed;
+            output_unlock(output);
+
+            // the ATAPI call which returns the flag if the disc is encrypted or not is unknown at this point. 
+            // user reports tell me that the only non-encrypted discs out there are DSD 3 14/16 discs. 
+            // this is a quick hack/fix for these discs.
+            if (encrypted && worker->checked_for_non_encrypted_disc == 0)
             {
-                encrypted_start_1 = handle->area[0].area_toc->track_start;
-                encrypted_end_1 = handle->area[0].area_toc->track_end;
+                switch (handle->area[sinks[first]->area].area_toc->frame_format)
+                {
+                case FRAME_FORMAT_DSD_3_IN_14:
+                case FRAME_FORMAT_DSD_3_IN_16:
+                    worker->non_encrypted_disc = *(uint64_t *)(block_data + 16) == 0;
+                    break;
+                }
+
+                worker->checked_for_non_encrypted_disc = 1;
             }
-            if (handle->area[1].area_toc != 0)
+
+            // encrypted blocks need to be decrypted first
+            if (encrypted && worker->non_encrypted_disc == 0)
             {
-                encrypted_start_2 = handle->area[1].area_toc->track_start;
-                encrypted_end_2 = handle->area[1].area_toc->track_end;
+                start = timeout_gettime();
+                sacd_decrypt(handle->sacd, block_data, block_size);
+                job_stats.decrypt_time += timeout_gettime() - start;
             }
 
-            // what blocks do we need to process?
-            ft->current_lsn = ft->start_lsn;
-            end_lsn = ft->start_lsn + ft->length_lsn;
+            bad_sector_count = sacd_read_ahead_bad_sectors(worker->read_ahead, &bad_sectors);
+            for (i = 0; i < bad_sector_count; i++)
+            {
+                LOG(lm_main, LOG_ERROR, ("unreadable sector %u in %s", bad_sectors[i], sinks[first]->filename));
 
-            sysAtomicSet(&output->stop_processing, 0);
+                // zero filled sectors went through the decryption as well
+                memset(block_data + (bad_sectors[i] - block_lsn) * SACD_LSN_SIZE, 0, SACD_LSN_SIZE);
+            }
+            worker->current_file_bad_sectors += bad_sector_count;
 
-            while (sysAtomicRead(&output->stop_processing) == 0)
+            // the block is shared by all sinks that cover (a part of) it
+            for (i = first; i < last; i++)
             {
-                if (ft->current_lsn < end_lsn)
+                scarletbook_output_format_t *ft = sinks[i];
+                uint32_t sink_end;
+
+                // a closed sink has been freed
+                if (state[i] == SINK_CLOSED)
+                    continue;
+
+                sink_end = ft->start_lsn + ft->length_lsn;
+                if (ft->start_lsn >= current_lsn || sink_end <= block_lsn || is_streamed(output, ft))
+                    continue;
+
+                if (state[i] == SINK_PENDING)
                 {
-                    // check what block ranges are encrypted..
-                    if (ft->current_lsn < encrypted_start_1)
-                    {
-                        block_size = min(encrypted_start_1 - ft->current_lsn, MAX_PROCESSING_BLOCK_SIZE);
-                        encrypted = 0;
-                    }
-                    else if (ft->current_lsn >= encrypted_start_1 && ft->current_lsn <= encrypted_end_1)
-                    {
-                        block_size = min(encrypted_end_1 + 1 - ft->current_lsn, MAX_PROCESSING_BLOCK_SIZE);
-                        encrypted = 1;
-                    }
-                    else if (ft->current_lsn > encrypted_end_1 && ft->current_lsn < encrypted_start_2)
-                    {
-                        block_size = min(encrypted_start_2 - ft->current_lsn, MAX_PROCESSING_BLOCK_SIZE);
-                        encrypted = 0;
-                    }
-                    else if (ft->current_lsn >= encrypted_start_2 && ft->current_lsn <= encrypted_end_2)
-                    {
-                        block_size = min(encrypted_end_2 + 1 - ft->current_lsn, MAX_PROCESSING_BLOCK_SIZE);
-                        encrypted = 1;
-                    }
-                    else
-                    {
-                        block_size = MAX_PROCESSING_BLOCK_SIZE;
-                        encrypted = 0;
-                    }
-                    block_size = min(end_lsn - ft->current_lsn, block_size);
-
-                    // read some blocks
-                    block_size = (uint32_t) sacd_read_block_raw(ft->sb_handle->sacd, ft->current_lsn, block_size, output->read_buffer);
-
-                    ft->current_lsn += block_size;
-                    output->stats_total_sectors_processed += block_size;
-                    output->stats_current_file_sectors_processed += block_size;
-
-                    // the ATAPI call which returns the flag if the disc is encrypted or not is unknown at this point. 
-                    // user reports tell me that the only non-encrypted discs out there are DSD 3 14/16 discs. 
-                    // this is a quick hack/fix for these discs.
-                    if (encrypted && checked_for_non_encrypted_disc == 0)
-                    {
-                        switch (handle->area[ft->area].area_toc->frame_format)
-                        {
-                        case FRAME_FORMAT_DSD_3_IN_14:
-                        case FRAME_FORMAT_DSD_3_IN_16:
-                            non_encrypted_disc = *(uint64_t *)(output->read_buffer + 16) == 0;
-                            break;
-                        }
-
-                        checked_for_non_encrypted_disc = 1;
-                    }
-
-                    // encrypted blocks need to be decrypted first
-                    if (encrypted && non_encrypted_disc == 0)
-                    {
-                        sacd_decrypt(ft->sb_handle->sacd, output->read_buffer, block_size);
-                    }
-
-                    // process DSD & DST frames
-                    if (ft->handler.flags & OUTPUT_FLAG_DSD || ft->handler.flags & OUTPUT_FLAG_DST)
-                    {
-                        scarletbook_process_frames(ft->sb_handle, output->read_buffer, block_size, ft->current_lsn == end_lsn, frame_read_callback, ft);
-                    }
-                    // ISO output is written without frame processing                        
-                    else if (ft->handler.flags & OUTPUT_FLAG_RAW)
-                    {
-                        write_block(ft, output->read_buffer, block_size);
-                    }
-
-                    // update statistics
-                    if (output->stats_progress_callback)
-                    {
-                        output->stats_progress_callback(output->stats_total_sectors, output->stats_total_sectors_processed, 
-                            output->stats_current_file_total_sectors, output->stats_current_file_sectors_processed);
-                    }
+                    state[i] = open_sink(worker, ft) ? SINK_OPEN : SINK_CLOSED;
+                    if (state[i] == SINK_CLOSED)
+                        continue;
                 }
-                else
+
+                process_sink_block(worker, ft, block_data, block_lsn, max(ft->start_lsn, block_lsn), min(sink_end, current_lsn), bad_sectors, bad_sector_count);
+
+                if (sink_end <= current_lsn)
                 {
-                    break;
+                    close_sink(worker, ft, CLOSE_FINISHED);
+                    state[i] = SINK_CLOSED;
                 }
             }
-        }
 
-        if (sysAtomicRead(&output->stop_processing) == 1)
-        {
-            // make a copy of the filename
-            char *file_to_remove = strdup(ft->filename);
+            for (area = 0; area < 2; area++)
+            {
+                area_stream_t *stream = &streams[area];
+
+                if (stream->member_count == 0 || stream->start_lsn >= current_lsn || stream->end_lsn <= block_lsn)
+                    continue;
+
+                process_stream_block(stream, block_data, block_lsn, max(stream->start_lsn, block_lsn), min(stream->end_lsn, current_lsn), 
+                                     bad_sectors, bad_sector_count);
+            }
 
-            sysAtomicSet(&output->processing, 0);
+            sacd_read_ahead_release(worker->read_ahead);
 
-            if (ft->dsd_encoded_export && ft->dst_encoded_import)
+            // update statistics
+            if (output->stats_progress_callback)
             {
-                dst_decoder_destroy(ft->dst_decoder);
+                output->stats_progress_callback(output->stats_total_sectors, total_sectors_processed, 
+                    worker->current_file_total_sectors, worker->current_file_sectors_processed);
             }
+        }
 
-            close_output_file(ft);
+        sacd_read_ahead_stop(worker->read_ahead);
 
-            // remove the file being worked on
-#ifdef __lv2ppu__
-            if (sysFsUnlink(file_to_remove) != 0)
-#else
-            if (remove(file_to_remove) != 0)
-#endif
+        cancelled = sysAtomicRead(&output->stop_processing) == 1;
+
+        // sinks that were not finished (read errors, empty ranges) are closed with what they got
+        for (i = first; i < last; i++)
+        {
+            if (state[i] == SINK_PENDING && !cancelled)
+            {
+                state[i] = open_sink(worker, sinks[i]) ? SINK_OPEN : SINK_CLOSED;
+            }
+            if (state[i] == SINK_OPEN)
+            {
+                close_sink(worker, sinks[i], cancelled ? CLOSE_CANCELLED : current_lsn < segment_end ? CLOSE_UNFINISHED : CLOSE_FINISHED);
+            }
+            else if (state[i] == SINK_PENDING)
             {
-                LOG(lm_main, LOG_ERROR, ("user cancelled, error removing: %s, [%s]", file_to_remove, strerror(errno)));
+                free(sinks[i]->filename);
+                free(sinks[i]);
             }
-            free(file_to_remove);
+            state[i] = SINK_CLOSED;
+        }
+        first = last;
+    }
+
+    // sinks of segments that were never started
+    for (i = first; i < sink_count; i++)
+    {
+        free(sinks[i]->filename);
+        free(sinks[i]);
+    }
+
+#ifndef __lv2ppu__
+    write_queue_finish(worker->write_queue);
+#endif
+
+    if (worker->current_file_bad_sectors > 0 && output->fwprintf_callback)
+    {
+        output->fwprintf_callback(stdout, L"\n%u unreadable sector(s) could not be recovered\n", worker->current_file_bad_sectors);
+    }
+
+    for (area = 0; area < 2; area++)
+    {
+        job_stats.parse_time += streams[area].parse_time;
+        scarletbook_frame_parser_destroy(streams[area].parser);
+        free(streams[area].members);
+    }
+
+    output_lock(output);
+    output->stats.read_time += job_stats.read_time;
+    output->stats.decrypt_time += job_stats.decrypt_time;
+    output->stats.parse_time += job_stats.parse_time;
+    output->stats.sectors_read += job_stats.sectors_read;
+    if (output->stats_stage_callback)
+    {
+        output->stats_stage_callback(&output->stats);
+    }
+    output_unlock(output);
+
+    free(state);
+
+    return !cancelled;
+}
+
+/**
+ * takes jobs from the ripping queue until it is empty, a job is a single
+ * file or, in single pass mode, all files
+ */
+static void process_queue(output_worker_t *worker)
+{
+    scarletbook_output_t *output = worker->output;
+    scarletbook_output_format_t **sinks;
+    int sink_count, i;
+
+    for (;;)
+    {
+        output_lock(output);
+        if (list_empty(&output->ripping_queue) || sysAtomicRead(&output->stop_processing) == 1)
+        {
+            output_unlock(output);
+            break;
+        }
+        sink_count = output->single_pass ? output->stats_total_tracks : 1;
+        sinks = (scarletbook_output_format_t **) calloc(sink_count, sizeof(scarletbook_output_format_t *));
+        for (i = 0; sinks && i < sink_count && !list_empty(&output->ripping_queue); i++)
+        {
+            sinks[i] = list_entry(output->ripping_queue.next, scarletbook_output_format_t, siblings);
+            list_del(&sinks[i]->siblings);
+        }
+        sink_count = i;
+        output_unlock(output);
+
+        if (!sinks)
+            break;
+
+        i = process_job(worker, sinks, sink_count);
+        free(sinks);
+        if (!i)
+            break;
+    }
+}
+
+#ifndef __lv2ppu__
+static void *worker_thread(void *arg)
+{
+    process_queue((output_worker_t *) arg);
+
+    return 0;
+}
+#endif
 
-            destroy_ripping_queue(output);
 #ifdef __lv2ppu__
-            sysThreadExit(-1);
+static void processing_thread(void *arg)
 #else
-            pthread_exit(0);
+static void *processing_thread(void *arg)
 #endif
-        }
+{
+    scarletbook_output_t *output = (scarletbook_output_t *) arg;
+
+    sysAtomicSet(&output->processing, 1);
+
+#ifndef __lv2ppu__
+    if (output->worker_count > 1)
+    {
+        int i, thread_count;
 
-        if (ft->dsd_encoded_export && ft->dst_encoded_import)
+        for (thread_count = 0; thread_count < output->worker_count; thread_count++)
+        {
+            if (pthread_create(&output->workers[thread_count].thread_id, NULL, worker_thread, &output->workers[thread_count]) != 0)
+            {
+                LOG(lm_main, LOG_ERROR, ("could not create worker thread"));
+                break;
+            }
+        }
+        // without any worker threads the queue is processed right here
+        if (thread_count == 0)
+        {
+            process_queue(&output->workers[0]);
+        }
+        for (i = 0; i < thread_count; i++)
         {
-            dst_decoder_destroy(ft->dst_decoder);
+            pthread_join(output->workers[i].thread_id, NULL);
         }
+    }
+    else
+#endif
+    {
+        process_queue(&output->workers[0]);
+    }
 
-        close_output_file(ft);
-    } 
+    output->completed = sysAtomicRead(&output->stop_processing) == 0;
     destroy_ripping_queue(output);
     sysAtomicSet(&output->processing, 0);
 
@@ -518,7 +2142,12 @@ scarletbook_output_t *scarletbook_output_create(scarletbook_handle_t *handle, st
     scarletbook_output_t *output = (scarletbook_output_t *) calloc(1, sizeof(scarletbook_output_t));
 
     INIT_LIST_HEAD(&output->ripping_queue);
-    output->read_buffer = (uint8_t *) malloc(MAX_PROCESSING_BLOCK_SIZE * SACD_LSN_SIZE);
+    INIT_LIST_HEAD(&output->open_files);
+#ifndef __lv2ppu__
+    pthread_mutex_init(&output->lock, NULL);
+#endif
+    output->worker_count = 1;
+    output->parse_thread_count = 1;
     output->sb_handle = handle;
     output->stats_track_callback = cb_track;
     output->stats_progress_callback = cb_progress;
@@ -527,17 +2156,196 @@ scarletbook_output_t *scarletbook_output_create(scarletbook_handle_t *handle, st
     return output;
 }
 
+void scarletbook_output_set_recovery(scarletbook_output_t *output, int recovery)
+{
+    output->recovery = recovery;
+}
+
+void scarletbook_output_set_worker_count(scarletbook_output_t *output, int worker_count)
+{
+#ifdef __lv2ppu__
+    // the PS3 has a single PPU and the SPUs are taken by the DST decoder
+    worker_count = 1;
+#endif
+    output->worker_count = max(1, min(worker_count, MAX_WORKER_COUNT));
+}
+
+void scarletbook_output_set_parse_thread_count(scarletbook_output_t *output, int thread_count)
+{
+#ifdef __lv2ppu__
+    thread_count = 1;
+#endif
+    output->parse_thread_count = max(1, min(thread_count, MAX_PARSE_THREAD_COUNT));
+}
+
+void scarletbook_output_set_transfer_size(scarletbook_output_t *output, uint32_t transfer_size)
+{
+    output->transfer_size = transfer_size;
+}
+
+void scarletbook_output_set_single_pass(scarletbook_output_t *output, int single_pass)
+{
+    output->single_pass = single_pass;
+}
+
+void scarletbook_output_set_area_stream(scarletbook_output_t *output, int area_stream)
+{
+    output->area_stream = area_stream;
+}
+
+int scarletbook_output_set_journal(scarletbook_output_t *output, const char *path)
+{
+    scarletbook_journal_close(output->journal, 0);
+    output->journal = scarletbook_journal_open(path);
+
+    // the sectors of the frames journaled are looked up in the index
+    if (output->journal && !output->index)
+    {
+        output->index = scarletbook_index_open(output->sb_handle, 0);
+    }
+
+    return output->journal ? 0 : -1;
+}
+
+int scarletbook_output_set_index(scarletbook_output_t *output, const char *dir)
+{
+    scarletbook_index_close(output->index);
+    output->index = scarletbook_index_open(output->sb_handle, dir);
+
+    return output->index ? 0 : -1;
+}
+
+void scarletbook_output_set_memory_limit(scarletbook_output_t *output, size_t memory_limit)
+{
+    output->memory_limit = memory_limit;
+}
+
+void scarletbook_output_set_stats_callback(scarletbook_output_t *output, stats_stage_callback_t cb_stage)
+{
+    output->stats_stage_callback = cb_stage;
+}
+
 int scarletbook_output_is_busy(scarletbook_output_t *output)
 {
     return sysAtomicRead(&output->processing);
 }
 
+void scarletbook_output_get_metrics(scarletbook_output_t *output, scarletbook_output_metrics_t *metrics)
+{
+    struct list_head *node_ptr;
+    double now = timeout_gettime();
+
+    memset(metrics, 0, sizeof(scarletbook_output_metrics_t));
+
+    output_lock(output);
+    metrics->total_sectors = output->stats_total_sectors;
+    metrics->sectors_processed = output->stats_total_sectors_processed;
+    metrics->frames_parsed = output->stats.frames_parsed;
+    metrics->frames_decoded = output->stats.frames_decoded;
+    metrics->bytes_written = output->stats.bytes_written;
+    metrics->decode_time = output->stats.decode_time;
+
+    list_for_each(node_ptr, &output->open_files)
+    {
+        scarletbook_output_format_t *ft = list_entry(node_ptr, scarletbook_output_format_t, siblings);
+
+        metrics->frames_parsed += ft->stats.frames_parsed;
+        metrics->frames_decoded += ft->dst_decoder_stats.frame_count;
+        metrics->bytes_written += ft->stats.bytes_written;
+        metrics->decode_time += ft->dst_decoder_stats.decode_time;
+        if (ft->dst_decoder)
+        {
+            metrics->dst_queue_depth += dst_decoder_get_queue_depth(ft->dst_decoder);
+            metrics->decoder_threads += dst_decoder_get_thread_count(ft->dst_decoder);
+        }
+
+        if (metrics->file_count < MAX_METRICS_FILES)
+        {
+            scarletbook_output_file_metrics_t *file = &metrics->files[metrics->file_count++];
+
+            strncpy(file->filename, ft->filename, sizeof(file->filename) - 1);
+            file->elapsed = now - ft->open_time;
+
+            // audio files progress by frame, raw files by sector
+            if (ft->frame_count > 0)
+            {
+                file->progress = min(1.0, (double) ft->stats.frames_parsed / ft->frame_count);
+            }
+            else if (ft->length_lsn > 0)
+            {
+                file->progress = (double) (ft->current_lsn - ft->start_lsn) / ft->length_lsn;
+            }
+        }
+    }
+    output_unlock(output);
+}
+
+// splits the memory budget over the DST decoders that can run at the same time
+static size_t get_decoder_memory_limit(scarletbook_output_t *output)
+{
+    int decoder_count = output->worker_count;
+    struct list_head *node_ptr;
+
+    // a single pass decodes all queued DST files next to each other
+    if (output->single_pass)
+    {
+        decoder_count = 0;
+        list_for_each(node_ptr, &output->ripping_queue)
+        {
+            scarletbook_output_format_t *ft = list_entry(node_ptr, scarletbook_output_format_t, siblings);
+            if (ft->dst_encoded_import && ft->dsd_encoded_export)
+                decoder_count++;
+        }
+    }
+
+    return output->memory_limit / max(1, decoder_count);
+}
+
 int scarletbook_output_start(scarletbook_output_t *output)
 {
-    int ret = 0;
+    int ret = 0, i;
 
+    if (output->journal)
+    {
+        apply_journal(output);
+    }
+    if (output->area_stream)
+    {
+        widen_streamed_tracks(output);
+        output->single_pass = 1;
+    }
+    if (output->single_pass)
+    {
+        sort_ripping_queue(output);
+    }
     scarletbook_output_init_stats(output);
 
+    // there is no use for more workers than jobs
+    output->worker_count = max(1, min(output->worker_count, output->single_pass ? 1 : output->stats_total_tracks));
+    output->workers = (output_worker_t *) calloc(output->worker_count, sizeof(output_worker_t));
+    if (!output->workers)
+    {
+        return -1;
+    }
+    for (i = 0; i < output->worker_count; i++)
+    {
+        if (create_worker(output, &output->workers[i]) != 0)
+        {
+            LOG(lm_main, LOG_ERROR, ("could not create worker %d", i));
+            break;
+        }
+    }
+    if (i == 0)
+    {
+        free(output->workers);
+        output->workers = 0;
+        return -1;
+    }
+    output->worker_count = i;
+    output->decoder_memory_limit = get_decoder_memory_limit(output);
+
+    // busy from here on, the processing thread clears it when done
+    sysAtomicSet(&output->processing, 1);
 #ifdef __lv2ppu__
     ret = sysThreadCreate(&output->processing_thread_id,
                           processing_thread,
@@ -552,6 +2360,15 @@ int scarletbook_output_start(scarletbook_output_t *output)
     if (ret)
     {
         LOG(lm_main, LOG_ERROR, ("return code from processing thread creation is %d\n", ret));
+        sysAtomicSet(&output->processing, 0);
+
+        // destroy only joins the processing thread while there are workers
+        for (i = 0; i < output->worker_count; i++)
+        {
+            destroy_worker(&output->workers[i]);
+        }
+        free(output->workers);
+        output->workers = 0;
     }
 
     return ret;
@@ -569,26 +2386,44 @@ int scarletbook_output_destroy(scarletbook_output_t *output)
 #else
     void *thr_exit_code;
 #endif
-    int ret = 0;
+    int ret = 0, i;
 
     if (!output)
         return -1;
 
+    // without workers the processing thread was never started
+    if (output->workers)
+    {
 #ifdef __lv2ppu__
-    scarletbook_output_interrupt(output);
-    ret = sysThreadJoin(output->processing_thread_id, &thr_exit_code);
+        scarletbook_output_interrupt(output);
+        ret = sysThreadJoin(output->processing_thread_id, &thr_exit_code);
 #else
-    scarletbook_output_interrupt(output);
-    ret = pthread_join(output->processing_thread_id, &thr_exit_code);
+        ret = pthread_join(output->processing_thread_id, &thr_exit_code);
 #endif    
-    if (ret != 0)
-    {
-        LOG(lm_main, LOG_ERROR, ("processing thread didn't close properly... %x", thr_exit_code));
+        if (ret != 0)
+        {
+            LOG(lm_main, LOG_ERROR, ("processing thread didn't close properly... %x", thr_exit_code));
+        }
     }
 
     // If decoding is aborted (eg. ctrl+C), then free() buffers after the decoder has been destroyed,
     // to ensure that buffers aren't still in use when they're free()d.
-    free(output->read_buffer);
+    for (i = 0; output->workers && i < output->worker_count; i++)
+    {
+        destroy_worker(&output->workers[i]);
+    }
+    free(output->workers);
+    // left over when the processing thread could not be started
+    destroy_ripping_queue(output);
+    scarletbook_journal_close(output->journal, output->completed);
+    scarletbook_index_close(output->index);
+#ifndef __lv2ppu__
+    pthread_mutex_destroy(&output->lock);
+#endif
+    if (output->failed_files > 0)
+    {
+        ret = -1;
+    }
     free(output);
 
     return ret;
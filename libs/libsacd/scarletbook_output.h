@@ -29,6 +29,7 @@
 #endif
 
 #include "scarletbook.h"
+#include "scarletbook_journal.h"
 
 // forward declaration
 typedef struct scarletbook_output_format_t scarletbook_output_format_t;
@@ -39,7 +40,9 @@ enum
     OUTPUT_FLAG_RAW         = 1 << 0,
     OUTPUT_FLAG_DSD         = 1 << 1,
     OUTPUT_FLAG_DST         = 1 << 2,
-    OUTPUT_FLAG_EDIT_MASTER = 1 << 3
+    OUTPUT_FLAG_EDIT_MASTER = 1 << 3,
+    OUTPUT_FLAG_RESUMABLE   = 1 << 4,       // a partly written file can be continued, by sector or at a frame with save_state
+    OUTPUT_FLAG_SEEKABLE    = 1 << 5        // the header is rewritten at the end, cannot be written to a stream
 };
 
 // Handler structure defined by each output format.
@@ -49,14 +52,68 @@ typedef struct scarletbook_format_handler_t
     char const *name;
     int (*startwrite)(scarletbook_output_format_t *ft);
     size_t (*write)(scarletbook_output_format_t *ft, const uint8_t *buf, size_t len);
+    // optional, writes frame_count frames stored back to back in buf, without
+    // it the frames are passed to write one at a time
+    size_t (*write_frames)(scarletbook_output_format_t *ft, const uint8_t *buf, const size_t *frame_sizes, int frame_count);
     int (*stopwrite)(scarletbook_output_format_t *ft);
     int         flags;
     size_t      priv_size;
+    // optional, the state of the writer after the frames written so far is
+    // journaled by save_state, resume restores it in place of startwrite
+    int (*save_state)(scarletbook_output_format_t *ft, scarletbook_journal_state_t *state);
+    int (*resume)(scarletbook_output_format_t *ft, const scarletbook_journal_state_t *state);
 } 
 scarletbook_format_handler_t;
 
 typedef int (*fwprintf_callback_t)(FILE *stream, const wchar_t *format, ...);
 
+// cumulative time (in seconds) spent in each stage of the rip, the stages
+// run in different threads so the times overlap
+typedef struct scarletbook_output_stats_t
+{
+    double                          read_time;          // waiting for the read-ahead engine
+    double                          decrypt_time;
+    double                          parse_time;         // frame parsing, excluding the frame callbacks
+    double                          dst_queue_time;     // waiting to hand frames to the DST decoder
+    double                          write_queue_time;   // waiting for room in the write queue
+    double                          decode_time;        // DST decoding, summed over the decoder threads
+    double                          write_time;
+
+    uint64_t                        sectors_read;
+    uint64_t                        frames_parsed;
+    uint64_t                        frames_decoded;
+    uint64_t                        bytes_written;
+}
+scarletbook_output_stats_t;
+
+// most files reported by scarletbook_output_get_metrics
+#define MAX_METRICS_FILES 16
+
+typedef struct scarletbook_output_file_metrics_t
+{
+    char                            filename[512];
+    double                          progress;           // from 0 to 1
+    double                          elapsed;            // seconds since the file was created
+}
+scarletbook_output_file_metrics_t;
+
+// a snapshot of a running rip, the counters include the files that are
+// being ripped, which are updated without locking
+typedef struct scarletbook_output_metrics_t
+{
+    uint32_t                        total_sectors;
+    uint32_t                        sectors_processed;
+    uint64_t                        frames_parsed;
+    uint64_t                        frames_decoded;
+    uint64_t                        bytes_written;
+    double                          decode_time;        // summed over the decoder threads
+    int                             dst_queue_depth;    // frames waiting to be DST decoded or written
+    int                             decoder_threads;
+    int                             file_count;         // files being ripped
+    scarletbook_output_file_metrics_t files[MAX_METRICS_FILES];
+}
+scarletbook_output_metrics_t;
+
 struct scarletbook_output_format_t 
 {
     int                             area;
@@ -66,12 +123,28 @@ struct scarletbook_output_format_t
     uint32_t                        current_lsn;
     char                           *filename;
 
+    // frames of the file, [first_frame, end_frame), used to split a streamed area
+    int                             first_frame;
+    int                             end_frame;
+    int                             trimmed;                // frames outside [first_frame, end_frame) are dropped
+    uint32_t                        frame_count;            // of the file according to the TOC
+
     int                             channel_count;
 
     FILE                           *fd;
     char                           *write_cache;
     uint64_t                        write_length;
-    uint64_t                        write_offset;
+    uint8_t                        *frame_batch;            // frames collected to be handed on together
+    size_t                         *frame_batch_sizes;
+    int                             frame_batch_count;
+    size_t                          frame_batch_length;
+    uint64_t                        write_offset;           // where writing starts, non zero for a resumed file
+    scarletbook_journal_state_t     resume_state;           // of the writer, for a file resumed at a frame
+    int                             resume_frame;           // frames before it were written by an earlier rip
+    int                             first_written_frame;    // the first frame handed to the writer, -1 for none
+    uint32_t                        frames_written;
+    uint64_t                        preallocated;           // disk space reserved when the file was created
+    int                             sequential;             // the file cannot seek, e.g. a pipe
 
     int                             dst_encoded_import;
     int                             dsd_encoded_export;
@@ -83,6 +156,16 @@ struct scarletbook_output_format_t
     char                            error_str[256];
 
     dst_decoder_t                  *dst_decoder;
+    dst_decoder_stats_t             dst_decoder_stats;
+
+    scarletbook_output_stats_t      stats;
+    double                          frame_callback_time;    // part of the parse time spent in frame_read_callback
+    double                          open_time;              // when the file was created
+
+    struct write_queue_s           *write_queue;            // set while the writer thread runs for this file
+    scarletbook_frame_parser_t     *frame_parser;           // of the worker ripping this file
+    struct scarletbook_journal_s   *journal;
+    struct scarletbook_index_s     *index;
 
     scarletbook_handle_t           *sb_handle;
     fwprintf_callback_t             cb_fwprintf;
@@ -95,12 +178,56 @@ typedef void (*stats_progress_callback_t)(uint32_t stats_total_sectors, uint32_t
 
 typedef void (*stats_track_callback_t)(char *filename, int current_track, int total_tracks);
 
+// called after each read pass (a file, or all files in single pass mode)
+// with the stage timing so far
+typedef void (*stats_stage_callback_t)(const scarletbook_output_stats_t *stats);
+
 scarletbook_output_t *scarletbook_output_create(scarletbook_handle_t *, stats_track_callback_t, stats_progress_callback_t, fwprintf_callback_t);
+// returns -1 when a file could not be written completely
 int scarletbook_output_destroy(scarletbook_output_t *);
 int scarletbook_output_enqueue_track(scarletbook_output_t *, int, int, char *, char *, int);
 int scarletbook_output_enqueue_raw_sectors(scarletbook_output_t *, int, int, char *, char *);
+
+// queues the frames [first_frame, end_frame) of an area as a file of their own,
+// only the sectors of the tracks (or indexed frames) that hold them are read
+int scarletbook_output_enqueue_range(scarletbook_output_t *, int area, int first_frame, int end_frame, char *, char *, int);
 int scarletbook_output_start(scarletbook_output_t *);
 void scarletbook_output_interrupt(scarletbook_output_t *);
+void scarletbook_output_set_recovery(scarletbook_output_t *, int);
+void scarletbook_output_set_worker_count(scarletbook_output_t *, int);
+
+// splits each block that is read in parts that are parsed at the same time,
+// by the given number of threads per worker
+void scarletbook_output_set_parse_thread_count(scarletbook_output_t *, int);
+
+// sets the amount of sectors requested per read, 0 (the default) picks the
+// size that gives the highest measured throughput
+void scarletbook_output_set_transfer_size(scarletbook_output_t *, uint32_t);
+
+// reads the sectors of all queued files once and writes every file from that read
+void scarletbook_output_set_single_pass(scarletbook_output_t *, int);
+
+// reads each area once from its first to its last sector and splits the
+// tracks by the timecode of their frames, implies single pass
+void scarletbook_output_set_area_stream(scarletbook_output_t *, int);
+
+// journals the progress of the rip to path, a rip that was interrupted is
+// resumed from there. The journal is removed once all files are ripped.
+int scarletbook_output_set_journal(scarletbook_output_t *, const char *path);
+
+// keeps an index of the sectors of the frames of the disc in directory dir,
+// frames that are parsed are added to it and it is written when the output
+// is destroyed
+int scarletbook_output_set_index(scarletbook_output_t *, const char *dir);
+
+// bounds the memory of the frames waiting to be DST decoded or written, in
+// bytes, reading blocks while it is used up. 0 (the default) for no limit.
+void scarletbook_output_set_memory_limit(scarletbook_output_t *, size_t);
+
+void scarletbook_output_set_stats_callback(scarletbook_output_t *, stats_stage_callback_t);
 int scarletbook_output_is_busy(scarletbook_output_t *);
 
+// can be called from any thread while the rip runs
+void scarletbook_output_get_metrics(scarletbook_output_t *, scarletbook_output_metrics_t *);
+
 #endif /* SCARLETBOOK_OUTPUT_H_INCLUDED */
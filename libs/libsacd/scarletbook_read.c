@@ -57,6 +57,9 @@ static const uint8_t my_friendly_zeros[2048];
 #define CHECK_ZERO(arg)     (void) (arg)
 #endif
 
+// the largest gap (in frames) that is filled with silence after a read error
+#define MAX_SILENCE_FRAMES  (60 * SACD_FRAME_RATE)
+
 /* Prototypes for internal functions */
 static int scarletbook_read_master_toc(scarletbook_handle_t *);
 static int scarletbook_read_area_toc(scarletbook_handle_t *, int);
@@ -69,15 +72,6 @@ scarletbook_handle_t *scarletbook_open(sacd_reader_t *sacd, int title)
     if (!sb)
         return NULL;
 
-#ifdef __lv2ppu__
-    sb->frame.data = (uint8_t *) memalign(128, MAX_DST_SIZE);
-#else
-    sb->frame.data = (uint8_t *) malloc(MAX_DST_SIZE);
-#endif
-
-    if (!sb->frame.data)
-        return NULL;
-
     sb->sacd      = sacd;
     sb->twoch_area_idx = -1;
     sb->mulch_area_idx = -1;
@@ -207,9 +201,6 @@ void scarletbook_close(scarletbook_handle_t *handle)
     if (handle->master_data)
         free((void *) handle->master_data);
 
-    if (handle->frame.data)
-        free((void *) handle->frame.data);
-
     memset(handle, 0, sizeof(scarletbook_handle_t));
 
     free(handle);
@@ -548,121 +539,322 @@ static int scarletbook_read_area_toc(scarletbook_handle_t *handle, int area_idx)
     return 1;
 }
 
-void scarletbook_frame_init(scarletbook_handle_t *handle)
+scarletbook_frame_parser_t *scarletbook_frame_parser_create(void)
+{
+    scarletbook_frame_parser_t *parser;
+
+    parser = (scarletbook_frame_parser_t *) calloc(sizeof(scarletbook_frame_parser_t), 1);
+    if (!parser)
+        return NULL;
+
+#ifdef __lv2ppu__
+    parser->frame.data = (uint8_t *) memalign(128, MAX_DST_SIZE);
+#else
+    parser->frame.data = (uint8_t *) malloc(MAX_DST_SIZE);
+#endif
+
+    if (!parser->frame.data)
+    {
+        free(parser);
+        return NULL;
+    }
+
+    scarletbook_frame_init(parser);
+
+    return parser;
+}
+
+void scarletbook_frame_parser_destroy(scarletbook_frame_parser_t *parser)
+{
+    if (!parser)
+        return;
+
+    free(parser->frame.data);
+    free(parser);
+}
+
+void scarletbook_frame_init(scarletbook_frame_parser_t *parser)
+{
+    parser->packet_info_idx = 0;
+    parser->frame.size = 0;
+    parser->frame.segment_count = 0;
+    parser->frame.started = 0;
+    parser->frame.last_timecode = -1;
+    parser->frame.start_lsn = 0;
+    parser->frame.damaged = 0;
+    parser->stopped = 0;
+    memset(&parser->audio_sector, 0, sizeof(audio_sector_desc_t));
+}
+
+void scarletbook_frame_parser_resync(scarletbook_frame_parser_t *parser, uint32_t lsn, uint32_t stop_lsn)
+{
+    scarletbook_frame_init(parser);
+    parser->lsn = lsn;
+    parser->stop_lsn = stop_lsn;
+}
+
+/**
+ * The bit fields of an audio sector header are looked up per byte, the
+ * tables are built by the preprocessor. The bits are in big endian order:
+ *
+ *   sector header:  packet_info_count:3 frame_info_count:3 reserved:1 dst_encoded:1
+ *   packet info:    frame_start:1 reserved:1 data_type:3 packet_length:11
+ *   DST frame info: channel_bit_1:1 sector_count:5 channel_bit_2:1 channel_bit_3:1
+ */
+typedef struct
 {
-    handle->packet_info_idx = 0;
-    handle->frame.size = 0;
-    handle->frame.started = 0;
-    memset(&handle->audio_sector, 0, sizeof(audio_sector_t));
+    uint8_t     packet_count;
+    uint8_t     frame_count;
+    uint8_t     dst_encoded;
 }
+sector_header_entry_t;
 
-static inline int get_channel_count(audio_frame_info_t *frame_info)
+typedef struct
 {
-    if (frame_info->channel_bit_2 == 1 && frame_info->channel_bit_3 == 0)
+    uint16_t    length_high;                        // the 3 high bits of the packet length, in place
+    uint8_t     frame_start;
+    uint8_t     data_type;
+}
+packet_info_entry_t;
+
+typedef struct
+{
+    uint8_t     sector_count;
+    uint8_t     channel_count;
+}
+frame_info_entry_t;
+
+#define TABLE_4(f, n)    f(n), f(n + 1), f(n + 2), f(n + 3)
+#define TABLE_16(f, n)   TABLE_4(f, n), TABLE_4(f, n + 4), TABLE_4(f, n + 8), TABLE_4(f, n + 12)
+#define TABLE_64(f, n)   TABLE_16(f, n), TABLE_16(f, n + 16), TABLE_16(f, n + 32), TABLE_16(f, n + 48)
+#define TABLE_256(f)     TABLE_64(f, 0), TABLE_64(f, 64), TABLE_64(f, 128), TABLE_64(f, 192)
+
+#define SECTOR_HEADER_ENTRY(b)   { ((b) >> 5) & 7, ((b) >> 2) & 7, (b) & 1 }
+#define PACKET_INFO_ENTRY(b)     { ((b) & 7) << 8, ((b) >> 7) & 1, ((b) >> 3) & 7 }
+// channel_bit_2 set for 6 channels, channel_bit_3 set for 5 channels, else stereo
+#define FRAME_INFO_ENTRY(b)      { ((b) >> 2) & 31, ((b) & 3) == 2 ? 6 : ((b) & 3) == 1 ? 5 : 2 }
+
+static const sector_header_entry_t sector_header_table[256] = { TABLE_256(SECTOR_HEADER_ENTRY) };
+static const packet_info_entry_t packet_info_table[256] = { TABLE_256(PACKET_INFO_ENTRY) };
+static const frame_info_entry_t frame_info_table[256] = { TABLE_256(FRAME_INFO_ENTRY) };
+
+const uint8_t *scarletbook_decode_sector_header(audio_sector_desc_t *sector, const uint8_t *p)
+{
+    const sector_header_entry_t *header = &sector_header_table[p[0]];
+    int i;
+
+    sector->packet_count = header->packet_count;
+    sector->frame_count = header->frame_count;
+    sector->dst_encoded = header->dst_encoded;
+    p += AUDIO_SECTOR_HEADER_SIZE;
+
+    for (i = 0; i < sector->packet_count; i++)
     {
-        return 6;
+        const packet_info_entry_t *packet = &packet_info_table[p[0]];
+
+        sector->packet[i].packet_length = packet->length_high | p[1];
+        sector->packet[i].frame_start = packet->frame_start;
+        sector->packet[i].data_type = packet->data_type;
+        p += AUDIO_PACKET_INFO_SIZE;
     }
-    else if (frame_info->channel_bit_2 == 0 && frame_info->channel_bit_3 == 1)
+
+    // the frame info of plain DSD lacks the last byte
+    for (i = 0; i < sector->frame_count; i++)
     {
-        return 5;
+        sector->frame[i].timecode = (p[0] * 60 + p[1]) * SACD_FRAME_RATE + p[2];
+        if (sector->dst_encoded)
+        {
+            sector->frame[i].sector_count = frame_info_table[p[3]].sector_count;
+            sector->frame[i].channel_count = frame_info_table[p[3]].channel_count;
+            p += AUDIO_FRAME_INFO_SIZE;
+        }
+        else
+        {
+            sector->frame[i].sector_count = 0;
+            sector->frame[i].channel_count = 2;
+            p += AUDIO_FRAME_INFO_SIZE - 1;
+        }
     }
-    else
+
+    return p;
+}
+
+uint8_t *scarletbook_frame_coalesce(scarletbook_audio_frame_t *frame)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < frame->segment_count; i++)
+    {
+        // the first segment may already be in place
+        if (frame->segments[i].data != frame->data + size)
+        {
+            memcpy(frame->data + size, frame->segments[i].data, frame->segments[i].size);
+        }
+        size += frame->segments[i].size;
+    }
+    frame->segments[0].data = frame->data;
+    frame->segments[0].size = size;
+    frame->segment_count = size > 0 ? 1 : 0;
+
+    return frame->data;
+}
+
+static inline void add_frame_segment(scarletbook_audio_frame_t *frame, const uint8_t *data, size_t size)
+{
+    // packets that follow each other in a sector form one segment
+    if (frame->segment_count > 0)
     {
-        return 2;
+        scarletbook_frame_segment_t *last = &frame->segments[frame->segment_count - 1];
+
+        if (last->data + last->size == data)
+        {
+            last->size += size;
+            return;
+        }
     }
+    if (frame->segment_count == MAX_FRAME_SEGMENTS)
+    {
+        scarletbook_frame_coalesce(frame);
+    }
+    frame->segments[frame->segment_count].data = data;
+    frame->segments[frame->segment_count].size = size;
+    frame->segment_count++;
 }
 
-static inline void exec_read_callback(scarletbook_handle_t *handle, frame_read_callback_t frame_read_callback, void *userdata)
+static inline void exec_read_callback(scarletbook_handle_t *handle, scarletbook_frame_parser_t *parser, frame_segments_callback_t frame_read_callback, void *userdata)
 {
-    if (handle->frame.started && handle->frame.size > 0 && 
-        ((handle->frame.dst_encoded && handle->frame.sector_count == 0) ||
-        (!handle->frame.dst_encoded && handle->frame.size % FRAME_SIZE_64 == 0))
+    if (parser->frame.started && parser->frame.size > 0 && 
+        ((parser->frame.dst_encoded && parser->frame.sector_count == 0) ||
+        (!parser->frame.dst_encoded && parser->frame.size % FRAME_SIZE_64 == 0))
         )
     {
-        handle->frame.started = 0;
-        frame_read_callback(handle, handle->frame.data, handle->frame.size, userdata);
+        parser->frame.started = 0;
+        parser->frame.last_timecode = parser->frame.timecode;
+        parser->frame.last_size = parser->frame.size;
+        frame_read_callback(handle, &parser->frame, userdata);
     }
 }
 
-void scarletbook_process_frames(scarletbook_handle_t *handle, uint8_t *read_buffer, int blocks_read, int last_block, frame_read_callback_t frame_read_callback, void *userdata)
+/**
+ * replaces the frames lost to unreadable sectors with silence, timecode is
+ * the frame number of the first frame following the damage
+ */
+static void exec_silence_callback(scarletbook_handle_t *handle, scarletbook_frame_parser_t *parser, int timecode, frame_segments_callback_t frame_read_callback, void *userdata)
 {
-    int i, frame_info_counter;
+    int missing = timecode - parser->frame.last_timecode - 1;
+
+    parser->frame.damaged = 0;
+
+    // nothing to go by when the damage precedes the first frame
+    if (parser->frame.last_timecode < 0 || missing <= 0 || missing > MAX_SILENCE_FRAMES)
+        return;
+
+    if (parser->frame.dst_encoded)
+    {
+        // a DST frame that is not DST coded holds plain DSD
+        parser->frame.size = 1 + FRAME_SIZE_64 * parser->frame.channel_count;
+        parser->frame.data[0] = 0;
+        memset(parser->frame.data + 1, DSD_SILENCE_BYTE, parser->frame.size - 1);
+    }
+    else
+    {
+        parser->frame.size = parser->frame.last_size;
+        memset(parser->frame.data, DSD_SILENCE_BYTE, parser->frame.size);
+    }
+    parser->frame.segments[0].data = parser->frame.data;
+    parser->frame.segments[0].size = parser->frame.size;
+    parser->frame.segment_count = 1;
+    parser->frame.start_lsn = 0;
+
+    // last_timecode is the frame number of the frame handed to the callback
+    while (missing--)
+    {
+        parser->frame.last_timecode++;
+        frame_read_callback(handle, &parser->frame, userdata);
+    }
+}
+
+void scarletbook_process_bad_sector(scarletbook_frame_parser_t *parser)
+{
+    // drop the frame being read, the next sector starts with a new header
+    parser->frame.started = 0;
+    parser->frame.damaged = 1;
+    parser->packet_info_idx = 0;
+    parser->audio_sector.packet_count = 0;
+}
+
+void scarletbook_process_frame_segments(scarletbook_handle_t *handle, scarletbook_frame_parser_t *parser, uint8_t *read_buffer, int blocks_read, int last_block, frame_segments_callback_t frame_read_callback, void *userdata)
+{
+    int frame_info_counter;
+
+    if (parser->stopped)
+        return;
 
     while(blocks_read--)
     {
         uint8_t *read_buffer_ptr = read_buffer;
 
-        if (handle->packet_info_idx == handle->audio_sector.header.packet_info_count) 
+        if (parser->packet_info_idx == parser->audio_sector.packet_count) 
         {
-            handle->packet_info_idx = 0;
-
-            memcpy(&handle->audio_sector.header, read_buffer_ptr, AUDIO_SECTOR_HEADER_SIZE);
-            read_buffer_ptr += AUDIO_SECTOR_HEADER_SIZE;
-#if defined(__BIG_ENDIAN__)
-            memcpy(&handle->audio_sector.packet, read_buffer_ptr, AUDIO_PACKET_INFO_SIZE * handle->audio_sector.header.packet_info_count);
-            read_buffer_ptr += AUDIO_PACKET_INFO_SIZE * handle->audio_sector.header.packet_info_count;
-#else
-            // Little Endian systems cannot properly deal with audio_packet_info_t
-            {
-                for (i = 0; i < handle->audio_sector.header.packet_info_count; i++)
-                {
-                    handle->audio_sector.packet[i].frame_start = (read_buffer_ptr[0] >> 7) & 1;
-                    handle->audio_sector.packet[i].data_type = (read_buffer_ptr[0] >> 3) & 7;
-                    handle->audio_sector.packet[i].packet_length = (read_buffer_ptr[0] & 7) << 8 | read_buffer_ptr[1];
-                    read_buffer_ptr += AUDIO_PACKET_INFO_SIZE;
-                }
-            }
-#endif
-            if (handle->audio_sector.header.dst_encoded)
-            {
-                memcpy(&handle->audio_sector.frame, read_buffer_ptr, AUDIO_FRAME_INFO_SIZE * handle->audio_sector.header.frame_info_count);
-                read_buffer_ptr += AUDIO_FRAME_INFO_SIZE * handle->audio_sector.header.frame_info_count;
-            }
-            else
-            {
-                for (i = 0; i < handle->audio_sector.header.frame_info_count; i++)
-                {
-                    memcpy(&handle->audio_sector.frame[i], read_buffer_ptr, AUDIO_FRAME_INFO_SIZE - 1);
-                    read_buffer_ptr += AUDIO_FRAME_INFO_SIZE - 1;
-                }
-            }
+            parser->packet_info_idx = 0;
+            read_buffer_ptr = (uint8_t *) scarletbook_decode_sector_header(&parser->audio_sector, read_buffer_ptr);
         }
 
         frame_info_counter = 0;
-        while (handle->packet_info_idx < handle->audio_sector.header.packet_info_count) 
+        while (parser->packet_info_idx < parser->audio_sector.packet_count) 
         {
-            audio_packet_info_t* packet = &handle->audio_sector.packet[handle->packet_info_idx];
+            audio_packet_desc_t *packet = &parser->audio_sector.packet[parser->packet_info_idx];
             switch (packet->data_type) 
             {
             case DATA_TYPE_AUDIO:
                 if (packet->frame_start)
                 {
-                    exec_read_callback(handle, frame_read_callback, userdata);
+                    int timecode = parser->audio_sector.frame[frame_info_counter].timecode;
 
-                    handle->frame.size = 0;
-                    handle->frame.dst_encoded = handle->audio_sector.header.dst_encoded;
-                    handle->frame.sector_count = handle->audio_sector.frame[frame_info_counter].sector_count;
-                    handle->frame.channel_count = get_channel_count(&handle->audio_sector.frame[frame_info_counter]);
-                    handle->frame.started = 1;
+                    exec_read_callback(handle, parser, frame_read_callback, userdata);
+
+                    // the frames from here on are parsed by whoever parses the next part
+                    if (parser->stop_lsn && parser->lsn >= parser->stop_lsn)
+                    {
+                        parser->frame.started = 0;
+                        parser->stopped = 1;
+                        return;
+                    }
+                    if (parser->frame.damaged)
+                    {
+                        exec_silence_callback(handle, parser, timecode, frame_read_callback, userdata);
+                    }
+
+                    parser->frame.size = 0;
+                    parser->frame.segment_count = 0;
+                    parser->frame.dst_encoded = parser->audio_sector.dst_encoded;
+                    parser->frame.sector_count = parser->audio_sector.frame[frame_info_counter].sector_count;
+                    parser->frame.channel_count = parser->audio_sector.frame[frame_info_counter].channel_count;
+                    parser->frame.timecode = timecode;
+                    parser->frame.start_lsn = parser->lsn;
+                    parser->frame.start_offset = (int) (read_buffer_ptr - read_buffer);
+                    parser->frame.started = 1;
 
                     // advance frame_info_counter
                     frame_info_counter++;
                 }
-                if (handle->frame.started)
+                if (parser->frame.started)
                 {
-                    if (handle->frame.size + packet->packet_length < MAX_DST_SIZE)
+                    if (parser->frame.size + packet->packet_length < MAX_DST_SIZE)
                     {
-                        memcpy(handle->frame.data + handle->frame.size, read_buffer_ptr, packet->packet_length);
-                        handle->frame.size += packet->packet_length;
-                        if (handle->frame.dst_encoded)
+                        add_frame_segment(&parser->frame, read_buffer_ptr, packet->packet_length);
+                        parser->frame.end_lsn = parser->lsn;
+                        parser->frame.size += packet->packet_length;
+                        if (parser->frame.dst_encoded)
                         {
-                            handle->frame.sector_count--;
+                            parser->frame.sector_count--;
                         }
                     }
                     else
                     {
                         // buffer overflow error, try next frame..
-                        handle->frame.started = 0;
+                        parser->frame.started = 0;
                     }
                 }
                 break;
@@ -675,14 +867,45 @@ void scarletbook_process_frames(scarletbook_handle_t *handle, uint8_t *read_buff
             // advance the source pointer
             read_buffer_ptr += packet->packet_length;
 
-            handle->packet_info_idx++;
+            parser->packet_info_idx++;
         }
         read_buffer += SACD_LSN_SIZE;
+        if (parser->lsn)
+        {
+            parser->lsn++;
+        }
     }
 
     if (last_block) 
     {
-        exec_read_callback(handle, frame_read_callback, userdata);
+        exec_read_callback(handle, parser, frame_read_callback, userdata);
     }
+    else if (parser->frame.started)
+    {
+        // the read buffer is reused, the rest of the frame follows in the next call
+        scarletbook_frame_coalesce(&parser->frame);
+    }
+}
+
+typedef struct
+{
+    frame_read_callback_t   callback;
+    void                   *userdata;
+}
+frame_read_adapter_t;
+
+static void coalesce_frame_callback(scarletbook_handle_t *handle, scarletbook_audio_frame_t *frame, void *userdata)
+{
+    frame_read_adapter_t *adapter = (frame_read_adapter_t *) userdata;
+
+    adapter->callback(handle, scarletbook_frame_coalesce(frame), frame->size, adapter->userdata);
+}
+
+void scarletbook_process_frames(scarletbook_handle_t *handle, scarletbook_frame_parser_t *parser, uint8_t *read_buffer, int blocks_read, int last_block, frame_read_callback_t frame_read_callback, void *userdata)
+{
+    frame_read_adapter_t adapter;
 
+    adapter.callback = frame_read_callback;
+    adapter.userdata = userdata;
+    scarletbook_process_frame_segments(handle, parser, read_buffer, blocks_read, last_block, coalesce_frame_callback, &adapter);
 }
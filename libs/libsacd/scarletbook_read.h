@@ -37,20 +37,66 @@ extern "C" {
  */
 scarletbook_handle_t *scarletbook_open(sacd_reader_t *, int);
 
+/**
+ * creates the state needed to reassemble audio frames, every track that is
+ * processed at the same time needs its own parser
+ */
+scarletbook_frame_parser_t *scarletbook_frame_parser_create(void);
+void scarletbook_frame_parser_destroy(scarletbook_frame_parser_t *);
+
 /**
  * initialize scarletbook audio frames structs
  */
-void scarletbook_frame_init(scarletbook_handle_t *handle);
+void scarletbook_frame_init(scarletbook_frame_parser_t *);
+
+/**
+ * resets a parser to start parsing at sector lsn, the frame that is in
+ * progress there is skipped. When stop_lsn is not 0 the parser hands out
+ * the frames that start before stop_lsn, reading past it to complete the
+ * last of them, and stops at the first frame that starts at or after it.
+ * A range of sectors can so be split in parts that are parsed at the same
+ * time, each part ends where the next one starts.
+ */
+void scarletbook_frame_parser_resync(scarletbook_frame_parser_t *, uint32_t lsn, uint32_t stop_lsn);
 
 /**
  * callback when a complete audio frame has been read
  */
 typedef void (*frame_read_callback_t)(scarletbook_handle_t *handle, uint8_t* frame_data, size_t frame_size, void *userdata);
 
+/**
+ * callback when a complete audio frame has been read, the frame is described
+ * by frame->segments, which are only valid during the callback
+ */
+typedef void (*frame_segments_callback_t)(scarletbook_handle_t *handle, scarletbook_audio_frame_t *frame, void *userdata);
+
 /**
  * processes scarletbook audio frames and does a callback in case it found a frame
  */
-void scarletbook_process_frames(scarletbook_handle_t *, uint8_t *, int, int, frame_read_callback_t, void *);
+void scarletbook_process_frames(scarletbook_handle_t *, scarletbook_frame_parser_t *, uint8_t *, int, int, frame_read_callback_t, void *);
+
+/**
+ * same as scarletbook_process_frames, but the frames are handed out as the
+ * pieces they were read in, without copying them together
+ */
+void scarletbook_process_frame_segments(scarletbook_handle_t *, scarletbook_frame_parser_t *, uint8_t *, int, int, frame_segments_callback_t, void *);
+
+/**
+ * copies the segments of a frame together, returns the contiguous frame
+ */
+uint8_t *scarletbook_frame_coalesce(scarletbook_audio_frame_t *);
+
+/**
+ * decodes the header at the start of an audio sector in a single pass,
+ * returns the first byte after it
+ */
+const uint8_t *scarletbook_decode_sector_header(audio_sector_desc_t *, const uint8_t *);
+
+/**
+ * skips a sector that could not be read, the frames that are lost are
+ * replaced by silence once the next frame is found
+ */
+void scarletbook_process_bad_sector(scarletbook_frame_parser_t *);
 
 /**
  * scarletbook_close(ifofile);
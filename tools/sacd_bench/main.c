@@ -0,0 +1,304 @@
+/**
+ * SACD Ripper - https://github.com/sacd-ripper/
+ *
+ * Copyright (c) 2010-2015 by respective authors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/**
+ * Compares the decoding of audio sector headers through lookup tables
+ * (scarletbook_decode_sector_header) with the bit field structs it replaced.
+ * The headers of all audio sectors of an image are captured first, both
+ * decoders then run over them and must agree on every sector.
+ *
+ *   sacd_bench <image> [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <logging.h>
+#include <timeout.h>
+
+#include <sacd_reader.h>
+#include <scarletbook.h>
+#include <scarletbook_read.h>
+
+// the largest header: 7 packet infos and 7 DST frame infos
+#define MAX_SECTOR_HEADER_SIZE  (AUDIO_SECTOR_HEADER_SIZE + 7 * AUDIO_PACKET_INFO_SIZE + 7 * AUDIO_FRAME_INFO_SIZE)
+#define CAPTURE_BLOCK_SIZE      512
+#define DEFAULT_ROUNDS          2000
+
+typedef const uint8_t *(*sector_header_decoder_t)(audio_sector_desc_t *, const uint8_t *);
+
+static inline int get_channel_count(audio_frame_info_t *frame_info)
+{
+    if (frame_info->channel_bit_2 == 1 && frame_info->channel_bit_3 == 0)
+    {
+        return 6;
+    }
+    else if (frame_info->channel_bit_2 == 0 && frame_info->channel_bit_3 == 1)
+    {
+        return 5;
+    }
+    else
+    {
+        return 2;
+    }
+}
+
+/**
+ * the decoding as it was done before the lookup tables, through the packed
+ * bit field structs of scarletbook.h
+ */
+static const uint8_t *decode_sector_header_bitfields(audio_sector_desc_t *desc, const uint8_t *read_buffer_ptr)
+{
+    audio_sector_t audio_sector;
+    int i;
+
+    memset(&audio_sector, 0, sizeof(audio_sector_t));
+
+    memcpy(&audio_sector.header, read_buffer_ptr, AUDIO_SECTOR_HEADER_SIZE);
+    read_buffer_ptr += AUDIO_SECTOR_HEADER_SIZE;
+#if defined(__BIG_ENDIAN__)
+    memcpy(&audio_sector.packet, read_buffer_ptr, AUDIO_PACKET_INFO_SIZE * audio_sector.header.packet_info_count);
+    read_buffer_ptr += AUDIO_PACKET_INFO_SIZE * audio_sector.header.packet_info_count;
+#else
+    // Little Endian systems cannot properly deal with audio_packet_info_t
+    for (i = 0; i < audio_sector.header.packet_info_count; i++)
+    {
+        audio_sector.packet[i].frame_start = (read_buffer_ptr[0] >> 7) & 1;
+        audio_sector.packet[i].data_type = (read_buffer_ptr[0] >> 3) & 7;
+        audio_sector.packet[i].packet_length = (read_buffer_ptr[0] & 7) << 8 | read_buffer_ptr[1];
+        read_buffer_ptr += AUDIO_PACKET_INFO_SIZE;
+    }
+#endif
+    if (audio_sector.header.dst_encoded)
+    {
+        memcpy(&audio_sector.frame, read_buffer_ptr, AUDIO_FRAME_INFO_SIZE * audio_sector.header.frame_info_count);
+        read_buffer_ptr += AUDIO_FRAME_INFO_SIZE * audio_sector.header.frame_info_count;
+    }
+    else
+    {
+        for (i = 0; i < audio_sector.header.frame_info_count; i++)
+        {
+            memcpy(&audio_sector.frame[i], read_buffer_ptr, AUDIO_FRAME_INFO_SIZE - 1);
+            read_buffer_ptr += AUDIO_FRAME_INFO_SIZE - 1;
+        }
+    }
+
+    desc->packet_count = audio_sector.header.packet_info_count;
+    desc->frame_count = audio_sector.header.frame_info_count;
+    desc->dst_encoded = audio_sector.header.dst_encoded;
+    for (i = 0; i < desc->packet_count; i++)
+    {
+        desc->packet[i].packet_length = audio_sector.packet[i].packet_length;
+        desc->packet[i].frame_start = audio_sector.packet[i].frame_start;
+        desc->packet[i].data_type = audio_sector.packet[i].data_type;
+    }
+    for (i = 0; i < desc->frame_count; i++)
+    {
+        desc->frame[i].timecode = TIME_FRAMECOUNT(&audio_sector.frame[i].timecode);
+        desc->frame[i].sector_count = audio_sector.frame[i].sector_count;
+        desc->frame[i].channel_count = get_channel_count(&audio_sector.frame[i]);
+    }
+
+    return read_buffer_ptr;
+}
+
+static int same_sector_desc(const audio_sector_desc_t *a, const audio_sector_desc_t *b)
+{
+    int i;
+
+    if (a->packet_count != b->packet_count || a->frame_count != b->frame_count || a->dst_encoded != b->dst_encoded)
+        return 0;
+
+    for (i = 0; i < a->packet_count; i++)
+    {
+        if (a->packet[i].packet_length != b->packet[i].packet_length || a->packet[i].frame_start != b->packet[i].frame_start ||
+            a->packet[i].data_type != b->packet[i].data_type)
+            return 0;
+    }
+    for (i = 0; i < a->frame_count; i++)
+    {
+        if (a->frame[i].timecode != b->frame[i].timecode || a->frame[i].sector_count != b->frame[i].sector_count ||
+            a->frame[i].channel_count != b->frame[i].channel_count)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * copies the start of every audio sector of the areas of the disc,
+ * returns the number of sectors captured
+ */
+static uint32_t capture_sector_headers(sacd_reader_t *sacd, scarletbook_handle_t *handle, uint8_t **headers)
+{
+    uint8_t *block = (uint8_t *) malloc(CAPTURE_BLOCK_SIZE * SACD_LSN_SIZE);
+    uint32_t sector_count = 0, capacity = 0;
+    int area;
+
+    *headers = 0;
+    if (!block)
+        return 0;
+
+    for (area = 0; area < handle->area_count; area++)
+    {
+        uint32_t lsn = handle->area[area].area_toc->track_start;
+        uint32_t end_lsn = handle->area[area].area_toc->track_end + 1;
+
+        while (lsn < end_lsn)
+        {
+            uint32_t block_size = end_lsn - lsn < CAPTURE_BLOCK_SIZE ? end_lsn - lsn : CAPTURE_BLOCK_SIZE;
+            uint32_t i;
+
+            if (sacd_read_block_raw(sacd, lsn, block_size, block) != (ssize_t) block_size)
+            {
+                fprintf(stderr, "could not read sector %u\n", lsn);
+                free(block);
+                return sector_count;
+            }
+            if (sector_count + block_size > capacity)
+            {
+                uint8_t *grown;
+
+                capacity = (sector_count + block_size) * 2;
+                grown = (uint8_t *) realloc(*headers, (size_t) capacity * MAX_SECTOR_HEADER_SIZE);
+                if (!grown)
+                {
+                    free(block);
+                    return sector_count;
+                }
+                *headers = grown;
+            }
+            for (i = 0; i < block_size; i++)
+            {
+                memcpy(*headers + (size_t) sector_count++ * MAX_SECTOR_HEADER_SIZE, block + (size_t) i * SACD_LSN_SIZE, MAX_SECTOR_HEADER_SIZE);
+            }
+            lsn += block_size;
+        }
+    }
+    free(block);
+
+    return sector_count;
+}
+
+// returns the time per sector in nanoseconds
+static double time_decoder(sector_header_decoder_t decoder, const uint8_t *headers, uint32_t sector_count, int rounds, uint64_t *checksum)
+{
+    audio_sector_desc_t desc;
+    double start;
+    uint32_t i;
+    int round;
+
+    start = timeout_gettime();
+    for (round = 0; round < rounds; round++)
+    {
+        for (i = 0; i < sector_count; i++)
+        {
+            const uint8_t *end = decoder(&desc, headers + (size_t) i * MAX_SECTOR_HEADER_SIZE);
+
+            // keeps the decoding from being optimized away
+            *checksum += (uint64_t) (end - headers) + desc.packet_count + desc.packet[0].packet_length + desc.frame[0].timecode;
+        }
+    }
+    return (timeout_gettime() - start) * 1e9 / ((double) sector_count * rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    sacd_reader_t *sacd;
+    scarletbook_handle_t *handle;
+    uint8_t *headers;
+    uint32_t sector_count, i, mismatches = 0;
+    uint64_t table_checksum = 0, bitfield_checksum = 0;
+    double table_time, bitfield_time;
+    int rounds = DEFAULT_ROUNDS;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <image> [rounds]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        rounds = atoi(argv[2]);
+        if (rounds < 1)
+            rounds = 1;
+    }
+
+    init_logging();
+
+    sacd = sacd_open(argv[1]);
+    if (!sacd)
+    {
+        fprintf(stderr, "could not open %s\n", argv[1]);
+        return 1;
+    }
+    handle = scarletbook_open(sacd, 0);
+    if (!handle)
+    {
+        fprintf(stderr, "%s is not a SACD\n", argv[1]);
+        sacd_close(sacd);
+        return 1;
+    }
+
+    sector_count = capture_sector_headers(sacd, handle, &headers);
+    scarletbook_close(handle);
+    sacd_close(sacd);
+    if (sector_count == 0)
+    {
+        fprintf(stderr, "no audio sectors were captured\n");
+        free(headers);
+        return 1;
+    }
+
+    // both decoders have to agree on every sector before they are timed
+    for (i = 0; i < sector_count; i++)
+    {
+        const uint8_t *header = headers + (size_t) i * MAX_SECTOR_HEADER_SIZE;
+        audio_sector_desc_t table_desc, bitfield_desc;
+        const uint8_t *table_end = scarletbook_decode_sector_header(&table_desc, header);
+        const uint8_t *bitfield_end = decode_sector_header_bitfields(&bitfield_desc, header);
+
+        if (table_end != bitfield_end || !same_sector_desc(&table_desc, &bitfield_desc))
+        {
+            if (mismatches++ < 10)
+                fprintf(stderr, "sector %u: the decoders differ\n", i);
+        }
+    }
+    if (mismatches > 0)
+    {
+        fprintf(stderr, "%u of %u sectors decoded differently\n", mismatches, sector_count);
+        free(headers);
+        return 1;
+    }
+
+    bitfield_time = time_decoder(decode_sector_header_bitfields, headers, sector_count, rounds, &bitfield_checksum);
+    table_time = time_decoder(scarletbook_decode_sector_header, headers, sector_count, rounds, &table_checksum);
+
+    printf("%u audio sectors, %d rounds, both decoders agree\n", sector_count, rounds);
+    printf("bit fields:    %6.2f ns/sector\n", bitfield_time);
+    printf("lookup tables: %6.2f ns/sector\n", table_time);
+
+    free(headers);
+    destroy_logging();
+
+    return table_checksum == bitfield_checksum ? 0 : 1;
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
@@ -57,6 +58,7 @@
 #include <fileutils.h>
 #include <utils.h>
 #include <yarn.h>
+#include <timeout.h>
 
 static struct opts_s
 {
@@ -66,18 +68,56 @@ static struct opts_s
     int            output_dsdiff_em;
     int            output_dsdiff;
     int            output_iso;
+    int            output_sacdz;
     int            convert_dst;
     int            export_cue_sheet;
+    int            recover;
+    int            stats;
+    int            jobs;
+    int            parse_threads;
+    int            transfer_size;
+    int            area_stream;
+    int            resume;
+    int            memory_limit;
+    int            metrics_fd;
     int            print;
+    int            output_to_stdout;
     char          *input_device; /* Access method driver should use for control */
+    char          *index_dir;
     char           output_file[512];
     int            select_tracks;
+    int            range;
+    int            range_first_frame;
+    int            range_end_frame;
     char           selected_tracks[256]; /* scarletbook is limited to 256 tracks */
 } opts;
 
 scarletbook_handle_t *handle;
 scarletbook_output_t *output;
 
+// messages go to stderr when the audio is written to stdout
+static FILE *message_stream;
+
+// parses "mm:ss:ff-mm:ss:ff" into the frames [first, end) of an area
+static int parse_range(const char *range, int *first_frame, int *end_frame)
+{
+    int minutes[2], seconds[2], frames[2], length = 0, i;
+
+    if (sscanf(range, "%d:%d:%d-%d:%d:%d%n", &minutes[0], &seconds[0], &frames[0], 
+               &minutes[1], &seconds[1], &frames[1], &length) != 6 || range[length] != 0)
+        return -1;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (minutes[i] < 0 || seconds[i] < 0 || seconds[i] >= 60 || frames[i] < 0 || frames[i] >= SACD_FRAME_RATE)
+            return -1;
+    }
+    *first_frame = (minutes[0] * 60 + seconds[0]) * SACD_FRAME_RATE + frames[0];
+    *end_frame = (minutes[1] * 60 + seconds[1]) * SACD_FRAME_RATE + frames[1];
+
+    return *end_frame > *first_frame ? 0 : -1;
+}
+
 /* Parse all options. */
 static int parse_options(int argc, char *argv[]) 
 {
@@ -86,17 +126,44 @@ static int parse_options(int argc, char *argv[])
 
     static const char help_text[] =
         "Usage: %s [options] [outfile]\n"
+        "  outfile \"-\" writes a single file (one track or the edit master) to\n"
+        "  standard output, DST is then converted to DSD\n"
         "  -2, --2ch-tracks                : Export two channel tracks (default)\n"
         "  -m, --mch-tracks                : Export multi-channel tracks\n"
         "  -e, --output-dsdiff-em          : output as Philips DSDIFF (Edit Master) file\n"
         "  -p, --output-dsdiff             : output as Philips DSDIFF file\n"
         "  -s, --output-dsf                : output as Sony DSF file\n"
         "  -t, --select-track              : only output selected track(s) (ex. -t 1,5,13)\n"
+        "  -E, --range=START-END           : output the part of the area from START up to\n"
+        "                                    END as a single file (ex. -E 01:00:00-01:30:00),\n"
+        "                                    times are mm:ss:ff with 75 frames a second\n"
         "  -I, --output-iso                : output as RAW ISO\n"
+        "  -z, --output-sacdz              : output as compressed ISO (sacdz)\n"
         "  -c, --convert-dst               : convert DST to DSD\n"
         "  -C, --export-cue                : Export a CUE Sheet\n"
+        "                                    output options can be combined (ex. -I -s -e),\n"
+        "                                    the disc is then read only once for all of them\n"
+        "  -r, --recover                   : continue on read errors, unreadable sectors\n"
+        "                                    are replaced by silence (or zeros for ISO)\n"
+        "  -S, --stats                     : show the time spent in each stage of the rip\n"
+        "  -j, --jobs=N                    : number of tracks that are ripped at the same time\n"
+        "  -a, --area-stream               : read the whole area once and split the tracks\n"
+        "                                    at their frame boundaries (overrides -j)\n"
+        "  -R, --resume                    : keep a journal of the rip, an interrupted rip\n"
+        "                                    continues where it stopped when run again\n"
+        "  -M, --memory=MB                 : memory for frames waiting to be DST decoded\n"
+        "                                    and written, reading waits when it is used up\n"
+        "  -J, --metrics=FD                : write the progress to file descriptor FD every\n"
+        "                                    second, one JSON object per line\n"
+        "  -T, --parse-threads=N           : parse the sectors that are read with N threads\n"
+        "  -B, --transfer=SECTORS          : sectors requested per read, by default the\n"
+        "                                    size with the highest throughput is picked\n"
+        "  -x, --index=DIR                 : keep an index of the sectors of the frames of\n"
+        "                                    each disc in DIR, to seek to any frame later\n"
         "  -i, --input[=FILE]              : set source and determine if \"iso\" image, \n"
         "                                    device or server (ex. -i 192.168.1.10:2002)\n"
+        "                                    split images are read from their first part\n"
+        "                                    (ex. -i album.iso.001)\n"
         "  -P, --print                     : display disc and track information\n" 
         "\n"
         "Help options:\n"
@@ -106,10 +173,14 @@ static int parse_options(int argc, char *argv[])
     static const char usage_text[] = 
         "Usage: %s [-2|--2ch-tracks] [-m|--mch-tracks] [-p|--output-dsdiff]\n"
         "        [-e|--output-dsdiff-em] [-s|--output-dsf] [-I|--output-iso]\n"
-        "        [-c|--convert-dst] [-C|--export-cue] [-i|--input FILE] [-P|--print]\n"
+        "        [-z|--output-sacdz] [-t|--select-track N] [-E|--range START-END]\n"
+        "        [-c|--convert-dst] [-C|--export-cue] [-r|--recover] [-S|--stats] [-j|--jobs N]\n"
+        "        [-a|--area-stream] [-R|--resume] [-M|--memory MB]\n"
+        "        [-J|--metrics FD] [-x|--index DIR] [-T|--parse-threads N]\n"
+        "        [-B|--transfer SECTORS] [-i|--input FILE] [-P|--print]\n"
         "        [-?|--help] [--usage]\n";
 
-    static const char options_string[] = "2mepsIcCi:t:P?";
+    static const char options_string[] = "2mepsIzcCrSj:aRM:J:x:T:B:E:i:t:P?";
     static const struct option options_table[] = {
         {"2ch-tracks", no_argument, NULL, '2' },
         {"mch-tracks", no_argument, NULL, 'm' },
@@ -117,8 +188,20 @@ static int parse_options(int argc, char *argv[])
         {"output-dsdiff", no_argument, NULL, 'p'}, 
         {"output-dsf", no_argument, NULL, 's'}, 
         {"output-iso", no_argument, NULL, 'I'}, 
+        {"output-sacdz", no_argument, NULL, 'z'}, 
         {"convert-dst", no_argument, NULL, 'c'}, 
         {"export-cue", no_argument, NULL, 'C'}, 
+        {"recover", no_argument, NULL, 'r'}, 
+        {"stats", no_argument, NULL, 'S'}, 
+        {"jobs", required_argument, NULL, 'j'}, 
+        {"area-stream", no_argument, NULL, 'a'}, 
+        {"resume", no_argument, NULL, 'R'}, 
+        {"memory", required_argument, NULL, 'M'}, 
+        {"metrics", required_argument, NULL, 'J'}, 
+        {"index", required_argument, NULL, 'x'}, 
+        {"parse-threads", required_argument, NULL, 'T'}, 
+        {"transfer", required_argument, NULL, 'B'}, 
+        {"range", required_argument, NULL, 'E'}, 
         {"input", required_argument, NULL, 'i' },
         {"print", no_argument, NULL, 'P' },
 
@@ -140,22 +223,13 @@ static int parse_options(int argc, char *argv[])
             break;
         case 'e': 
             opts.output_dsdiff_em = 1;
-            opts.output_dsdiff = 0;
-            opts.output_dsf = 0; 
-            opts.output_iso = 0;
             opts.export_cue_sheet = 1;
             break;
         case 'p': 
-            opts.output_dsdiff_em = 0; 
             opts.output_dsdiff = 1; 
-            opts.output_dsf = 0; 
-            opts.output_iso = 0;
             break;
         case 's': 
-            opts.output_dsdiff_em = 0; 
-            opts.output_dsdiff = 0; 
             opts.output_dsf = 1; 
-            opts.output_iso = 0;
             break;
         case 't': 
             {
@@ -175,13 +249,32 @@ static int parse_options(int argc, char *argv[])
             }
             break;
         case 'I': 
-            opts.output_dsdiff_em = 0; 
-            opts.output_dsdiff = 0; 
-            opts.output_dsf = 0; 
             opts.output_iso = 1;
             break;
+        case 'z': 
+            opts.output_sacdz = 1;
+            break;
         case 'c': opts.convert_dst = 1; break;
         case 'C': opts.export_cue_sheet = 1; break;
+        case 'r': opts.recover = 1; break;
+        case 'S': opts.stats = 1; break;
+        case 'j': opts.jobs = atoi(optarg); break;
+        case 'a': opts.area_stream = 1; break;
+        case 'R': opts.resume = 1; break;
+        case 'M': opts.memory_limit = atoi(optarg); break;
+        case 'J': opts.metrics_fd = atoi(optarg); break;
+        case 'x': opts.index_dir = strdup(optarg); break;
+        case 'T': opts.parse_threads = atoi(optarg); break;
+        case 'B': opts.transfer_size = atoi(optarg); break;
+        case 'E': 
+            if (parse_range(optarg, &opts.range_first_frame, &opts.range_end_frame) != 0)
+            {
+                fprintf(stderr, "Invalid range %s, expected mm:ss:ff-mm:ss:ff\n", optarg);
+                free(program_name);
+                return 0;
+            }
+            opts.range = 1;
+            break;
         case 'i': opts.input_device = strdup(optarg); break;
         case 'P': opts.print = 1; break;
 
@@ -204,6 +297,16 @@ static int parse_options(int argc, char *argv[])
         strcpy(opts.output_file, remaining_arg);
     }
 
+    // a stream cannot be seeked to index DST frames, nor has it a directory
+    // for a cue sheet or journal
+    if (strcmp(opts.output_file, "-") == 0)
+    {
+        opts.output_to_stdout = 1;
+        opts.convert_dst = 1;
+        opts.export_cue_sheet = 0;
+        opts.resume = 0;
+    }
+
     return 1;
 }
 
@@ -216,6 +319,9 @@ static int safe_fwprintf(FILE *stream, const wchar_t *format, ...)
 
     possess(g_fwprintf_lock);
 
+    if (stream == stdout)
+        stream = message_stream;
+
     va_start(arglist, format);
     retval = vfwprintf(stream, format, arglist);
     va_end(arglist);
@@ -229,7 +335,7 @@ static int safe_fwprintf(FILE *stream, const wchar_t *format, ...)
 
 static void handle_sigint(int sig_no)
 {
-    safe_fwprintf(stdout, L"\rUser interrupted..                                                      \n");
+    safe_fwprintf(message_stream, L"\rUser interrupted..                                                      \n");
     scarletbook_output_interrupt(output);
 }
 
@@ -240,16 +346,43 @@ static void handle_status_update_track_callback(char *filename, int current_trac
 #else
     wchar_t *wide_filename = (wchar_t *) charset_convert(filename, strlen(filename), "UTF-8", "WCHAR_T");
 #endif
-    safe_fwprintf(stdout, L"\rProcessing [%ls] (%d/%d)..\n", wide_filename, current_track, total_tracks);
+    safe_fwprintf(message_stream, L"\rProcessing [%ls] (%d/%d)..\n", wide_filename, current_track, total_tracks);
     free(wide_filename);
 }
 
 static time_t started_processing;
 
+// number of files the selected output options write
+static int count_output_files(int area_idx)
+{
+    int i, track_count = 0;
+
+    for (i = 0; i < handle->area[area_idx].area_toc->track_count; i++)
+    {
+        if (!opts.select_tracks || opts.selected_tracks[i])
+            track_count++;
+    }
+    if (opts.range)
+    {
+        track_count = 1;
+    }
+
+    return opts.output_iso + opts.output_sacdz + opts.output_dsdiff_em + (opts.output_dsf + opts.output_dsdiff) * track_count;
+}
+
+// "-" for a file streamed to stdout
+static char *make_output_filename(const char *path, const char *filename, const char *extension)
+{
+    if (opts.output_to_stdout)
+        return strdup("-");
+
+    return make_filename(0, path, filename, extension);
+}
+
 static void handle_status_update_progress_callback(uint32_t stats_total_sectors, uint32_t stats_total_sectors_processed,
                                  uint32_t stats_current_file_total_sectors, uint32_t stats_current_file_sectors_processed)
 {
-    safe_fwprintf(stdout, L"\rCompleted: %d%% (%.1fMB), Total: %d%% (%.1fMB) at %.2fMB/sec", (stats_current_file_sectors_processed*100/stats_current_file_total_sectors), 
+    safe_fwprintf(message_stream, L"\rCompleted: %d%% (%.1fMB), Total: %d%% (%.1fMB) at %.2fMB/sec", (stats_current_file_sectors_processed*100/stats_current_file_total_sectors), 
                                              ((float)((double) stats_current_file_sectors_processed * SACD_LSN_SIZE / 1048576.00)),
                                              (stats_total_sectors_processed * 100 / stats_total_sectors),
                                              ((float)((double) stats_current_file_total_sectors * SACD_LSN_SIZE / 1048576.00)),
@@ -257,6 +390,121 @@ static void handle_status_update_progress_callback(uint32_t stats_total_sectors,
                                              );
 }
 
+static scarletbook_output_stats_t stage_stats;
+static double started_stage_timing;
+
+static void handle_status_update_stage_callback(const scarletbook_output_stats_t *stats)
+{
+    stage_stats = *stats;
+}
+
+static void print_stage_stats(void)
+{
+    double elapsed = timeout_gettime() - started_stage_timing;
+
+    if (elapsed <= 0.0)
+        elapsed = 1.0;
+
+    fwprintf(message_stream, L"Stage timing (stages run in parallel, %.2fs elapsed):\n", elapsed);
+    fwprintf(message_stream, L"  read wait      : %8.2fs (%3.0f%%) %lu sectors\n", stage_stats.read_time, stage_stats.read_time * 100.0 / elapsed, (unsigned long) stage_stats.sectors_read);
+    fwprintf(message_stream, L"  decrypt        : %8.2fs (%3.0f%%)\n", stage_stats.decrypt_time, stage_stats.decrypt_time * 100.0 / elapsed);
+    fwprintf(message_stream, L"  frame parse    : %8.2fs (%3.0f%%) %lu frames\n", stage_stats.parse_time, stage_stats.parse_time * 100.0 / elapsed, (unsigned long) stage_stats.frames_parsed);
+    fwprintf(message_stream, L"  DST queue wait : %8.2fs (%3.0f%%)\n", stage_stats.dst_queue_time, stage_stats.dst_queue_time * 100.0 / elapsed);
+    fwprintf(message_stream, L"  DST decode     : %8.2fs (%3.0f%%) %lu frames, summed over all decoder threads\n", stage_stats.decode_time, stage_stats.decode_time * 100.0 / elapsed, (unsigned long) stage_stats.frames_decoded);
+    fwprintf(message_stream, L"  write queue    : %8.2fs (%3.0f%%)\n", stage_stats.write_queue_time, stage_stats.write_queue_time * 100.0 / elapsed);
+    fwprintf(message_stream, L"  write          : %8.2fs (%3.0f%%) %.1fMB\n", stage_stats.write_time, stage_stats.write_time * 100.0 / elapsed, (double) stage_stats.bytes_written / 1048576.00);
+}
+
+// metrics are written every second while the rip runs
+#define METRICS_INTERVAL 1.0
+
+static FILE *metrics_stream;
+
+static void write_json_string(FILE *stream, const char *str)
+{
+    fputc('"', stream);
+    for (; *str; str++)
+    {
+        unsigned char c = (unsigned char) *str;
+
+        if (c == '"' || c == '\\')
+            fprintf(stream, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(stream, "\\u%04x", c);
+        else
+            fputc(c, stream);
+    }
+    fputc('"', stream);
+}
+
+static void write_metrics(double elapsed, double interval, const scarletbook_output_metrics_t *metrics, const scarletbook_output_metrics_t *previous)
+{
+    double utilisation = 0.0;
+    int i;
+
+    // decoding time per second of the decoding threads that are running
+    if (metrics->decoder_threads > 0 && interval > 0.0)
+    {
+        utilisation = (metrics->decode_time - previous->decode_time) / (interval * metrics->decoder_threads);
+    }
+
+    fprintf(metrics_stream, "{\"time\":%.3f,\"sectors_read\":%u,\"sectors_total\":%u,\"sectors_per_second\":%.1f,"
+                            "\"frames_parsed\":%" PRIu64 ",\"frames_decoded\":%" PRIu64 ",\"dst_queue_depth\":%d,"
+                            "\"decoder_threads\":%d,\"decoder_utilisation\":%.3f,\"bytes_written\":%" PRIu64 ",\"files\":[",
+            elapsed, metrics->sectors_processed, metrics->total_sectors, 
+            interval > 0.0 ? (metrics->sectors_processed - previous->sectors_processed) / interval : 0.0,
+            metrics->frames_parsed, metrics->frames_decoded, metrics->dst_queue_depth, 
+            metrics->decoder_threads, utilisation, metrics->bytes_written);
+
+    for (i = 0; i < metrics->file_count; i++)
+    {
+        const scarletbook_output_file_metrics_t *file = &metrics->files[i];
+
+        fprintf(metrics_stream, "%s{\"name\":", i > 0 ? "," : "");
+        write_json_string(metrics_stream, file->filename);
+        fprintf(metrics_stream, ",\"progress\":%.4f,\"eta\":", file->progress);
+        if (file->progress > 0.0)
+            fprintf(metrics_stream, "%.1f}", file->elapsed * (1.0 - file->progress) / file->progress);
+        else
+            fprintf(metrics_stream, "null}");
+    }
+    fprintf(metrics_stream, "]}\n");
+    fflush(metrics_stream);
+}
+
+// writes the metrics until the rip has finished, the last line covers all files
+static void metrics_thread(void *arg)
+{
+    scarletbook_output_metrics_t *metrics = (scarletbook_output_metrics_t *) calloc(2, sizeof(scarletbook_output_metrics_t));
+    double started = timeout_gettime(), last = started;
+    int busy, current = 0;
+
+    if (!metrics)
+        return;
+
+    do
+    {
+        double now;
+
+        do
+        {
+            usleep(50000);
+            busy = scarletbook_output_is_busy(output);
+            now = timeout_gettime();
+        }
+        while (busy && now - last < METRICS_INTERVAL);
+
+        scarletbook_output_get_metrics(output, &metrics[current]);
+        write_metrics(now - started, now - last, &metrics[current], &metrics[current ^ 1]);
+
+        current ^= 1;
+        last = now;
+    }
+    while (busy);
+
+    free(metrics);
+}
+
 /* Initialize global variables. */
 static void init(void) 
 {
@@ -265,11 +513,20 @@ static void init(void)
     opts.multi_channel      = 0;
     opts.output_dsf         = 0;
     opts.output_iso         = 0;
+    opts.output_sacdz       = 0;
     opts.output_dsdiff      = 0;
     opts.output_dsdiff_em   = 0;
     opts.convert_dst        = 0;
     opts.export_cue_sheet   = 0;
+    opts.recover            = 0;
+    opts.stats              = 0;
+    opts.jobs               = 1;
+    opts.parse_threads      = 1;
+    opts.transfer_size      = 0;
+    opts.area_stream        = 0;
+    opts.resume             = 0;
     opts.print              = 0;
+    opts.metrics_fd         = -1;
     opts.input_device       = "/dev/cdrom";
 
 #ifdef _WIN32
@@ -288,7 +545,7 @@ static void init(void)
 int main(int argc, char* argv[]) 
 {
     char *albumdir = 0, *musicfilename, *file_path = 0;
-    int i, area_idx;
+    int i, area_idx, exit_code = 0;
     sacd_reader_t *sacd_reader;
 
 #ifdef PTW32_STATIC_LIB
@@ -300,7 +557,8 @@ int main(int argc, char* argv[])
     if (parse_options(argc, argv)) 
     {
         setlocale(LC_ALL, "");
-        if (fwide(stdout, 1) < 0)
+        message_stream = opts.output_to_stdout ? stderr : stdout;
+        if (fwide(message_stream, 1) < 0)
         {
             fprintf(stderr, "ERROR: Output not set to wide.\n");
         }
@@ -323,15 +581,64 @@ int main(int argc, char* argv[])
                     scarletbook_print(handle);
                 }
 
-                if (opts.output_dsf || opts.output_iso || opts.output_dsdiff || opts.output_dsdiff_em || opts.export_cue_sheet)
+                // select the channel area
+                area_idx = ((has_multi_channel(handle) && opts.multi_channel) || !has_two_channel(handle)) ? handle->mulch_area_idx : handle->twoch_area_idx;
+
+                if (opts.output_to_stdout && count_output_files(area_idx) != 1)
+                {
+                    fwprintf(message_stream, L"Only a single file can be written to standard output, select one track with -t\n");
+                }
+                else if (opts.output_to_stdout && opts.output_sacdz)
+                {
+                    // its header points to the chunk index, which is only known at the end
+                    fwprintf(message_stream, L"A compressed image cannot be written to standard output\n");
+                }
+                else if (opts.output_dsf || opts.output_iso || opts.output_sacdz || opts.output_dsdiff || opts.output_dsdiff_em || opts.export_cue_sheet)
                 {
                     output = scarletbook_output_create(handle, handle_status_update_track_callback, handle_status_update_progress_callback, safe_fwprintf);
-
-                    // select the channel area
-                    area_idx = ((has_multi_channel(handle) && opts.multi_channel) || !has_two_channel(handle)) ? handle->mulch_area_idx : handle->twoch_area_idx;
+                    scarletbook_output_set_recovery(output, opts.recover);
+                    scarletbook_output_set_worker_count(output, opts.jobs);
+                    scarletbook_output_set_parse_thread_count(output, opts.parse_threads);
+                    scarletbook_output_set_transfer_size(output, (uint32_t) max(opts.transfer_size, 0));
+                    scarletbook_output_set_single_pass(output, 
+                        opts.output_iso + opts.output_sacdz + opts.output_dsdiff_em + opts.output_dsf + opts.output_dsdiff > 1);
+                    scarletbook_output_set_area_stream(output, opts.area_stream);
+                    scarletbook_output_set_memory_limit(output, (size_t) max(opts.memory_limit, 0) * 1024 * 1024);
+                    if (opts.index_dir)
+                    {
+                        recursive_mkdir(opts.index_dir, 0774);
+                        if (scarletbook_output_set_index(output, opts.index_dir) != 0)
+                        {
+                            fwprintf(message_stream, L"Could not create the frame index\n");
+                        }
+                    }
+                    if (opts.metrics_fd >= 0)
+                    {
+                        metrics_stream = fdopen(opts.metrics_fd, "w");
+                        if (!metrics_stream)
+                        {
+                            fwprintf(message_stream, L"Could not open file descriptor %d for the metrics\n", opts.metrics_fd);
+                        }
+                    }
+                    if (opts.stats)
+                    {
+                        scarletbook_output_set_stats_callback(output, handle_status_update_stage_callback);
+                    }
 
                     albumdir = (strlen(opts.output_file) > 0 ? strdup(opts.output_file) : get_album_dir(handle));
 
+                    // a resumed rip writes to the same files, they are not made unique
+                    if (opts.resume)
+                    {
+                        file_path = make_filename(0, 0, albumdir, "journal");
+                        if (scarletbook_output_set_journal(output, file_path) != 0)
+                        {
+                            fwprintf(message_stream, L"Could not create the journal, the rip cannot be resumed\n");
+                        }
+                        free(file_path);
+                        file_path = 0;
+                    }
+
                     if (opts.output_iso)
                     {
                         uint32_t total_sectors = sacd_get_total_sectors(sacd_reader);
@@ -352,31 +659,75 @@ int main(int argc, char* argv[])
                                 total_sectors -= sector_size;
                             }
                             free(musicfilename);
+                            free(file_path);
+                            file_path = 0;
                         }
                         else
 #endif
                         {
-                            get_unique_filename(&albumdir, "iso");
-                            file_path = make_filename(0, 0, albumdir, "iso");
+                            if (!opts.resume && !opts.output_to_stdout)
+                                get_unique_filename(&albumdir, "iso");
+                            file_path = make_output_filename(0, albumdir, "iso");
                             scarletbook_output_enqueue_raw_sectors(output, 0, total_sectors, file_path, "iso");
+                            free(file_path);
+                            file_path = 0;
                         }
                     }
-                    else if (opts.output_dsdiff_em)
+                    if (opts.output_sacdz)
                     {
-                        get_unique_filename(&albumdir, "dff");
-                        file_path = make_filename(0, 0, albumdir, "dff");
-
-                        scarletbook_output_enqueue_track(output, area_idx, 0, file_path, "dsdiff_edit_master", 
-                            (opts.convert_dst ? 1 : handle->area[area_idx].area_toc->frame_format != FRAME_FORMAT_DST));
+                        if (!opts.resume && !opts.output_to_stdout)
+                            get_unique_filename(&albumdir, "sacdz");
+                        file_path = make_output_filename(0, albumdir, "sacdz");
+                        if (scarletbook_output_enqueue_raw_sectors(output, 0, sacd_get_total_sectors(sacd_reader), file_path, "sacdz") != 0)
+                        {
+                            fwprintf(message_stream, L"Compressed images are not supported by this build\n");
+                        }
+                        free(file_path);
+                        file_path = 0;
                     }
-                    else if (opts.output_dsf || opts.output_dsdiff)
+                    if (opts.output_dsf || opts.output_dsdiff)
                     {
                         // create the output folder
-                        get_unique_dir(0, &albumdir);
-                        recursive_mkdir(albumdir, 0774);
+                        if (!opts.output_to_stdout)
+                        {
+                            if (!opts.resume)
+                                get_unique_dir(0, &albumdir);
+                            recursive_mkdir(albumdir, 0774);
+                        }
+
+                        // a range is ripped instead of the tracks
+                        if (opts.range)
+                        {
+                            musicfilename = (char *) malloc(64);
+                            snprintf(musicfilename, 64, "Range %02d-%02d-%02d to %02d-%02d-%02d", 
+                                     opts.range_first_frame / SACD_FRAME_RATE / 60, opts.range_first_frame / SACD_FRAME_RATE % 60, opts.range_first_frame % SACD_FRAME_RATE,
+                                     opts.range_end_frame / SACD_FRAME_RATE / 60, opts.range_end_frame / SACD_FRAME_RATE % 60, opts.range_end_frame % SACD_FRAME_RATE);
+                            if (opts.output_dsf)
+                            {
+                                file_path = make_output_filename(albumdir, musicfilename, "dsf");
+                                if (scarletbook_output_enqueue_range(output, area_idx, opts.range_first_frame, opts.range_end_frame, file_path, "dsf", 1) != 0)
+                                {
+                                    fwprintf(message_stream, L"The range is not within the area\n");
+                                }
+                                free(file_path);
+                                file_path = 0;
+                            }
+                            if (opts.output_dsdiff)
+                            {
+                                file_path = make_output_filename(albumdir, musicfilename, "dff");
+                                if (scarletbook_output_enqueue_range(output, area_idx, opts.range_first_frame, opts.range_end_frame, file_path, "dsdiff", 
+                                    (opts.convert_dst ? 1 : handle->area[area_idx].area_toc->frame_format != FRAME_FORMAT_DST)) != 0)
+                                {
+                                    fwprintf(message_stream, L"The range is not within the area\n");
+                                }
+                                free(file_path);
+                                file_path = 0;
+                            }
+                            free(musicfilename);
+                        }
 
                         // fill the queue with items to rip
-                        for (i = 0; i < handle->area[area_idx].area_toc->track_count; i++) 
+                        for (i = 0; i < handle->area[area_idx].area_toc->track_count && !opts.range; i++) 
                         {
                             if (opts.select_tracks && opts.selected_tracks[i] == 0)
                                 continue;
@@ -385,22 +736,33 @@ int main(int argc, char* argv[])
 
                             if (opts.output_dsf)
                             {
-                                file_path = make_filename(0, albumdir, musicfilename, "dsf");
+                                file_path = make_output_filename(albumdir, musicfilename, "dsf");
                                 scarletbook_output_enqueue_track(output, area_idx, i, file_path, "dsf", 
                                     1 /* always decode to DSD */);
+                                free(file_path);
+                                file_path = 0;
                             }
-                            else if (opts.output_dsdiff)
+                            if (opts.output_dsdiff)
                             {
-                                file_path = make_filename(0, albumdir, musicfilename, "dff");
+                                file_path = make_output_filename(albumdir, musicfilename, "dff");
                                 scarletbook_output_enqueue_track(output, area_idx, i, file_path, "dsdiff", 
                                     (opts.convert_dst ? 1 : handle->area[area_idx].area_toc->frame_format != FRAME_FORMAT_DST));
+                                free(file_path);
+                                file_path = 0;
                             }
 
                             free(musicfilename);
-                            free(file_path);
-                            file_path = 0;
                         }
                     }
+                    if (opts.output_dsdiff_em)
+                    {
+                        if (!opts.resume && !opts.output_to_stdout)
+                            get_unique_filename(&albumdir, "dff");
+                        file_path = make_output_filename(0, albumdir, "dff");
+
+                        scarletbook_output_enqueue_track(output, area_idx, 0, file_path, "dsdiff_edit_master", 
+                            (opts.convert_dst ? 1 : handle->area[area_idx].area_toc->frame_format != FRAME_FORMAT_DST));
+                    }
 
                     if (opts.export_cue_sheet)
                     {
@@ -410,7 +772,7 @@ int main(int argc, char* argv[])
 #else
                         wchar_t *wide_filename = (wchar_t *) charset_convert(cue_file_path, strlen(cue_file_path), "UTF-8", "WCHAR_T");
 #endif
-                        fwprintf(stdout, L"Exporting CUE sheet [%ls]\n", wide_filename);
+                        fwprintf(message_stream, L"Exporting CUE sheet [%ls]\n", wide_filename);
                         if (!file_path)
                             file_path = make_filename(0, 0, albumdir, "dff");
                         write_cue_sheet(handle, file_path, area_idx, cue_file_path);
@@ -421,10 +783,28 @@ int main(int argc, char* argv[])
                     free(file_path);
 
                     started_processing = time(0);
-                    scarletbook_output_start(output);
-                    scarletbook_output_destroy(output);
+                    started_stage_timing = timeout_gettime();
+                    if (scarletbook_output_start(output) == 0 && metrics_stream)
+                    {
+                        join(launch(metrics_thread, 0));
+                    }
+                    if (scarletbook_output_destroy(output) != 0)
+                    {
+                        exit_code = 1;
+                    }
+
+                    if (metrics_stream)
+                    {
+                        fclose(metrics_stream);
+                        metrics_stream = 0;
+                    }
+
+                    fwprintf(message_stream, L"\rWe are done..                                                          \n");
 
-                    fprintf(stdout, "\rWe are done..                                                          \n");
+                    if (opts.stats)
+                    {
+                        print_stage_stats();
+                    }
                 }
                 scarletbook_close(handle);
 
@@ -434,12 +814,16 @@ int main(int argc, char* argv[])
 
         sacd_close(sacd_reader);
 
+        // the audio written to stdout is not followed by text
+        if (!opts.output_to_stdout)
+        {
 #ifndef _WIN32
-        freopen(0, "w", stdout);
+            freopen(0, "w", stdout);
 #endif
-        if (fwide(stdout, -1) >= 0)
-        {
-            fprintf(stderr, "ERROR: Output not set to byte oriented.\n");
+            if (fwide(stdout, -1) >= 0)
+            {
+                fprintf(stderr, "ERROR: Output not set to byte oriented.\n");
+            }
         }
     }
 
@@ -451,6 +835,7 @@ int main(int argc, char* argv[])
     pthread_win32_thread_detach_np();
 #endif
 
-    printf("\n");
-    return 0;
+    if (!opts.output_to_stdout)
+        printf("\n");
+    return exit_code;
 }